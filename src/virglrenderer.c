@@ -34,18 +34,18 @@
 #include "pipe/p_state.h"
 #include "util/u_format.h"
 #include "util/u_math.h"
+#include "util/u_memory.h"
 #include "vrend_renderer.h"
+#include "os/os_thread.h"
 
 #include "virglrenderer.h"
 
 #ifdef HAVE_EPOXY_EGL_H
 #include "virgl_egl.h"
-static struct virgl_egl *egl_info;
 #endif
 
 #ifdef HAVE_EPOXY_GLX_H
 #include "virgl_glx.h"
-static struct virgl_glx *glx_info;
 #endif
 
 enum {
@@ -54,17 +54,287 @@ enum {
    CONTEXT_GLX
 };
 
-static int use_context = CONTEXT_NONE;
+/* Command buffers and fences go to a render thread, which executes them
+ * while the caller moves on. Polls are queued as well, and the fences they
+ * find are handed back on the next poll. Any other call first waits for
+ * the thread to go idle and takes the GL contexts back, since a context can
+ * only be current in one thread at a time.
+ */
+enum virgl_render_job_type {
+   RENDER_JOB_SUBMIT,
+   RENDER_JOB_FENCE,
+   RENDER_JOB_POLL,
+};
+
+struct virgl_render_job {
+   struct list_head head;
+   enum virgl_render_job_type type;
+   uint32_t ctx_id;
+   uint32_t fence_id;
+   int ndw;
+   uint32_t buf[];
+};
+
+/* a fence signalled while the render thread polled, reported to the
+ * caller from its own thread */
+struct virgl_fence_report {
+   struct list_head head;
+   uint32_t ctx_id;
+   uint32_t fence_id;
+   bool ctx_fence;
+};
+
+struct virgl_render_thread {
+   pipe_thread thread;
+   pipe_mutex mutex;
+   pipe_condvar cond;
+   pipe_condvar idle_cond;
+   struct list_head jobs;
+   struct list_head reports;
+   struct vrend_instance *instance;
+   /* the render thread has the GL contexts */
+   bool busy;
+   bool stop;
+   bool poll_queued;
+   /* only touched by the render thread */
+   bool polling;
+   bool reported;
+   /* the caller has the GL contexts, only touched by the caller */
+   bool caller_current;
+};
+
+static void virgl_render_job_run(struct virgl_render_thread *rt,
+                                 struct virgl_render_job *job)
+{
+   int ret;
+
+   switch (job->type) {
+   case RENDER_JOB_SUBMIT:
+      ret = vrend_decode_block(job->ctx_id, job->buf, job->ndw);
+      if (ret)
+         fprintf(stderr, "failed to decode commands of context %u: %d\n",
+                 job->ctx_id, ret);
+      break;
+   case RENDER_JOB_FENCE:
+      vrend_renderer_create_fence(job->fence_id, job->ctx_id);
+      break;
+   case RENDER_JOB_POLL:
+      rt->polling = true;
+      rt->reported = false;
+      vrend_renderer_check_queries();
+      vrend_renderer_check_fences();
+      rt->polling = false;
+      /* the fences go out with the next poll, wake up who waits for it */
+      if (rt->reported)
+         vrend_renderer_signal_poll_fd();
+      break;
+   }
+}
+
+static int virgl_render_thread_main(void *arg)
+{
+   struct virgl_render_thread *rt = arg;
+   struct virgl_render_job *job;
+   bool acquire;
+
+   vrend_instance = rt->instance;
+
+   pipe_mutex_lock(rt->mutex);
+   while (true) {
+      if (LIST_IS_EMPTY(&rt->jobs)) {
+         if (rt->busy) {
+            pipe_mutex_unlock(rt->mutex);
+            vrend_renderer_release_current();
+            pipe_mutex_lock(rt->mutex);
+            rt->busy = false;
+            pipe_condvar_broadcast(rt->idle_cond);
+            continue;
+         }
+         if (rt->stop)
+            break;
+         pipe_condvar_wait(rt->cond, rt->mutex);
+         continue;
+      }
+
+      job = LIST_ENTRY(struct virgl_render_job, rt->jobs.next, head);
+      list_del(&job->head);
+      if (job->type == RENDER_JOB_POLL)
+         rt->poll_queued = false;
+      acquire = !rt->busy;
+      rt->busy = true;
+      pipe_mutex_unlock(rt->mutex);
+
+      if (acquire)
+         vrend_renderer_force_ctx_0();
+      virgl_render_job_run(rt, job);
+      FREE(job);
+
+      pipe_mutex_lock(rt->mutex);
+   }
+   pipe_mutex_unlock(rt->mutex);
+   return 0;
+}
+
+/* waits for the queued jobs, so the caller can use the renderer */
+static void virgl_render_thread_sync(void)
+{
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+
+   if (!rt || rt->caller_current)
+      return;
+
+   pipe_mutex_lock(rt->mutex);
+   while (rt->busy || !LIST_IS_EMPTY(&rt->jobs))
+      pipe_condvar_wait(rt->idle_cond, rt->mutex);
+   pipe_mutex_unlock(rt->mutex);
+
+   vrend_renderer_force_ctx_0();
+   rt->caller_current = true;
+}
+
+static void virgl_render_thread_queue(struct virgl_render_thread *rt,
+                                      struct virgl_render_job *job)
+{
+   if (rt->caller_current) {
+      vrend_renderer_release_current();
+      rt->caller_current = false;
+   }
+
+   pipe_mutex_lock(rt->mutex);
+   list_addtail(&job->head, &rt->jobs);
+   pipe_condvar_signal(rt->cond);
+   pipe_mutex_unlock(rt->mutex);
+}
+
+/* Has the render thread check fences and queries once it gets through the
+ * jobs queued so far, and hands out what it found on earlier checks. */
+static void virgl_render_thread_poll(struct virgl_render_thread *rt,
+                                     struct list_head *reports)
+{
+   struct virgl_render_job *job = NULL;
+
+   if (!rt->caller_current) {
+      job = CALLOC_STRUCT(virgl_render_job);
+      if (job)
+         job->type = RENDER_JOB_POLL;
+   }
+
+   pipe_mutex_lock(rt->mutex);
+   if (job && !rt->poll_queued) {
+      list_addtail(&job->head, &rt->jobs);
+      rt->poll_queued = true;
+      pipe_condvar_signal(rt->cond);
+      job = NULL;
+   }
+   if (LIST_IS_EMPTY(&rt->reports)) {
+      list_inithead(reports);
+   } else {
+      list_replace(&rt->reports, reports);
+      list_inithead(&rt->reports);
+   }
+   pipe_mutex_unlock(rt->mutex);
+
+   FREE(job);
+}
+
+static void virgl_render_thread_report(struct virgl_render_thread *rt,
+                                       uint32_t ctx_id, uint32_t fence_id,
+                                       bool ctx_fence)
+{
+   struct virgl_fence_report *report = CALLOC_STRUCT(virgl_fence_report);
+
+   if (!report) {
+      fprintf(stderr, "failed to report fence %u\n", fence_id);
+      return;
+   }
+   report->ctx_id = ctx_id;
+   report->fence_id = fence_id;
+   report->ctx_fence = ctx_fence;
+
+   pipe_mutex_lock(rt->mutex);
+   list_addtail(&report->head, &rt->reports);
+   pipe_mutex_unlock(rt->mutex);
+   rt->reported = true;
+}
+
+static void virgl_render_thread_init(void)
+{
+   struct virgl_render_thread *rt = CALLOC_STRUCT(virgl_render_thread);
+
+   if (!rt)
+      return;
+
+   list_inithead(&rt->jobs);
+   list_inithead(&rt->reports);
+   rt->instance = vrend_instance;
+   /* the renderer comes out of init with context 0 current */
+   rt->caller_current = true;
+   pipe_mutex_init(rt->mutex);
+   pipe_condvar_init(rt->cond);
+   pipe_condvar_init(rt->idle_cond);
+
+   rt->thread = pipe_thread_create(virgl_render_thread_main, rt);
+   if (!rt->thread) {
+      fprintf(stderr, "failed to create render thread\n");
+      pipe_condvar_destroy(rt->idle_cond);
+      pipe_condvar_destroy(rt->cond);
+      pipe_mutex_destroy(rt->mutex);
+      FREE(rt);
+      return;
+   }
+   vrend_instance->render_thread = rt;
+}
+
+static void virgl_render_thread_fini(void)
+{
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+   struct virgl_fence_report *report, *tmp;
+
+   if (!rt)
+      return;
+
+   virgl_render_thread_sync();
+
+   pipe_mutex_lock(rt->mutex);
+   rt->stop = true;
+   pipe_condvar_signal(rt->cond);
+   pipe_mutex_unlock(rt->mutex);
+   pipe_thread_wait(rt->thread);
+
+   LIST_FOR_EACH_ENTRY_SAFE(report, tmp, &rt->reports, head)
+      FREE(report);
+
+   pipe_condvar_destroy(rt->idle_cond);
+   pipe_condvar_destroy(rt->cond);
+   pipe_mutex_destroy(rt->mutex);
+   FREE(rt);
+   vrend_instance->render_thread = NULL;
+}
+
+/* A thread that didn't call virgl_renderer_init only has the read-only
+ * null instance, so its calls are turned away. */
+static bool virgl_renderer_initialised(void)
+{
+   return vrend_instance->rcbs != NULL;
+}
 
 /* new API - just wrap internal API for now */
 
 int virgl_renderer_resource_create(struct virgl_renderer_resource_create_args *args, struct iovec *iov, uint32_t num_iovs)
 {
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
    return vrend_renderer_resource_create((struct vrend_renderer_resource_create_args *)args, iov, num_iovs, NULL);
 }
 
 int virgl_renderer_resource_import_eglimage(struct virgl_renderer_resource_create_args *args, void *image)
 {
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
 #ifdef HAVE_EPOXY_EGL_H
    return vrend_renderer_resource_create((struct vrend_renderer_resource_create_args *)args, 0, 0, image);
 #else
@@ -74,22 +344,38 @@ int virgl_renderer_resource_import_eglimage(struct virgl_renderer_resource_creat
 
 void virgl_renderer_resource_unref(uint32_t res_handle)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_resource_unref(res_handle);
 }
 
 void virgl_renderer_fill_caps(uint32_t set, uint32_t version,
                               void *caps)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_fill_caps(set, version, (union virgl_caps *)caps);
 }
 
 int virgl_renderer_context_create(uint32_t handle, uint32_t nlen, const char *name)
 {
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
    return vrend_renderer_context_create(handle, nlen, name);
 }
 
 void virgl_renderer_context_destroy(uint32_t handle)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_context_destroy(handle);
 }
 
@@ -97,7 +383,25 @@ int virgl_renderer_submit_cmd(void *buffer,
                               int ctx_id,
                               int ndw)
 {
-   return vrend_decode_block(ctx_id, buffer, ndw);
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+   struct virgl_render_job *job;
+
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   if (!rt || ndw <= 0)
+      return vrend_decode_block(ctx_id, buffer, ndw);
+
+   /* the caller may reuse the buffer as soon as we return */
+   job = MALLOC(sizeof(*job) + ndw * sizeof(uint32_t));
+   if (!job)
+      return ENOMEM;
+   job->type = RENDER_JOB_SUBMIT;
+   job->ctx_id = ctx_id;
+   job->ndw = ndw;
+   memcpy(job->buf, buffer, ndw * sizeof(uint32_t));
+   virgl_render_thread_queue(rt, job);
+   return 0;
 }
 
 int virgl_renderer_transfer_write_iov(uint32_t handle,
@@ -112,6 +416,11 @@ int virgl_renderer_transfer_write_iov(uint32_t handle,
 {
    struct vrend_transfer_info transfer_info;
 
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
+
    transfer_info.handle = handle;
    transfer_info.ctx_id = ctx_id;
    transfer_info.level = level;
@@ -134,6 +443,11 @@ int virgl_renderer_transfer_read_iov(uint32_t handle, uint32_t ctx_id,
 {
    struct vrend_transfer_info transfer_info;
 
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
+
    transfer_info.handle = handle;
    transfer_info.ctx_id = ctx_id;
    transfer_info.level = level;
@@ -150,42 +464,101 @@ int virgl_renderer_transfer_read_iov(uint32_t handle, uint32_t ctx_id,
 int virgl_renderer_resource_attach_iov(int res_handle, struct iovec *iov,
                                        int num_iovs)
 {
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
    return vrend_renderer_resource_attach_iov(res_handle, iov, num_iovs);
 }
 
 void virgl_renderer_resource_detach_iov(int res_handle, struct iovec **iov_p, int *num_iovs_p)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    return vrend_renderer_resource_detach_iov(res_handle, iov_p, num_iovs_p);
 }
 
 int virgl_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
 {
-   return vrend_renderer_create_fence(client_fence_id, ctx_id);
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+   struct virgl_render_job *job;
+
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   if (!rt)
+      return vrend_renderer_create_fence(client_fence_id, ctx_id);
+
+   job = CALLOC_STRUCT(virgl_render_job);
+   if (!job)
+      return ENOMEM;
+   job->type = RENDER_JOB_FENCE;
+   job->ctx_id = ctx_id;
+   job->fence_id = client_fence_id;
+   virgl_render_thread_queue(rt, job);
+   return 0;
 }
 
 void virgl_renderer_force_ctx_0(void)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_force_ctx_0();
 }
 
 void virgl_renderer_ctx_attach_resource(int ctx_id, int res_handle)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_attach_res_ctx(ctx_id, res_handle);
 }
 
 void virgl_renderer_ctx_detach_resource(int ctx_id, int res_handle)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_detach_res_ctx(ctx_id, res_handle);
 }
 
+void virgl_renderer_set_mem_budget(uint64_t budget)
+{
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
+   vrend_renderer_set_mem_budget(budget);
+}
+
+int virgl_renderer_get_mem_usage(int ctx_id, uint64_t *ctx_bytes, uint64_t *total_bytes)
+{
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
+   return vrend_renderer_get_mem_usage(ctx_id, ctx_bytes, total_bytes);
+}
+
 int virgl_renderer_resource_get_info(int res_handle,
                                      struct virgl_renderer_resource_info *info)
 {
    int ret;
+
+   if (!virgl_renderer_initialised())
+      return EINVAL;
+
+   virgl_render_thread_sync();
    ret = vrend_renderer_resource_get_info(res_handle, (struct vrend_renderer_resource_info *)info);
 #ifdef HAVE_EPOXY_EGL_H
-   if (ret == 0 && use_context == CONTEXT_EGL)
-      return virgl_egl_get_fourcc_for_texture(egl_info, info->tex_id, info->virgl_format, &info->drm_fourcc);
+   if (ret == 0 && vrend_instance->use_context == CONTEXT_EGL)
+      return virgl_egl_get_fourcc_for_texture(vrend_instance->egl_info, info->tex_id, info->virgl_format, &info->drm_fourcc);
 #endif
 
    return ret;
@@ -200,19 +573,36 @@ void virgl_renderer_get_cap_set(uint32_t cap_set, uint32_t *max_ver,
 void virgl_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int num_iovs,
                              uint32_t offset, int x, int y, int width, int height)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_get_rect(resource_id, iov, num_iovs, offset, x, y, width, height);
 }
 
 
-static struct virgl_renderer_callbacks *rcbs;
-
-static void *dev_cookie;
-
 static struct vrend_if_cbs virgl_cbs;
 
 static void virgl_write_fence(uint32_t fence_id)
 {
-   rcbs->write_fence(dev_cookie, fence_id);
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+
+   if (rt && rt->polling) {
+      virgl_render_thread_report(rt, 0, fence_id, false);
+      return;
+   }
+   vrend_instance->rcbs->write_fence(vrend_instance->dev_cookie, fence_id);
+}
+
+static void virgl_write_context_fence(uint32_t ctx_id, uint32_t fence_id)
+{
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+
+   if (rt && rt->polling) {
+      virgl_render_thread_report(rt, ctx_id, fence_id, true);
+      return;
+   }
+   vrend_instance->rcbs->write_context_fence(vrend_instance->dev_cookie, ctx_id, fence_id);
 }
 
 static virgl_renderer_gl_context create_gl_context(int scanout_idx, struct virgl_gl_ctx_param *param)
@@ -220,44 +610,44 @@ static virgl_renderer_gl_context create_gl_context(int scanout_idx, struct virgl
    struct virgl_renderer_gl_ctx_param vparam;
 
 #ifdef HAVE_EPOXY_EGL_H
-   if (use_context == CONTEXT_EGL)
-      return virgl_egl_create_context(egl_info, param);
+   if (vrend_instance->use_context == CONTEXT_EGL)
+      return virgl_egl_create_context(vrend_instance->egl_info, param);
 #endif
 #ifdef HAVE_EPOXY_GLX_H
-   if (use_context == CONTEXT_GLX)
-      return virgl_glx_create_context(glx_info, param);
+   if (vrend_instance->use_context == CONTEXT_GLX)
+      return virgl_glx_create_context(vrend_instance->glx_info, param);
 #endif
    vparam.version = 1;
    vparam.shared = param->shared;
    vparam.major_ver = param->major_ver;
    vparam.minor_ver = param->minor_ver;
-   return rcbs->create_gl_context(dev_cookie, scanout_idx, &vparam);
+   return vrend_instance->rcbs->create_gl_context(vrend_instance->dev_cookie, scanout_idx, &vparam);
 }
 
 static void destroy_gl_context(virgl_renderer_gl_context ctx)
 {
 #ifdef HAVE_EPOXY_EGL_H
-   if (use_context == CONTEXT_EGL)
-      return virgl_egl_destroy_context(egl_info, ctx);
+   if (vrend_instance->use_context == CONTEXT_EGL)
+      return virgl_egl_destroy_context(vrend_instance->egl_info, ctx);
 #endif
 #ifdef HAVE_EPOXY_GLX_H
-   if (use_context == CONTEXT_GLX)
-      return virgl_glx_destroy_context(glx_info, ctx);
+   if (vrend_instance->use_context == CONTEXT_GLX)
+      return virgl_glx_destroy_context(vrend_instance->glx_info, ctx);
 #endif
-   return rcbs->destroy_gl_context(dev_cookie, ctx);
+   return vrend_instance->rcbs->destroy_gl_context(vrend_instance->dev_cookie, ctx);
 }
 
 static int make_current(int scanout_idx, virgl_renderer_gl_context ctx)
 {
 #ifdef HAVE_EPOXY_EGL_H
-   if (use_context == CONTEXT_EGL)
-      return virgl_egl_make_context_current(egl_info, ctx);
+   if (vrend_instance->use_context == CONTEXT_EGL)
+      return virgl_egl_make_context_current(vrend_instance->egl_info, ctx);
 #endif
 #ifdef HAVE_EPOXY_GLX_H
-   if (use_context == CONTEXT_GLX)
-      return virgl_glx_make_context_current(glx_info, ctx);
+   if (vrend_instance->use_context == CONTEXT_GLX)
+      return virgl_glx_make_context_current(vrend_instance->glx_info, ctx);
 #endif
-   return rcbs->make_current(dev_cookie, scanout_idx, ctx);
+   return vrend_instance->rcbs->make_current(vrend_instance->dev_cookie, scanout_idx, ctx);
 }
 
 static struct vrend_if_cbs virgl_cbs = {
@@ -265,49 +655,84 @@ static struct vrend_if_cbs virgl_cbs = {
    create_gl_context,
    destroy_gl_context,
    make_current,
+   virgl_write_context_fence,
 };
 
 void *virgl_renderer_get_cursor_data(uint32_t resource_id, uint32_t *width, uint32_t *height)
 {
+   if (!virgl_renderer_initialised())
+      return NULL;
+
+   virgl_render_thread_sync();
    return vrend_renderer_get_cursor_contents(resource_id, width, height);
 }
 
+/* doesn't wait for the render thread, fences it retires are reported on
+ * a later poll */
 void virgl_renderer_poll(void)
 {
+   struct virgl_render_thread *rt = vrend_instance->render_thread;
+   struct virgl_fence_report *report, *tmp;
+   struct list_head reports;
+
+   if (!virgl_renderer_initialised())
+      return;
+
+   if (rt) {
+      virgl_render_thread_poll(rt, &reports);
+      LIST_FOR_EACH_ENTRY_SAFE(report, tmp, &reports, head) {
+         if (report->ctx_fence)
+            virgl_write_context_fence(report->ctx_id, report->fence_id);
+         else
+            virgl_write_fence(report->fence_id);
+         FREE(report);
+      }
+      if (!rt->caller_current)
+         return;
+   }
+
    vrend_renderer_check_queries();
    vrend_renderer_check_fences();
 }
 
 void virgl_renderer_cleanup(UNUSED void *cookie)
 {
+   virgl_render_thread_fini();
    vrend_renderer_fini();
 #ifdef HAVE_EPOXY_EGL_H
-   if (use_context == CONTEXT_EGL) {
-      virgl_egl_destroy(egl_info);
-      egl_info = NULL;
-      use_context = CONTEXT_NONE;
+   if (vrend_instance->use_context == CONTEXT_EGL) {
+      virgl_egl_destroy(vrend_instance->egl_info);
+      vrend_instance->egl_info = NULL;
+      vrend_instance->use_context = CONTEXT_NONE;
    }
 #endif
 #ifdef HAVE_EPOXY_GLX_H
-   if (use_context == CONTEXT_GLX) {
-      virgl_glx_destroy(glx_info);
-      glx_info = NULL;
-      use_context = CONTEXT_NONE;
+   if (vrend_instance->use_context == CONTEXT_GLX) {
+      virgl_glx_destroy(vrend_instance->glx_info);
+      vrend_instance->glx_info = NULL;
+      vrend_instance->use_context = CONTEXT_NONE;
    }
 #endif
+   vrend_renderer_destroy_instance();
 }
 
 int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cbs)
 {
    uint32_t renderer_flags = 0;
+   int ret;
+
    if (!cookie || !cbs)
       return -1;
 
    if (cbs->version < 1 || cbs->version > VIRGL_RENDERER_CALLBACKS_VERSION)
       return -1;
 
-   dev_cookie = cookie;
-   rcbs = cbs;
+   /* each thread drives its own renderer */
+   if (vrend_renderer_create_instance())
+      return -1;
+
+   vrend_instance->dev_cookie = cookie;
+   vrend_instance->rcbs = cbs;
 
    if (flags & VIRGL_RENDERER_USE_EGL) {
 #ifdef HAVE_EPOXY_EGL_H
@@ -315,37 +740,53 @@ int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks
       if (cbs->version >= 2 && cbs->get_drm_fd) {
          fd = cbs->get_drm_fd(cookie);
       }
-      egl_info = virgl_egl_init(fd, flags & VIRGL_RENDERER_USE_SURFACELESS,
+      vrend_instance->egl_info = virgl_egl_init(fd, flags & VIRGL_RENDERER_USE_SURFACELESS,
                                     flags & VIRGL_RENDERER_USE_GLES);
-      if (!egl_info)
-         return -1;
-      use_context = CONTEXT_EGL;
+      if (!vrend_instance->egl_info)
+         goto fail;
+      vrend_instance->use_context = CONTEXT_EGL;
 #else
       fprintf(stderr, "EGL is not supported on this platform\n");
-      return -1;
+      goto fail;
 #endif
    } else if (flags & VIRGL_RENDERER_USE_GLX) {
 #ifdef HAVE_EPOXY_GLX_H
-      glx_info = virgl_glx_init();
-      if (!glx_info)
-         return -1;
-      use_context = CONTEXT_GLX;
+      vrend_instance->glx_info = virgl_glx_init();
+      if (!vrend_instance->glx_info)
+         goto fail;
+      vrend_instance->use_context = CONTEXT_GLX;
 #else
       fprintf(stderr, "GLX is not supported on this platform\n");
-      return -1;
+      goto fail;
 #endif
    }
 
    if (flags & VIRGL_RENDERER_THREAD_SYNC)
       renderer_flags |= VREND_USE_THREAD_SYNC;
-
-   return vrend_renderer_init(&virgl_cbs, renderer_flags);
+   if (cbs->version >= 3 && cbs->write_context_fence)
+      renderer_flags |= VREND_USE_CTX_FENCES;
+
+   ret = vrend_renderer_init(&virgl_cbs, renderer_flags);
+   if (ret)
+      goto fail;
+   if (flags & VIRGL_RENDERER_THREAD_SUBMIT)
+      virgl_render_thread_init();
+   return 0;
+
+ fail:
+   /* don't leave a half set up instance behind for the next init */
+   virgl_renderer_cleanup(cookie);
+   return -1;
 }
 
 int virgl_renderer_get_fd_for_texture(uint32_t tex_id, int *fd)
 {
+   if (!virgl_renderer_initialised())
+      return -1;
+
+   virgl_render_thread_sync();
 #ifdef HAVE_EPOXY_EGL_H
-   return virgl_egl_get_fd_for_texture(egl_info, tex_id, fd);
+   return virgl_egl_get_fd_for_texture(vrend_instance->egl_info, tex_id, fd);
 #else
    return -1;
 #endif
@@ -353,8 +794,12 @@ int virgl_renderer_get_fd_for_texture(uint32_t tex_id, int *fd)
 
 int virgl_renderer_get_fd_for_texture2(uint32_t tex_id, int *fd, int *stride, int *offset)
 {
+   if (!virgl_renderer_initialised())
+      return -1;
+
+   virgl_render_thread_sync();
 #ifdef HAVE_EPOXY_EGL_H
-   return virgl_egl_get_fd_for_texture2(egl_info, tex_id, fd, stride, offset);
+   return virgl_egl_get_fd_for_texture2(vrend_instance->egl_info, tex_id, fd, stride, offset);
 #else
    return -1;
 #endif
@@ -362,6 +807,10 @@ int virgl_renderer_get_fd_for_texture2(uint32_t tex_id, int *fd, int *stride, in
 
 void virgl_renderer_reset(void)
 {
+   if (!virgl_renderer_initialised())
+      return;
+
+   virgl_render_thread_sync();
    vrend_renderer_reset();
 }
 
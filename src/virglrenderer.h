@@ -44,7 +44,7 @@ struct virgl_renderer_gl_ctx_param {
    int minor_ver;
 };
 
-#define VIRGL_RENDERER_CALLBACKS_VERSION 2
+#define VIRGL_RENDERER_CALLBACKS_VERSION 3
 
 struct virgl_renderer_callbacks {
    int version;
@@ -56,6 +56,13 @@ struct virgl_renderer_callbacks {
    int (*make_current)(void *cookie, int scanout_idx, virgl_renderer_gl_context ctx);
 
    int (*get_drm_fd)(void *cookie); /* v2, used with flags & VIRGL_RENDERER_USE_EGL */
+
+   /*
+    * v3, optional. When set, the fences created for a context other than 0
+    * are signalled in order per context through this callback instead of
+    * write_fence, so contexts don't wait on each other's fences.
+    */
+   void (*write_context_fence)(void *cookie, uint32_t ctx_id, uint32_t fence_id);
 };
 
 /* virtio-gpu compatible interface */
@@ -68,7 +75,24 @@ struct virgl_renderer_callbacks {
 #define VIRGL_RENDERER_USE_GLX (1 << 2)
 #define VIRGL_RENDERER_USE_SURFACELESS (1 << 3)
 #define VIRGL_RENDERER_USE_GLES (1 << 4)
+/*
+ * Run command buffers and fences on a render thread, so that
+ * virgl_renderer_submit_cmd returns before they are executed.
+ * virgl_renderer_poll doesn't wait either, it reports the fences the
+ * render thread found signalled since the previous poll. With
+ * VIRGL_RENDERER_THREAD_SYNC the poll fd becomes readable again once the
+ * render thread has found some. All other calls wait for the queued work
+ * first.
+ */
+#define VIRGL_RENDERER_THREAD_SUBMIT (1 << 5)
 
+/*
+ * The renderer belongs to the thread that called virgl_renderer_init, all
+ * other calls have to be made from that thread. Calls from any other thread
+ * fail or do nothing, until it calls virgl_renderer_init itself to get a
+ * renderer of its own. On failure nothing is left behind, so init
+ * can simply be retried.
+ */
 VIRGL_EXPORT int virgl_renderer_init(void *cookie, int flags, struct virgl_renderer_callbacks *cb);
 VIRGL_EXPORT void virgl_renderer_poll(void); /* force fences */
 
@@ -156,6 +180,14 @@ VIRGL_EXPORT void virgl_renderer_force_ctx_0(void);
 VIRGL_EXPORT void virgl_renderer_ctx_attach_resource(int ctx_id, int res_handle);
 VIRGL_EXPORT void virgl_renderer_ctx_detach_resource(int ctx_id, int res_handle);
 
+/*
+ * Estimated GL memory of the resources attached to a context and of all
+ * resources that weren't evicted. With a non-zero budget, idle resources whose contents
+ * can be re-uploaded from their backing get their GL storage dropped.
+ */
+VIRGL_EXPORT int virgl_renderer_get_mem_usage(int ctx_id, uint64_t *ctx_bytes, uint64_t *total_bytes);
+VIRGL_EXPORT void virgl_renderer_set_mem_budget(uint64_t budget);
+
 /* return information about a resource */
 
 struct virgl_renderer_resource_info {
@@ -36,6 +36,7 @@
 #include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_dual_blend.h"
+#include "util/u_hash_table.h"
 
 #include "util/u_double_list.h"
 #include "util/u_format.h"
@@ -51,21 +52,15 @@
 
 #define DEST_SWIZZLE_SNIPPET_SIZE 64
 
+/* only objects that are shared between GL contexts live here, the blit
+ * runs in the context of the caller, with its vertex array and framebuffer */
 struct vrend_blitter_ctx {
-   virgl_gl_context gl_context;
    bool initialised;
    bool use_gles;
-   int framebuffer_srgb_enabled;
-
-   GLuint vaoid;
 
    GLuint vs;
    GLuint vs_pos_only;
-   GLuint fs_texfetch_col[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_depth[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_depth_msaa[PIPE_MAX_TEXTURE_TYPES];
-   GLuint fs_texfetch_col_swizzle;
-   GLuint fb_id;
+   struct util_hash_table *prog_cache;
 
    unsigned dst_width;
    unsigned dst_height;
@@ -74,7 +69,29 @@ struct vrend_blitter_ctx {
    GLfloat vertices[4][2][4];   /**< {pos, color} or {pos, texcoord} */
 };
 
-static struct vrend_blitter_ctx vrend_blit_ctx;
+static struct vrend_blitter_ctx *vrend_blitter_get_ctx(void)
+{
+   if (!vrend_instance->blit_ctx)
+      vrend_instance->blit_ctx = CALLOC_STRUCT(vrend_blitter_ctx);
+   return vrend_instance->blit_ctx;
+}
+
+struct blit_prog_key {
+   uint8_t write_depth;
+   uint8_t tgsi_tex_target;
+   uint8_t tgsi_ret;
+   uint8_t nr_samples;
+   uint8_t has_swizzle;
+   uint8_t swizzle[4];
+};
+
+/* linked blit programs, keyed by everything that goes into the shaders */
+struct blit_prog {
+   struct blit_prog_key key;
+   GLuint id;
+   GLint pos_loc;
+   GLint tc_loc;
+};
 
 struct vrend_blitter_point {
     int x;
@@ -360,111 +377,143 @@ static GLuint blit_build_frag_blit_msaa_depth(struct vrend_blitter_ctx *blit_ctx
    return fs_id;
 }
 
-static GLuint blit_get_frag_tex_writedepth(struct vrend_blitter_ctx *blit_ctx, int pipe_tex_target, unsigned nr_samples)
+static unsigned blit_prog_hash(void *key)
 {
-   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
+   const uint8_t *bytes = key;
+   unsigned hash = 2166136261u;
+   uint32_t i;
 
-   if (nr_samples > 1) {
-      GLuint *shader = &blit_ctx->fs_texfetch_depth_msaa[pipe_tex_target];
+   for (i = 0; i < sizeof(struct blit_prog_key); i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
+   return hash;
+}
 
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, nr_samples);
+static int blit_prog_compare(void *key1, void *key2)
+{
+   return memcmp(key1, key2, sizeof(struct blit_prog_key));
+}
 
-         *shader = blit_build_frag_blit_msaa_depth(blit_ctx, tgsi_tex);
-      }
-      return *shader;
+static void blit_prog_free(void *value)
+{
+   struct blit_prog *prog = value;
 
-   } else {
-      GLuint *shader = &blit_ctx->fs_texfetch_depth[pipe_tex_target];
+   glDeleteProgram(prog->id);
+   FREE(prog);
+}
 
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, 0);
+static void blit_prog_key_init(struct blit_prog_key *key,
+                               bool write_depth,
+                               int pipe_tex_target,
+                               unsigned nr_samples,
+                               const struct vrend_format_table *src_entry,
+                               const struct vrend_format_table *dst_entry)
+{
+   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
 
-         *shader = blit_build_frag_tex_writedepth(blit_ctx, tgsi_tex);
-      }
-      return *shader;
+   memset(key, 0, sizeof(*key));
+   if (nr_samples <= 1)
+      nr_samples = 0;
+   key->write_depth = write_depth;
+   key->tgsi_tex_target = util_pipe_tex_to_tgsi_tex(pipe_tex_target, nr_samples);
+   key->nr_samples = MAX2(nr_samples, 1);
+   if (write_depth)
+      return;
+
+   key->tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   if (dst_entry->flags & VIRGL_BIND_NEED_SWIZZLE) {
+      key->has_swizzle = 1;
+      memcpy(key->swizzle, dst_entry->swizzle, sizeof(key->swizzle));
    }
 }
 
-static GLuint blit_get_frag_tex_col(struct vrend_blitter_ctx *blit_ctx,
-                                    int pipe_tex_target,
-                                    unsigned nr_samples,
-                                    const struct vrend_format_table *src_entry,
-                                    const struct vrend_format_table *dst_entry)
+static GLuint blit_build_frag(struct vrend_blitter_ctx *blit_ctx,
+                              const struct blit_prog_key *key)
 {
-   assert(pipe_tex_target < PIPE_MAX_TEXTURE_TYPES);
+   const uint8_t *swizzle = key->has_swizzle ? key->swizzle : NULL;
 
-   bool needs_swizzle = dst_entry->flags & VIRGL_BIND_NEED_SWIZZLE;
-
-   if (needs_swizzle || nr_samples > 1) {
-      const uint8_t *swizzle = needs_swizzle ? dst_entry->swizzle : NULL;
-      GLuint *shader = &blit_ctx->fs_texfetch_col_swizzle;
-      if (shader) {
-         glDeleteShader(*shader);
-      }
+   if (key->write_depth) {
+      if (key->nr_samples > 1)
+         return blit_build_frag_blit_msaa_depth(blit_ctx, key->tgsi_tex_target);
+      return blit_build_frag_tex_writedepth(blit_ctx, key->tgsi_tex_target);
+   }
 
-      unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, nr_samples);
-      enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   if (key->nr_samples > 1) {
+      // Integer textures are resolved using just one sample
+      int msaa_samples = key->tgsi_ret == TGSI_RETURN_TYPE_UNORM ? key->nr_samples : 1;
+      return blit_build_frag_tex_col_msaa(blit_ctx, key->tgsi_tex_target, key->tgsi_ret,
+                                          swizzle, msaa_samples);
+   }
+   return blit_build_frag_tex_col(blit_ctx, key->tgsi_tex_target, key->tgsi_ret, swizzle);
+}
 
-      if (nr_samples > 1) {
-         // Integer textures are resolved using just one sample
-         int msaa_samples = tgsi_ret == TGSI_RETURN_TYPE_UNORM ? nr_samples : 1;
-         *shader = blit_build_frag_tex_col_msaa(blit_ctx, tgsi_tex, tgsi_ret,
-                                                swizzle, msaa_samples);
-      } else {
-         *shader = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret, swizzle);
-      }
+static struct blit_prog *blit_get_prog(struct vrend_context *ctx,
+                                       struct vrend_blitter_ctx *blit_ctx,
+                                       const struct blit_prog_key *key)
+{
+   struct blit_prog *prog;
+   GLuint fs_id;
+   GLint lret;
 
-      return *shader;
-   } else {
-      GLuint *shader = &blit_ctx->fs_texfetch_col[pipe_tex_target];
+   prog = util_hash_table_get(blit_ctx->prog_cache, (void *)key);
+   if (prog)
+      return prog;
 
-      if (!*shader) {
-         unsigned tgsi_tex = util_pipe_tex_to_tgsi_tex(pipe_tex_target, 0);
-         enum tgsi_return_type tgsi_ret = tgsi_ret_for_format(src_entry->format);
+   fs_id = blit_build_frag(blit_ctx, key);
+   if (!fs_id)
+      return NULL;
 
-         *shader = blit_build_frag_tex_col(blit_ctx, tgsi_tex, tgsi_ret, NULL);
-      }
-      return *shader;
+   prog = CALLOC_STRUCT(blit_prog);
+   if (!prog) {
+      glDeleteShader(fs_id);
+      return NULL;
    }
+   prog->key = *key;
+   prog->id = glCreateProgram();
+   glAttachShader(prog->id, blit_ctx->vs);
+   glAttachShader(prog->id, fs_id);
+   glLinkProgram(prog->id);
+   glDetachShader(prog->id, fs_id);
+   glDeleteShader(fs_id);
+
+   glGetProgramiv(prog->id, GL_LINK_STATUS, &lret);
+   if (lret == GL_FALSE) {
+      char infolog[65536];
+      int len;
+      glGetProgramInfoLog(prog->id, 65536, &len, infolog);
+      fprintf(stderr,"got error linking\n%s\n", infolog);
+      glDeleteProgram(prog->id);
+      FREE(prog);
+      return NULL;
+   }
+
+   prog->pos_loc = glGetAttribLocation(prog->id, "arg0");
+   prog->tc_loc = glGetAttribLocation(prog->id, "arg1");
+
+   /* the sampler always reads from unit 0 */
+   vrend_use_program(ctx, prog->id);
+   glUniform1i(glGetUniformLocation(prog->id, "samp"), 0);
+
+   util_hash_table_set(blit_ctx->prog_cache, &prog->key, prog);
+   return prog;
 }
 
 static void vrend_renderer_init_blit_ctx(struct vrend_blitter_ctx *blit_ctx)
 {
-   struct virgl_gl_ctx_param ctx_params;
    int i;
-   if (blit_ctx->initialised) {
-      vrend_clicbs->make_current(0, blit_ctx->gl_context);
+   if (blit_ctx->initialised)
       return;
-   }
 
    blit_ctx->initialised = true;
    blit_ctx->use_gles = epoxy_is_desktop_gl() == 0;
-   ctx_params.shared = true;
-   for (uint32_t i = 0; i < ARRAY_SIZE(gl_versions); i++) {
-      ctx_params.major_ver = gl_versions[i].major;
-      ctx_params.minor_ver = gl_versions[i].minor;
-
-      blit_ctx->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
-      if (blit_ctx->gl_context)
-         break;
-   }
-
-   vrend_clicbs->make_current(0, blit_ctx->gl_context);
-   glGenVertexArrays(1, &blit_ctx->vaoid);
-   glGenFramebuffers(1, &blit_ctx->fb_id);
 
    glGenBuffers(1, &blit_ctx->vbo_id);
    blit_build_vs_passthrough(blit_ctx);
+   blit_ctx->prog_cache = util_hash_table_create(blit_prog_hash,
+                                                 blit_prog_compare,
+                                                 blit_prog_free);
 
    for (i = 0; i < 4; i++)
       blit_ctx->vertices[i][0][3] = 1; /*v.w*/
-   glBindVertexArray(blit_ctx->vaoid);
-   glBindBuffer(GL_ARRAY_BUFFER, blit_ctx->vbo_id);
-
-   if (!blit_ctx->use_gles)
-      glEnable(GL_FRAMEBUFFER_SRGB);
-   blit_ctx->framebuffer_srgb_enabled = true;
 }
 
 static inline GLenum convert_mag_filter(unsigned int filter)
@@ -598,23 +647,6 @@ static void blitter_set_texcoords(struct vrend_blitter_ctx *blit_ctx,
    default:;
    }
 }
-#if 0
-static void set_dsa_keep_depth_stencil(void)
-{
-   glDisable(GL_STENCIL_TEST);
-   glDisable(GL_DEPTH_TEST);
-   glDepthMask(GL_FALSE);
-}
-#endif
-
-static void set_dsa_write_depth_keep_stencil(void)
-{
-   glDisable(GL_STENCIL_TEST);
-   glEnable(GL_DEPTH_TEST);
-   glDepthFunc(GL_ALWAYS);
-   glDepthMask(GL_TRUE);
-}
-
 static inline GLenum to_gl_swizzle(int swizzle)
 {
    switch (swizzle) {
@@ -687,21 +719,19 @@ static void calc_dst_deltas_from_src(const struct pipe_blit_info *info,
    dst1_delta->dy = src1_delta->dy * scale_y;
 }
 
-/* implement blitting using OpenGL. */
-void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
+/* implement blitting using OpenGL. The caller binds the framebuffer and
+ * vertex array to use, and sets up the fixed function state. */
+void vrend_renderer_blit_gl(struct vrend_context *ctx,
                             struct vrend_resource *src_res,
                             struct vrend_resource *dst_res,
                             const struct pipe_blit_info *info,
                             bool has_texture_srgb_decode)
 {
-   struct vrend_blitter_ctx *blit_ctx = &vrend_blit_ctx;
+   struct vrend_blitter_ctx *blit_ctx = vrend_blitter_get_ctx();
+   struct blit_prog_key key;
+   struct blit_prog *prog;
    GLuint buffers;
-   GLuint prog_id;
-   GLuint fs_id;
-   GLint lret;
    GLenum filter;
-   GLuint pos_loc, tc_loc;
-   GLuint samp_loc;
    bool has_depth, has_stencil;
    bool blit_stencil, blit_depth;
    int dst_z;
@@ -724,6 +754,9 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
    blit_depth = has_depth && (info->mask & PIPE_MASK_Z);
    blit_stencil = has_stencil && (info->mask & PIPE_MASK_S) & 0;
 
+   if (!blit_ctx)
+      return;
+
    filter = convert_mag_filter(info->filter);
    vrend_renderer_init_blit_ctx(blit_ctx);
 
@@ -747,34 +780,14 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
 
    blitter_set_rectangle(blit_ctx, dst0.x, dst0.y, dst1.x, dst1.y, 0);
 
-   prog_id = glCreateProgram();
-   glAttachShader(prog_id, blit_ctx->vs);
-
-   if (blit_depth || blit_stencil) {
-      fs_id = blit_get_frag_tex_writedepth(blit_ctx, src_res->base.target,
-                                           src_res->base.nr_samples);
-   } else {
-      fs_id = blit_get_frag_tex_col(blit_ctx, src_res->base.target,
-                                    src_res->base.nr_samples,
-                                    src_entry, dst_entry);
-   }
-   glAttachShader(prog_id, fs_id);
-
-   glLinkProgram(prog_id);
-   glGetProgramiv(prog_id, GL_LINK_STATUS, &lret);
-   if (lret == GL_FALSE) {
-      char infolog[65536];
-      int len;
-      glGetProgramInfoLog(prog_id, 65536, &len, infolog);
-      fprintf(stderr,"got error linking\n%s\n", infolog);
-      /* dump shaders */
-      glDeleteProgram(prog_id);
+   blit_prog_key_init(&key, blit_depth || blit_stencil, src_res->base.target,
+                      src_res->base.nr_samples, src_entry, dst_entry);
+   prog = blit_get_prog(ctx, blit_ctx, &key);
+   if (!prog)
       return;
-   }
 
-   glUseProgram(prog_id);
+   vrend_use_program(ctx, prog->id);
 
-   glBindFramebuffer(GL_FRAMEBUFFER_EXT, blit_ctx->fb_id);
    vrend_fb_bind_texture(dst_res, 0, info->dst.level, info->dst.box.z);
 
    buffers = GL_COLOR_ATTACHMENT0_EXT;
@@ -810,19 +823,12 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
       glTexParameterf(src_res->target, GL_TEXTURE_MAG_FILTER, filter);
       glTexParameterf(src_res->target, GL_TEXTURE_MIN_FILTER, filter);
    }
-   pos_loc = glGetAttribLocation(prog_id, "arg0");
-   tc_loc = glGetAttribLocation(prog_id, "arg1");
-   samp_loc = glGetUniformLocation(prog_id, "samp");
-
-   glUniform1i(samp_loc, 0);
-
-   glVertexAttribPointer(pos_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)0);
-   glVertexAttribPointer(tc_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)(4 * sizeof(float)));
+   vrend_bind_buffer(GL_ARRAY_BUFFER, blit_ctx->vbo_id);
+   glVertexAttribPointer(prog->pos_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)0);
+   glVertexAttribPointer(prog->tc_loc, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)(4 * sizeof(float)));
 
-   glEnableVertexAttribArray(pos_loc);
-   glEnableVertexAttribArray(tc_loc);
-
-   set_dsa_write_depth_keep_stencil();
+   glEnableVertexAttribArray(prog->pos_loc);
+   glEnableVertexAttribArray(prog->tc_loc);
 
    for (dst_z = 0; dst_z < info->dst.box.depth; dst_z++) {
       float dst2src_scale = info->src.box.depth / (float)info->dst.box.depth;
@@ -831,7 +837,6 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
       float src_z = (dst_z + dst_offset) * dst2src_scale;
       uint32_t layer = (dst_res->target == GL_TEXTURE_CUBE_MAP) ? info->dst.box.z : dst_z;
 
-      glBindFramebuffer(GL_FRAMEBUFFER_EXT, blit_ctx->fb_id);
       vrend_fb_bind_texture(dst_res, 0, info->dst.level, layer);
 
       buffers = GL_COLOR_ATTACHMENT0_EXT;
@@ -844,8 +849,7 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
       glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
    }
 
-   glUseProgram(0);
-   glDeleteProgram(prog_id);
+   vrend_use_program(ctx, 0);
    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
                              GL_TEXTURE_2D, 0, 0);
    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0,
@@ -854,7 +858,16 @@ void vrend_renderer_blit_gl(UNUSED struct vrend_context *ctx,
 
 void vrend_blitter_fini(void)
 {
-   vrend_blit_ctx.initialised = false;
-   vrend_clicbs->destroy_gl_context(vrend_blit_ctx.gl_context);
-   memset(&vrend_blit_ctx, 0, sizeof(vrend_blit_ctx));
+   struct vrend_blitter_ctx *blit_ctx = vrend_instance->blit_ctx;
+
+   if (!blit_ctx)
+      return;
+   if (blit_ctx->prog_cache)
+      util_hash_table_destroy(blit_ctx->prog_cache);
+   if (blit_ctx->vbo_id)
+      vrend_delete_buffers(1, &blit_ctx->vbo_id);
+   if (blit_ctx->vs)
+      glDeleteShader(blit_ctx->vs);
+   FREE(blit_ctx);
+   vrend_instance->blit_ctx = NULL;
 }
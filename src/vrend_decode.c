@@ -47,8 +47,6 @@ struct vrend_decode_ctx {
    struct vrend_decoder_state ids, *ds;
    struct vrend_context *grctx;
 };
-#define VREND_MAX_CTX 64
-static struct vrend_decode_ctx *dec_ctx[VREND_MAX_CTX];
 
 static inline uint32_t get_buf_entry(struct vrend_decode_ctx *ctx, uint32_t offset)
 {
@@ -381,6 +379,105 @@ static int vrend_decode_resource_inline_write(struct vrend_decode_ctx *ctx, uint
    return vrend_transfer_inline_write(ctx->grctx, &info, usage);
 }
 
+/* there is no multi draw with an index range, so indexed draws are only
+ * batched when they don't give one */
+static bool vrend_decode_draw_has_range(const struct pipe_draw_info *info)
+{
+   return info->indexed &&
+      (info->min_index != 0 || info->max_index != (unsigned)-1);
+}
+
+static bool vrend_decode_draw_compatible(const struct pipe_draw_info *info,
+                                         const uint32_t *cmd, int length)
+{
+   if (info->indexed &&
+       (cmd[VIRGL_DRAW_VBO_MIN_INDEX] != 0 ||
+        cmd[VIRGL_DRAW_VBO_MAX_INDEX] != (uint32_t)-1))
+      return false;
+
+   if (cmd[VIRGL_DRAW_VBO_MODE] != info->mode ||
+       cmd[VIRGL_DRAW_VBO_INDEXED] != info->indexed ||
+       cmd[VIRGL_DRAW_VBO_INSTANCE_COUNT] != info->instance_count ||
+       cmd[VIRGL_DRAW_VBO_START_INSTANCE] != info->start_instance ||
+       cmd[VIRGL_DRAW_VBO_PRIMITIVE_RESTART] != info->primitive_restart ||
+       cmd[VIRGL_DRAW_VBO_RESTART_INDEX] != info->restart_index ||
+       cmd[VIRGL_DRAW_VBO_COUNT_FROM_SO])
+      return false;
+
+   if (length >= VIRGL_DRAW_VBO_SIZE_TESS &&
+       (cmd[VIRGL_DRAW_VBO_VERTICES_PER_PATCH] != info->vertices_per_patch ||
+        cmd[VIRGL_DRAW_VBO_DRAWID] != info->drawid))
+      return false;
+
+   return true;
+}
+
+/* Look ahead for draws that only differ in their range, with at most index
+ * buffer offset changes in between, and issue them as one batch. The last
+ * draw taken becomes the current command.
+ */
+static int vrend_decode_draw_batch(struct vrend_decode_ctx *ctx, int length,
+                                   const struct pipe_draw_info *info)
+{
+   struct vrend_draw_batch batch;
+   const uint32_t *buf = ctx->ds->buf;
+   uint32_t pos = ctx->ds->buf_offset + length + 1;
+   uint32_t last = ctx->ds->buf_offset;
+   uint32_t ib_handle = 0, ib_size = 0, ib_offset = 0;
+   uint32_t cur_ib_offset, last_ib_offset;
+
+   if (info->indexed &&
+       !vrend_get_index_buffer(ctx->grctx, &ib_handle, &ib_size, &ib_offset))
+      return vrend_draw_vbo(ctx->grctx, info, 0, 0, 0, NULL);
+
+   batch.num_draws = 1;
+   batch.starts[0] = info->start;
+   batch.counts[0] = info->count;
+   batch.index_biases[0] = info->index_bias;
+   batch.ib_offsets[0] = ib_offset;
+   cur_ib_offset = last_ib_offset = ib_offset;
+
+   while (batch.num_draws < VREND_MAX_BATCHED_DRAWS && pos < ctx->ds->buf_total) {
+      const uint32_t *cmd = &buf[pos];
+      uint32_t len = cmd[0] >> 16;
+      int n;
+
+      if (pos + len + 1 > ctx->ds->buf_total)
+         break;
+
+      if ((cmd[0] & 0xff) == VIRGL_CCMD_SET_INDEX_BUFFER && info->indexed && len == 3 &&
+          cmd[VIRGL_SET_INDEX_BUFFER_HANDLE] == ib_handle &&
+          cmd[VIRGL_SET_INDEX_BUFFER_INDEX_SIZE] == ib_size) {
+         cur_ib_offset = cmd[VIRGL_SET_INDEX_BUFFER_OFFSET];
+         pos += len + 1;
+         continue;
+      }
+
+      if ((cmd[0] & 0xff) != VIRGL_CCMD_DRAW_VBO || len != (uint32_t)length ||
+          !vrend_decode_draw_compatible(info, cmd, length))
+         break;
+
+      n = batch.num_draws++;
+      batch.starts[n] = cmd[VIRGL_DRAW_VBO_START];
+      batch.counts[n] = cmd[VIRGL_DRAW_VBO_COUNT];
+      batch.index_biases[n] = cmd[VIRGL_DRAW_VBO_INDEX_BIAS];
+      batch.ib_offsets[n] = cur_ib_offset;
+      last_ib_offset = cur_ib_offset;
+      last = pos;
+      pos += len + 1;
+   }
+
+   if (batch.num_draws == 1)
+      return vrend_draw_vbo(ctx->grctx, info, 0, 0, 0, NULL);
+
+   /* leave the index buffer state as the skipped commands would have */
+   if (last_ib_offset != ib_offset)
+      vrend_set_index_buffer(ctx->grctx, ib_handle, ib_size, last_ib_offset);
+
+   ctx->ds->buf_offset = last;
+   return vrend_draw_vbo(ctx->grctx, info, 0, 0, 0, &batch);
+}
+
 static int vrend_decode_draw_vbo(struct vrend_decode_ctx *ctx, int length)
 {
    struct pipe_draw_info info;
@@ -419,7 +516,11 @@ static int vrend_decode_draw_vbo(struct vrend_decode_ctx *ctx, int length)
 
    cso = get_buf_entry(ctx, VIRGL_DRAW_VBO_COUNT_FROM_SO);
 
-   return vrend_draw_vbo(ctx->grctx, &info, cso, handle, indirect_draw_count_handle);
+   if (length != VIRGL_DRAW_VBO_SIZE_INDIRECT && !cso && info.instance_count <= 1 &&
+       !vrend_decode_draw_has_range(&info))
+      return vrend_decode_draw_batch(ctx, length, &info);
+
+   return vrend_draw_vbo(ctx->grctx, &info, cso, handle, indirect_draw_count_handle, NULL);
 }
 
 static int vrend_decode_create_blend(struct vrend_decode_ctx *ctx, uint32_t handle, uint16_t length)
@@ -458,8 +559,8 @@ static int vrend_decode_create_blend(struct vrend_decode_ctx *ctx, uint32_t hand
       blend_state->rt[i].colormask = (tmp >> 27) & 0xf;
    }
 
-   tmp = vrend_renderer_object_insert(ctx->grctx, blend_state, sizeof(struct pipe_blend_state), handle,
-                                      VIRGL_OBJECT_BLEND);
+   tmp = vrend_renderer_state_insert(ctx->grctx, blend_state, sizeof(struct pipe_blend_state), handle,
+                                     VIRGL_OBJECT_BLEND);
    if (tmp == 0) {
       FREE(blend_state);
       return ENOMEM;
@@ -502,8 +603,8 @@ static int vrend_decode_create_dsa(struct vrend_decode_ctx *ctx, uint32_t handle
    tmp = get_buf_entry(ctx, VIRGL_OBJ_DSA_ALPHA_REF);
    dsa_state->alpha.ref_value = uif(tmp);
 
-   tmp = vrend_renderer_object_insert(ctx->grctx, dsa_state, sizeof(struct pipe_depth_stencil_alpha_state), handle,
-                                      VIRGL_OBJECT_DSA);
+   tmp = vrend_renderer_state_insert(ctx->grctx, dsa_state, sizeof(struct pipe_depth_stencil_alpha_state), handle,
+                                     VIRGL_OBJECT_DSA);
    if (tmp == 0) {
       FREE(dsa_state);
       return ENOMEM;
@@ -568,8 +669,8 @@ static int vrend_decode_create_rasterizer(struct vrend_decode_ctx *ctx, uint32_t
    rs_state->offset_scale = uif(get_buf_entry(ctx, VIRGL_OBJ_RS_OFFSET_SCALE));
    rs_state->offset_clamp = uif(get_buf_entry(ctx, VIRGL_OBJ_RS_OFFSET_CLAMP));
 
-   tmp = vrend_renderer_object_insert(ctx->grctx, rs_state, sizeof(struct pipe_rasterizer_state), handle,
-                                      VIRGL_OBJECT_RASTERIZER);
+   tmp = vrend_renderer_state_insert(ctx->grctx, rs_state, sizeof(struct pipe_rasterizer_state), handle,
+                                     VIRGL_OBJECT_RASTERIZER);
    if (tmp == 0) {
       FREE(rs_state);
       return ENOMEM;
@@ -617,6 +718,9 @@ static int vrend_decode_create_sampler_state(struct vrend_decode_ctx *ctx, uint3
 
    if (length != VIRGL_OBJ_SAMPLER_STATE_SIZE)
       return EINVAL;
+
+   /* the renderer shares GL samplers by comparing whole states */
+   memset(&state, 0, sizeof(state));
    tmp = get_buf_entry(ctx, VIRGL_OBJ_SAMPLER_STATE_S0);
    state.wrap_s = tmp & 0x7;
    state.wrap_t = (tmp >> 3) & 0x7;
@@ -1257,7 +1361,7 @@ void vrend_renderer_context_create_internal(uint32_t handle, uint32_t nlen,
    if (handle >= VREND_MAX_CTX)
       return;
 
-   dctx = dec_ctx[handle];
+   dctx = vrend_instance->dec_ctx[handle];
    if (dctx)
       return;
 
@@ -1273,7 +1377,7 @@ void vrend_renderer_context_create_internal(uint32_t handle, uint32_t nlen,
 
    dctx->ds = &dctx->ids;
 
-   dec_ctx[handle] = dctx;
+   vrend_instance->dec_ctx[handle] = dctx;
 }
 
 int vrend_renderer_context_create(uint32_t handle, uint32_t nlen, const char *debug_name)
@@ -1302,15 +1406,16 @@ void vrend_renderer_context_destroy(uint32_t handle)
       return;
    }
 
-   ctx = dec_ctx[handle];
+   ctx = vrend_instance->dec_ctx[handle];
    if (!ctx)
       return;
-   dec_ctx[handle] = NULL;
+   vrend_instance->dec_ctx[handle] = NULL;
+   vrend_renderer_destroy_fence_timeline(handle);
    ret = vrend_destroy_context(ctx->grctx);
    free(ctx);
    /* switch to ctx 0 */
    if (ret && handle != 0)
-      vrend_hw_switch_context(dec_ctx[0]->grctx, true);
+      vrend_hw_switch_context(vrend_instance->dec_ctx[0]->grctx, true);
 }
 
 struct vrend_context *vrend_lookup_renderer_ctx(uint32_t ctx_id)
@@ -1318,10 +1423,10 @@ struct vrend_context *vrend_lookup_renderer_ctx(uint32_t ctx_id)
    if (ctx_id >= VREND_MAX_CTX)
       return NULL;
 
-   if (dec_ctx[ctx_id] == NULL)
+   if (vrend_instance->dec_ctx[ctx_id] == NULL)
       return NULL;
 
-   return dec_ctx[ctx_id]->grctx;
+   return vrend_instance->dec_ctx[ctx_id]->grctx;
 }
 
 int vrend_decode_block(uint32_t ctx_id, uint32_t *block, int ndw)
@@ -1332,10 +1437,10 @@ int vrend_decode_block(uint32_t ctx_id, uint32_t *block, int ndw)
    if (ctx_id >= VREND_MAX_CTX)
       return EINVAL;
 
-   if (dec_ctx[ctx_id] == NULL)
+   if (vrend_instance->dec_ctx[ctx_id] == NULL)
       return EINVAL;
 
-   gdctx = dec_ctx[ctx_id];
+   gdctx = vrend_instance->dec_ctx[ctx_id];
 
    bret = vrend_hw_switch_context(gdctx->grctx, true);
    if (bret == false)
@@ -1499,23 +1604,23 @@ void vrend_decode_reset(bool ctx_0_only)
 {
    int i;
 
-   vrend_hw_switch_context(dec_ctx[0]->grctx, true);
+   vrend_hw_switch_context(vrend_instance->dec_ctx[0]->grctx, true);
 
    if (ctx_0_only == false) {
       for (i = 1; i < VREND_MAX_CTX; i++) {
-         if (!dec_ctx[i])
+         if (!vrend_instance->dec_ctx[i])
             continue;
 
-         if (!dec_ctx[i]->grctx)
+         if (!vrend_instance->dec_ctx[i]->grctx)
             continue;
 
-         vrend_destroy_context(dec_ctx[i]->grctx);
-         free(dec_ctx[i]);
-         dec_ctx[i] = NULL;
+         vrend_destroy_context(vrend_instance->dec_ctx[i]->grctx);
+         free(vrend_instance->dec_ctx[i]);
+         vrend_instance->dec_ctx[i] = NULL;
       }
    } else {
-      vrend_destroy_context(dec_ctx[0]->grctx);
-      free(dec_ctx[0]);
-      dec_ctx[0] = NULL;
+      vrend_destroy_context(vrend_instance->dec_ctx[0]->grctx);
+      free(vrend_instance->dec_ctx[0]);
+      vrend_instance->dec_ctx[0] = NULL;
    }
 }
@@ -27,6 +27,7 @@
 #include "util/u_hash_table.h"
 
 #include "vrend_object.h"
+#include "vrend_renderer.h"
 
 struct vrend_object_types {
    void (*unref)(void *);
@@ -62,19 +63,9 @@ compare(void *key1, void *key2)
       return 0;
 }
 
-static struct util_hash_table *res_hash;
 
-struct vrend_object {
-   enum virgl_object_type type;
-   uint32_t handle;
-   void *data;
-   bool free_data;
-};
-
-static void free_object(void *value)
+static void release_object(struct vrend_object *obj)
 {
-   struct vrend_object *obj = value;
-
    if (obj->free_data) {
       if (obj_types[obj->type].unref)
          obj_types[obj->type].unref(obj->data);
@@ -83,52 +74,152 @@ static void free_object(void *value)
          free(obj->data);
       }
    }
-   free(obj);
 }
 
-struct util_hash_table *vrend_object_init_ctx_table(void)
+static void free_object(void *value)
+{
+   release_object(value);
+   free(value);
+}
+
+static void release_res(struct vrend_object *obj)
+{
+   (*resource_unref)(obj->data);
+}
+
+static void free_res(void *value)
+{
+   release_res(value);
+   free(value);
+}
+
+static struct vrend_object_table *
+vrend_object_table_create(void (*release)(struct vrend_object *),
+                          void (*destroy)(void *))
+{
+   struct vrend_object_table *table = CALLOC_STRUCT(vrend_object_table);
+
+   if (!table)
+      return NULL;
+   table->sparse = util_hash_table_create(hash_func, compare, destroy);
+   if (!table->sparse) {
+      FREE(table);
+      return NULL;
+   }
+   table->release = release;
+   return table;
+}
+
+/* entries are cleared before they are released, the callbacks may look
+ * up other objects in the same table */
+static void vrend_object_table_release(struct vrend_object_table *table,
+                                       struct vrend_object *obj)
 {
-   struct util_hash_table *ctx_hash;
-   ctx_hash = util_hash_table_create(hash_func, compare, free_object);
-   return ctx_hash;
+   struct vrend_object old = *obj;
+
+   memset(obj, 0, sizeof(*obj));
+   table->release(&old);
 }
 
-void vrend_object_fini_ctx_table(struct util_hash_table *ctx_hash)
+static void vrend_object_table_destroy(struct vrend_object_table *table)
 {
-   if (!ctx_hash)
+   int i, j;
+
+   for (i = 0; i < VREND_OBJECT_NUM_BLOCKS; i++) {
+      if (!table->blocks[i])
+         continue;
+      for (j = 0; j < VREND_OBJECT_BLOCK_SIZE; j++) {
+         if (table->blocks[i][j].handle)
+            vrend_object_table_release(table, &table->blocks[i][j]);
+      }
+   }
+   for (i = 0; i < VREND_OBJECT_NUM_BLOCKS; i++)
+      FREE(table->blocks[i]);
+   util_hash_table_destroy(table->sparse);
+   FREE(table);
+}
+
+struct vrend_object *vrend_object_table_get_sparse(struct vrend_object_table *table,
+                                                   uint32_t handle)
+{
+   return util_hash_table_get(table->sparse, intptr_to_pointer(handle));
+}
+
+/* returns the entry to fill in, an object that had the handle is released */
+static struct vrend_object *vrend_object_table_add(struct vrend_object_table *table,
+                                                   uint32_t handle)
+{
+   struct vrend_object **block, *obj;
+
+   if (!handle || handle >= VREND_OBJECT_DENSE_MAX) {
+      obj = CALLOC_STRUCT(vrend_object);
+      if (!obj)
+         return NULL;
+      util_hash_table_set(table->sparse, intptr_to_pointer(handle), obj);
+      return obj;
+   }
+
+   block = &table->blocks[handle >> VREND_OBJECT_BLOCK_SHIFT];
+   if (!*block) {
+      *block = CALLOC(VREND_OBJECT_BLOCK_SIZE, sizeof(struct vrend_object));
+      if (!*block)
+         return NULL;
+   }
+   obj = &(*block)[handle & (VREND_OBJECT_BLOCK_SIZE - 1)];
+   if (obj->handle)
+      vrend_object_table_release(table, obj);
+   return obj;
+}
+
+static void vrend_object_table_remove(struct vrend_object_table *table,
+                                      uint32_t handle)
+{
+   struct vrend_object *obj;
+
+   if (!handle || handle >= VREND_OBJECT_DENSE_MAX) {
+      util_hash_table_remove(table->sparse, intptr_to_pointer(handle));
       return;
+   }
 
-   util_hash_table_destroy(ctx_hash);
+   obj = vrend_object_table_get(table, handle);
+   if (obj)
+      vrend_object_table_release(table, obj);
 }
 
-static void free_res(void *value)
+struct vrend_object_table *vrend_object_init_ctx_table(void)
 {
-   struct vrend_object *obj = value;
-   (*resource_unref)(obj->data);
-   free(obj);
+   return vrend_object_table_create(release_object, free_object);
+}
+
+void vrend_object_fini_ctx_table(struct vrend_object_table *ctx_table)
+{
+   if (!ctx_table)
+      return;
+
+   vrend_object_table_destroy(ctx_table);
 }
 
 void
 vrend_object_init_resource_table(void)
 {
-   if (!res_hash)
-      res_hash = util_hash_table_create(hash_func, compare, free_res);
+   if (!vrend_instance->res_hash)
+      vrend_instance->res_hash = vrend_object_table_create(release_res, free_res);
 }
 
 void vrend_object_fini_resource_table(void)
 {
-   if (res_hash) {
-      util_hash_table_destroy(res_hash);
+   if (vrend_instance->res_hash) {
+      vrend_object_table_destroy(vrend_instance->res_hash);
    }
-   res_hash = NULL;
+   vrend_instance->res_hash = NULL;
 }
 
 uint32_t
-vrend_object_insert_nofree(struct util_hash_table *handle_hash,
+vrend_object_insert_nofree(struct vrend_object_table *handle_table,
                            void *data, UNUSED uint32_t length, uint32_t handle,
                            enum virgl_object_type type, bool free_data)
 {
-   struct vrend_object *obj = CALLOC_STRUCT(vrend_object);
+   struct vrend_object *obj = vrend_object_table_add(handle_table, handle);
 
    if (!obj)
       return 0;
@@ -136,38 +227,22 @@ vrend_object_insert_nofree(struct util_hash_table *handle_hash,
    obj->data = data;
    obj->type = type;
    obj->free_data = free_data;
-   util_hash_table_set(handle_hash, intptr_to_pointer(obj->handle), obj);
    return obj->handle;
 }
 
 uint32_t
-vrend_object_insert(struct util_hash_table *handle_hash,
+vrend_object_insert(struct vrend_object_table *handle_table,
                     void *data, uint32_t length, uint32_t handle, enum virgl_object_type type)
 {
-   return vrend_object_insert_nofree(handle_hash, data, length,
+   return vrend_object_insert_nofree(handle_table, data, length,
                                      handle, type, true);
 }
 
 void
-vrend_object_remove(struct util_hash_table *handle_hash,
+vrend_object_remove(struct vrend_object_table *handle_table,
                     uint32_t handle, UNUSED enum virgl_object_type type)
 {
-   util_hash_table_remove(handle_hash, intptr_to_pointer(handle));
-}
-
-void *vrend_object_lookup(struct util_hash_table *handle_hash,
-                          uint32_t handle, enum virgl_object_type type)
-{
-   struct vrend_object *obj;
-
-   obj = util_hash_table_get(handle_hash, intptr_to_pointer(handle));
-   if (!obj) {
-      return NULL;
-   }
-
-   if (obj->type != type)
-      return NULL;
-   return obj->data;
+   vrend_object_table_remove(handle_table, handle);
 }
 
 int vrend_resource_insert(void *data, uint32_t handle)
@@ -177,25 +252,26 @@ int vrend_resource_insert(void *data, uint32_t handle)
    if (!handle)
       return 0;
 
-   obj = CALLOC_STRUCT(vrend_object);
+   obj = vrend_object_table_add(vrend_instance->res_hash, handle);
    if (!obj)
       return 0;
 
    obj->handle = handle;
    obj->data = data;
-   util_hash_table_set(res_hash, intptr_to_pointer(obj->handle), obj);
+   obj->type = 0;
+   obj->free_data = false;
    return obj->handle;
 }
 
 void vrend_resource_remove(uint32_t handle)
 {
-   util_hash_table_remove(res_hash, intptr_to_pointer(handle));
+   vrend_object_table_remove(vrend_instance->res_hash, handle);
 }
 
 void *vrend_resource_lookup(uint32_t handle, UNUSED uint32_t ctx_id)
 {
    struct vrend_object *obj;
-   obj = util_hash_table_get(res_hash, intptr_to_pointer(handle));
+   obj = vrend_object_table_get(vrend_instance->res_hash, handle);
    if (!obj)
       return NULL;
    return obj->data;
@@ -25,18 +25,72 @@
 #ifndef VREND_OBJECT_H
 #define VREND_OBJECT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "virgl_protocol.h"
 
+struct util_hash_table;
+
+struct vrend_object {
+   enum virgl_object_type type;
+   uint32_t handle;
+   void *data;
+   bool free_data;
+};
+
+/* Guests hand out handles densely from small integers, so those index
+ * blocks of entries directly, and only the others go through the hash.
+ * A free entry has a handle of 0.
+ */
+#define VREND_OBJECT_BLOCK_SHIFT 8
+#define VREND_OBJECT_BLOCK_SIZE (1 << VREND_OBJECT_BLOCK_SHIFT)
+#define VREND_OBJECT_NUM_BLOCKS 256
+#define VREND_OBJECT_DENSE_MAX (VREND_OBJECT_NUM_BLOCKS * VREND_OBJECT_BLOCK_SIZE)
+
+struct vrend_object_table {
+   struct vrend_object *blocks[VREND_OBJECT_NUM_BLOCKS];
+   struct util_hash_table *sparse;
+   void (*release)(struct vrend_object *obj);
+};
+
 void vrend_object_init_resource_table(void);
 void vrend_object_fini_resource_table(void);
 
-struct util_hash_table *vrend_object_init_ctx_table(void);
-void vrend_object_fini_ctx_table(struct util_hash_table *ctx_hash);
+struct vrend_object_table *vrend_object_init_ctx_table(void);
+void vrend_object_fini_ctx_table(struct vrend_object_table *ctx_table);
+
+struct vrend_object *vrend_object_table_get_sparse(struct vrend_object_table *table,
+                                                   uint32_t handle);
+
+static inline struct vrend_object *
+vrend_object_table_get(struct vrend_object_table *table, uint32_t handle)
+{
+   struct vrend_object *block, *obj;
+
+   if (!handle || handle >= VREND_OBJECT_DENSE_MAX)
+      return vrend_object_table_get_sparse(table, handle);
+
+   block = table->blocks[handle >> VREND_OBJECT_BLOCK_SHIFT];
+   if (!block)
+      return NULL;
+   obj = &block[handle & (VREND_OBJECT_BLOCK_SIZE - 1)];
+   return obj->handle == handle ? obj : NULL;
+}
+
+static inline void *vrend_object_lookup(struct vrend_object_table *handle_table,
+                                        uint32_t handle, enum virgl_object_type type)
+{
+   struct vrend_object *obj = vrend_object_table_get(handle_table, handle);
+
+   if (!obj || obj->type != type)
+      return NULL;
+   return obj->data;
+}
 
-void vrend_object_remove(struct util_hash_table *handle_hash, uint32_t handle, enum virgl_object_type obj);
-void *vrend_object_lookup(struct util_hash_table *handle_hash, uint32_t handle, enum virgl_object_type obj);
-uint32_t vrend_object_insert(struct util_hash_table *handle_hash, void *data, uint32_t length, uint32_t handle, enum virgl_object_type type);
-uint32_t vrend_object_insert_nofree(struct util_hash_table *handle_hash,
+void vrend_object_remove(struct vrend_object_table *handle_table, uint32_t handle, enum virgl_object_type obj);
+uint32_t vrend_object_insert(struct vrend_object_table *handle_table, void *data, uint32_t length, uint32_t handle, enum virgl_object_type type);
+uint32_t vrend_object_insert_nofree(struct vrend_object_table *handle_table,
                                     void *data, uint32_t length,
                                     uint32_t handle,
                                     enum virgl_object_type type,
@@ -37,6 +37,8 @@
 #include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_dual_blend.h"
+#include "util/u_box.h"
+#include "util/u_hash_table.h"
 
 #include "os/os_thread.h"
 #include "util/u_double_list.h"
@@ -62,13 +64,50 @@ int vrend_dump_shaders;
 /* debugging via KHR_debug extension */
 int vrend_use_debug_cb = 0;
 
-struct vrend_if_cbs *vrend_clicbs;
+/* Fences of one context, signalled in submission order independently of
+ * the fences of other contexts. Without per context fence callbacks all
+ * fences go on the timeline of context 0.
+ */
+struct vrend_fence_timeline {
+   struct list_head head;
+   uint32_t ctx_id;
+   /* pending and active belong to the thread that retires the fences */
+   struct list_head pending;
+   struct list_head active;
+   /* pending fences created in another GL context than the one before */
+   uint32_t unordered;
+   /* fences not freed yet, the context may be gone before they are */
+   uint32_t num_fences;
+   bool destroyed;
+   /* latest signalled fence that wasn't reported yet */
+   uint32_t signalled_id;
+   bool signalled;
+};
 
 struct vrend_fence {
    uint32_t fence_id;
    uint32_t ctx_id;
+   uint64_t seqno;
    GLsync syncobj;
+   virgl_gl_context gl_context;
+   bool unordered;
+   struct vrend_fence_timeline *timeline;
    struct list_head fences;
+   /* link in a fence queue or in the pool */
+   struct vrend_fence *next;
+};
+
+/* Intrusive multi producer, single consumer queue. Producers only swap
+ * the head, so neither side ever takes a lock.
+ *
+ * A push hands the fence, and what it points to, over to the consumer,
+ * which may free or reuse it right away. The producer must be done with
+ * the fence and its timeline before pushing it.
+ */
+struct vrend_fence_queue {
+   struct vrend_fence *head;
+   struct vrend_fence *tail;
+   struct vrend_fence stub;
 };
 
 struct vrend_query {
@@ -81,6 +120,50 @@ struct vrend_query {
    int ctx_id;
    struct vrend_resource *res;
    uint64_t current_total;
+
+   /* the result is written by the GPU into qbo, and read back once
+    * qbo_sync has signalled */
+   GLuint qbo;
+   GLsync qbo_sync;
+
+   /* with virtual contexts, an active query is ended when its context is
+    * switched away, and the parts add up to the result */
+   struct list_head active;
+   GLuint *segments;
+   unsigned num_segments;
+   unsigned max_segments;
+};
+
+/* Small buffers are packed into shared GL buffers of VREND_BUFFER_SLAB_SIZE
+ * bytes, using power of two sized chunks between the min and max order.
+ */
+#define VREND_BUFFER_SLAB_SIZE (1 << 20)
+#define VREND_SUBALLOC_MIN_ORDER 8
+#define VREND_SUBALLOC_MAX_ORDER 16
+#define VREND_SUBALLOC_NUM_ORDERS (VREND_SUBALLOC_MAX_ORDER - VREND_SUBALLOC_MIN_ORDER + 1)
+
+struct vrend_buffer_slab {
+   struct list_head head;
+   GLuint id;
+   uint32_t order;
+   uint32_t num_free;
+   uint32_t free_mask[(VREND_BUFFER_SLAB_SIZE >> VREND_SUBALLOC_MIN_ORDER) / 32];
+};
+
+/* Destroyed textures and buffers are kept for reuse by matching creates
+ * until they are older than VREND_POOL_MAX_AGE fences or the pool grows
+ * beyond VREND_POOL_MAX_SIZE bytes.
+ */
+#define VREND_POOL_MAX_SIZE (64 * 1024 * 1024)
+#define VREND_POOL_MAX_AGE 120
+
+struct vrend_pooled_object {
+   struct list_head head;
+   GLuint id;
+   GLenum target;
+   struct pipe_resource templ;
+   uint64_t size;
+   uint32_t epoch;
 };
 
 struct global_error_state {
@@ -89,22 +172,27 @@ struct global_error_state {
 
 enum features_id
 {
+   feat_arb_buffer_storage,
    feat_arb_or_gles_ext_texture_buffer,
    feat_arb_robustness,
    feat_atomic_counters,
    feat_base_instance,
    feat_barrier,
    feat_bit_encoding,
+   feat_clear_buffer,
+   feat_clear_texture,
    feat_compute_shader,
    feat_copy_image,
    feat_conditional_render_inverted,
    feat_cube_map_array,
    feat_debug_cb,
+   feat_draw_elements_base_vertex,
    feat_draw_instance,
    feat_dual_src_blend,
    feat_fb_no_attach,
    feat_framebuffer_fetch,
    feat_geometry_shader,
+   feat_get_texture_sub_image,
    feat_gl_conditional_render,
    feat_gl_prim_restart,
    feat_gles_khr_robustness,
@@ -116,10 +204,12 @@ enum features_id
    feat_indirect_draw,
    feat_mesa_invert,
    feat_ms_scaled_blit,
+   feat_multi_draw,
    feat_multisample,
    feat_nv_conditional_render,
    feat_nv_prim_restart,
    feat_polygon_offset_clamp,
+   feat_qbo,
    feat_robust_buffer_access,
    feat_sample_mask,
    feat_sample_shading,
@@ -156,22 +246,27 @@ static const  struct {
    int gles_ver;
    const char *gl_ext[FEAT_MAX_EXTS];
 } feature_list[] = {
+   [feat_arb_buffer_storage] = { 44, UNAVAIL, { "GL_ARB_buffer_storage", "GL_EXT_buffer_storage" } },
    [feat_arb_or_gles_ext_texture_buffer] = { 31, UNAVAIL, { "GL_ARB_texture_buffer_object", "GL_EXT_texture_buffer", NULL } },
    [feat_arb_robustness] = { UNAVAIL, UNAVAIL, { "GL_ARB_robustness" } },
    [feat_atomic_counters] = { 42, 31, { "GL_ARB_shader_atomic_counters" } },
    [feat_base_instance] = { 42, UNAVAIL, { "GL_ARB_base_instance", "GL_EXT_base_instance" } },
    [feat_barrier] = { 42, 31, {} },
    [feat_bit_encoding] = { 33, UNAVAIL, { "GL_ARB_shader_bit_encoding" } },
+   [feat_clear_buffer] = { 43, UNAVAIL, { "GL_ARB_clear_buffer_object" } },
+   [feat_clear_texture] = { 44, UNAVAIL, { "GL_ARB_clear_texture" } },
    [feat_compute_shader] = { 43, 31, { "GL_ARB_compute_shader" } },
    [feat_copy_image] = { 43, 32, { "GL_ARB_copy_image", "GL_EXT_copy_image", "GL_OES_copy_image" } },
    [feat_conditional_render_inverted] = { 45, UNAVAIL, { "GL_ARB_conditional_render_inverted" } },
    [feat_cube_map_array] = { 40, 32, { "GL_ARB_texture_cube_map_array", "GL_EXT_texture_cube_map_array", "GL_OES_texture_cube_map_array" } },
    [feat_debug_cb] = { UNAVAIL, UNAVAIL, {} }, /* special case */
+   [feat_draw_elements_base_vertex] = { 32, UNAVAIL, { "GL_ARB_draw_elements_base_vertex" } },
    [feat_draw_instance] = { 31, 30, { "GL_ARB_draw_instanced" } },
    [feat_dual_src_blend] = { 33, UNAVAIL, { "GL_ARB_blend_func_extended" } },
    [feat_fb_no_attach] = { 43, 31, { "GL_ARB_framebuffer_no_attachments" } },
    [feat_framebuffer_fetch] = { UNAVAIL, UNAVAIL, { "GL_EXT_shader_framebuffer_fetch" } },
    [feat_geometry_shader] = { 32, 32, {"GL_EXT_geometry_shader", "GL_OES_geometry_shader"} },
+   [feat_get_texture_sub_image] = { 45, UNAVAIL, { "GL_ARB_get_texture_sub_image" } },
    [feat_gl_conditional_render] = { 30, UNAVAIL, {} },
    [feat_gl_prim_restart] = { 31, 30, {} },
    [feat_gles_khr_robustness] = { UNAVAIL, UNAVAIL, { "GL_KHR_robustness" } },
@@ -183,10 +278,12 @@ static const  struct {
    [feat_indirect_draw] = { 40, 31, { "GL_ARB_draw_indirect" } },
    [feat_mesa_invert] = { UNAVAIL, UNAVAIL, { "GL_MESA_pack_invert" } },
    [feat_ms_scaled_blit] = { UNAVAIL, UNAVAIL, { "GL_EXT_framebuffer_multisample_blit_scaled" } },
+   [feat_multi_draw] = { 30, UNAVAIL, { "GL_EXT_multi_draw_arrays" } },
    [feat_multisample] = { 32, 30, { "GL_ARB_texture_multisample" } },
    [feat_nv_conditional_render] = { UNAVAIL, UNAVAIL, { "GL_NV_conditional_render" } },
    [feat_nv_prim_restart] = { UNAVAIL, UNAVAIL, { "GL_NV_primitive_restart" } },
    [feat_polygon_offset_clamp] = { 46, UNAVAIL, { "GL_ARB_polygon_offset_clamp" } },
+   [feat_qbo] = { 44, UNAVAIL, { "GL_ARB_query_buffer_object" } },
    [feat_robust_buffer_access] = { 43, UNAVAIL, { "GL_ARB_robust_buffer_access_behavior", "GL_KHR_robust_buffer_access_behavior" } },
    [feat_sample_mask] = { 32, 31, { "GL_ARB_texture_multisample" } },
    [feat_sample_shading] = { 40, 32, { "GL_ARB_sample_shading", "GL_OES_sample_shading" } },
@@ -214,6 +311,112 @@ static const  struct {
    [feat_viewport_array] = { 41, UNAVAIL, { "GL_ARB_viewport_array" } },
 };
 
+/* GL state that is shadowed per GL context, so that calls which wouldn't
+ * change anything can be dropped before reaching the driver */
+static const GLenum vrend_shadow_caps[] = {
+   GL_ALPHA_TEST,
+   GL_BLEND,
+   GL_CLIP_PLANE0,
+   GL_CLIP_PLANE1,
+   GL_CLIP_PLANE2,
+   GL_CLIP_PLANE3,
+   GL_CLIP_PLANE4,
+   GL_CLIP_PLANE5,
+   GL_CLIP_PLANE0 + 6,
+   GL_CLIP_PLANE0 + 7,
+   GL_COLOR_LOGIC_OP,
+   GL_CULL_FACE,
+   GL_DEPTH_CLAMP,
+   GL_DEPTH_TEST,
+   GL_DITHER,
+   GL_FRAMEBUFFER_SRGB,
+   GL_LINE_SMOOTH,
+   GL_MULTISAMPLE,
+   GL_POLYGON_OFFSET_FILL,
+   GL_POLYGON_OFFSET_LINE,
+   GL_POLYGON_OFFSET_POINT,
+   GL_POLYGON_SMOOTH,
+   GL_POLYGON_STIPPLE,
+   GL_PRIMITIVE_RESTART,
+   GL_PRIMITIVE_RESTART_FIXED_INDEX,
+   GL_PROGRAM_POINT_SIZE,
+   GL_RASTERIZER_DISCARD,
+   GL_SAMPLE_ALPHA_TO_COVERAGE,
+   GL_SAMPLE_ALPHA_TO_ONE,
+   GL_SAMPLE_MASK,
+   GL_SAMPLE_SHADING,
+   GL_SCISSOR_TEST,
+   GL_STENCIL_TEST,
+   GL_TEXTURE_CUBE_MAP_SEAMLESS,
+};
+
+/* GL_ELEMENT_ARRAY_BUFFER is left out on purpose, it is VAO state */
+static const GLenum vrend_shadow_buffer_targets[] = {
+   GL_ARRAY_BUFFER,
+   GL_COPY_READ_BUFFER,
+   GL_COPY_WRITE_BUFFER,
+   GL_DISPATCH_INDIRECT_BUFFER,
+   GL_DRAW_INDIRECT_BUFFER,
+   GL_PIXEL_PACK_BUFFER,
+   GL_PIXEL_UNPACK_BUFFER,
+   GL_QUERY_BUFFER,
+};
+
+static const GLenum vrend_shadow_pixel_stores[] = {
+   GL_PACK_ALIGNMENT,
+   GL_PACK_INVERT_MESA,
+   GL_PACK_ROW_LENGTH,
+   GL_UNPACK_ALIGNMENT,
+   GL_UNPACK_IMAGE_HEIGHT,
+   GL_UNPACK_ROW_LENGTH,
+   GL_UNPACK_SKIP_IMAGES,
+   GL_UNPACK_SKIP_PIXELS,
+   GL_UNPACK_SKIP_ROWS,
+};
+
+/* everything starts out unknown, except the program which is 0 in a new
+ * context; a zeroed struct is a valid shadow */
+struct vrend_gl_shadow {
+   uint64_t caps_known;
+   uint64_t caps_enabled;
+
+   GLuint buffers[ARRAY_SIZE(vrend_shadow_buffer_targets)];
+   uint32_t buffers_known;
+   uint32_t buffer_serial;
+
+   GLint pixel_stores[ARRAY_SIZE(vrend_shadow_pixel_stores)];
+   uint32_t pixel_stores_known;
+
+   GLenum active_texture;
+   GLuint program;
+};
+
+enum vrend_shadow_stat {
+   VREND_SHADOW_CAP,
+   VREND_SHADOW_BUFFER,
+   VREND_SHADOW_PIXEL_STORE,
+   VREND_SHADOW_ACTIVE_TEXTURE,
+   VREND_SHADOW_PROGRAM,
+   VREND_SHADOW_NUM_STATS,
+};
+
+static const char *vrend_shadow_stat_names[VREND_SHADOW_NUM_STATS] = {
+   [VREND_SHADOW_CAP] = "glEnable/glDisable",
+   [VREND_SHADOW_BUFFER] = "glBindBuffer",
+   [VREND_SHADOW_PIXEL_STORE] = "glPixelStorei",
+   [VREND_SHADOW_ACTIVE_TEXTURE] = "glActiveTexture",
+   [VREND_SHADOW_PROGRAM] = "glUseProgram",
+};
+
+/* the cached state of the sub context that last had the host context */
+struct vrend_virtual_hw {
+   struct pipe_rasterizer_state rs_state;
+   struct pipe_blend_state blend_state;
+   bool depth_test_enabled;
+   bool alpha_test_enabled;
+   bool stencil_test_enabled;
+};
+
 struct global_renderer_state {
    int gl_major_ver;
    int gl_minor_ver;
@@ -231,6 +434,9 @@ struct global_renderer_state {
    /* these appeared broken on at least one driver */
    bool use_explicit_locations;
    uint32_t max_uniform_blocks;
+   /* constants go through a streaming uniform buffer when non zero */
+   uint32_t max_const_ubo_size;
+   uint32_t ubo_offset_align;
    uint32_t max_draw_buffers;
    struct list_head active_ctx_list;
 
@@ -238,16 +444,112 @@ struct global_renderer_state {
    bool stop_sync_thread;
    int eventfd;
 
+   /* only protects the sync thread going to sleep */
    pipe_mutex fence_mutex;
-   struct list_head fence_list;
-   struct list_head fence_wait_list;
    pipe_condvar fence_cond;
+   bool sync_thread_sleeping;
+
+   /* new fences go to the sync thread through fence_submit, retired ones
+    * come back through fence_done, see vrend_fence_queue for the ordering */
+   struct vrend_fence_queue fence_submit;
+   struct vrend_fence_queue fence_done;
+   /* timelines with pending fences, owned by the retiring thread */
+   struct list_head fence_active;
+   struct vrend_fence *fence_pool;
+
+   struct list_head fence_timelines;
+   uint64_t fence_seqno;
+   bool use_ctx_fences;
 
    pipe_thread sync_thread;
    virgl_gl_context sync_context;
+
+   /* all sub contexts share one host context */
+   bool use_virtual_ctx;
+   bool virtual_ctx_current;
+   virgl_gl_context virtual_gl_context;
+   struct vrend_sub_context *virtual_sub;
+   struct vrend_gl_shadow virtual_gl_shadow;
+   struct vrend_virtual_hw virtual_hw;
+
+   /* large transfers, see vrend_upload_queue */
+   pipe_thread upload_thread;
+   virgl_gl_context upload_context;
+   pipe_mutex upload_mutex;
+   pipe_condvar upload_cond;
+   pipe_condvar upload_idle_cond;
+   struct list_head upload_queue;
+   struct list_head upload_done;
+   uint32_t upload_pending;
+   bool stop_upload_thread;
+   /* fenced after the last finished job, taken by the main thread */
+   GLsync upload_sync;
+   /* main thread only */
+   bool upload_batch_open;
+   GLsync upload_wait_sync;
+   uint32_t upload_serial;
+
+   /* buffer suballocation */
+   bool use_buffer_suballoc;
+   uint32_t suballoc_min_order;
+   struct list_head buffer_slabs[VREND_SUBALLOC_NUM_ORDERS];
+
+   /* recycled GL objects */
+   struct list_head resource_pool;
+   uint64_t resource_pool_size;
+   uint32_t resource_pool_epoch;
+
+   /* estimated GL memory of resident resources, idle ones in LRU order */
+   struct list_head resource_lru;
+   uint64_t mem_used;
+   uint64_t mem_budget;
+
+   /* allocate GL storage on first use instead of at creation */
+   bool use_lazy_alloc;
+
+   /* fetch query results through query buffer objects */
+   bool use_qbo;
+
+   /* interned blend, dsa and rasterizer states */
+   struct util_hash_table *state_hash;
+   /* GL sampler objects by sampler state and variant */
+   struct util_hash_table *sampler_cache;
+
+   /* VAO cache entries of all sub contexts, and a serial bumped whenever
+    * a GL buffer that may be bound to a VAO is deleted */
+   struct list_head vao_entries;
+   uint32_t vbo_serial;
+   /* FBO cache entries of all sub contexts */
+   struct list_head fbo_entries;
+
+   /* texture unit left active after binding samplers, so texture binds
+    * done outside of draws don't clobber the sampler units */
+   int scratch_texture_unit;
+
+   /* shadow of the current GL context, NULL if it isn't a sub context */
+   struct vrend_gl_shadow *gl_shadow;
+   /* bumped whenever a GL buffer is deleted, as that unbinds it */
+   uint32_t buffer_serial;
+   uint64_t shadow_calls[VREND_SHADOW_NUM_STATS];
+   uint64_t shadow_elided[VREND_SHADOW_NUM_STATS];
+   bool print_shadow_stats;
+
+   struct vrend_format_table tex_conv_table[VIRGL_FORMAT_MAX];
 };
 
-static struct global_renderer_state vrend_state;
+struct vrend_renderer_instance {
+   struct vrend_instance base;
+   struct global_renderer_state state;
+};
+
+/* what a thread sees before it created its own instance, read-only since
+ * it is shared by all of them */
+static const struct vrend_renderer_instance vrend_null_instance;
+
+__thread struct vrend_instance *vrend_instance =
+   (struct vrend_instance *)&vrend_null_instance.base;
+
+#define vrend_state (((struct vrend_renderer_instance *)vrend_instance)->state)
 
 static inline bool has_feature(enum features_id feature_id)
 {
@@ -274,6 +576,7 @@ struct vrend_linked_shader_program {
    GLuint *shadow_samp_add_locs[PIPE_SHADER_TYPES];
 
    GLint *const_locs[PIPE_SHADER_TYPES];
+   GLuint const_ubo_locs[PIPE_SHADER_TYPES];
 
    GLuint *attrib_locs;
    uint32_t shadow_samp_mask[PIPE_SHADER_TYPES];
@@ -333,9 +636,21 @@ struct vrend_surface {
    struct vrend_resource *texture;
 };
 
+/* GL sampler objects are shared through vrend_state.sampler_cache */
+#define VREND_SAMPLER_VARIANT_DECODE         (1 << 0)
+#define VREND_SAMPLER_VARIANT_EMULATED_ALPHA (1 << 1)
+#define VREND_SAMPLER_NUM_VARIANTS           4
+
+struct vrend_sampler_object {
+   struct pipe_reference reference;
+   struct pipe_sampler_state state;
+   uint32_t variant;
+   GLuint id;
+};
+
 struct vrend_sampler_state {
    struct pipe_sampler_state base;
-   GLuint ids[2];
+   struct vrend_sampler_object *objs[VREND_SAMPLER_NUM_VARIANTS];
 };
 
 struct vrend_so_target {
@@ -409,6 +724,83 @@ struct vrend_vertex_element_array {
    unsigned count;
    struct vrend_vertex_element elements[PIPE_MAX_ATTRIBS];
    GLuint id;
+
+   /* vertex buffers bound to the VAO, when using attrib binding */
+   struct {
+      GLuint id;
+      uint32_t offset;
+      uint32_t stride;
+   } bound_vbos[PIPE_MAX_ATTRIBS];
+   int num_bound_vbos;
+   uint32_t vbo_serial;
+};
+
+/* Without attrib binding, every distinct vertex layout gets its own VAO,
+ * looked up by the elements, the program and the vertex buffers used.
+ */
+#define VREND_VAO_CACHE_SIZE 64
+
+/* zero stride attributes are read from a CPU copy of buffers up to this size */
+#define VREND_ATTRIB_SHADOW_MAX_SIZE 4096
+
+struct vrend_vao_key {
+   struct vrend_vertex_element_array *ve;
+   struct vrend_linked_shader_program *prog;
+   GLuint buffer_ids[PIPE_MAX_ATTRIBS];
+   uint32_t offsets[PIPE_MAX_ATTRIBS];
+   uint32_t strides[PIPE_MAX_ATTRIBS];
+};
+
+struct vrend_vao_entry {
+   struct list_head head;
+   struct list_head global;
+   struct vrend_vao_key key;
+   unsigned hash;
+   GLuint id;
+   /* zero stride elements are set with glVertexAttrib, which isn't VAO state */
+   uint32_t zero_stride_mask;
+   GLint locs[PIPE_MAX_ATTRIBS];
+   bool stale;
+};
+
+/* Framebuffer objects of a sub context by their attachments. The color
+ * buffers come first, the depth/stencil buffer is in the last slot.
+ */
+#define VREND_FBO_CACHE_SIZE 32
+#define VREND_FBO_ZS_SLOT PIPE_MAX_COLOR_BUFS
+
+struct vrend_fbo_key {
+   GLuint ids[PIPE_MAX_COLOR_BUFS + 1];
+   uint32_t levels[PIPE_MAX_COLOR_BUFS + 1];
+   uint32_t layers[PIPE_MAX_COLOR_BUFS + 1];
+   uint32_t nr_cbufs;
+};
+
+struct vrend_fbo_entry {
+   struct list_head head;
+   struct list_head global;
+   struct vrend_fbo_key key;
+   unsigned hash;
+   GLuint id;
+   bool stale;
+};
+
+#define VREND_CONST_RING_SIZE (1024 * 1024)
+#define VREND_CONST_RING_SEGMENTS 4
+#define VREND_CONST_RING_SEGMENT_SIZE (VREND_CONST_RING_SIZE / VREND_CONST_RING_SEGMENTS)
+
+/* Constants of shaders that declare them as a uniform block are streamed
+ * through a persistently mapped ring. The ring is split in segments, and
+ * a fence is placed behind a segment when writing moves past it, so it is
+ * only reused once the draws reading from it are done.
+ */
+struct vrend_const_ring {
+   GLuint id;
+   uint8_t *map;
+   uint32_t head;
+   GLsync fences[VREND_CONST_RING_SEGMENTS];
+   /* segment of the range bound for each stage, -1 once it is reused */
+   int stage_segs[PIPE_SHADER_TYPES];
 };
 
 struct vrend_constants {
@@ -448,18 +840,25 @@ struct vrend_sub_context {
    struct list_head head;
 
    virgl_gl_context gl_context;
+   /* last upload fence this context waited for */
+   uint32_t upload_serial;
+   struct vrend_context *parent;
 
    int sub_ctx_id;
 
    GLuint vaoid;
-   uint32_t enabled_attribs_bitmask;
+   struct list_head vao_cache;
+   unsigned num_vaos;
+
+   /* the GL blitter draws with these, VAOs and FBOs aren't shared */
+   GLuint blit_vaoid;
+   GLuint blit_fb_id;
 
    struct list_head programs;
-   struct util_hash_table *object_hash;
+   struct vrend_object_table *object_hash;
 
    struct vrend_vertex_element_array *ve;
    int num_vbos;
-   int old_num_vbos; /* for cleaning up */
    struct pipe_vertex_buffer vbo[PIPE_MAX_ATTRIBS];
    uint32_t vbo_res_ids[PIPE_MAX_ATTRIBS];
 
@@ -469,6 +868,10 @@ struct vrend_sub_context {
    bool vbo_dirty;
    bool shader_dirty;
    bool cs_shader_dirty;
+   /* bumped by the state shader keys, blend patching and the front face
+    * are derived from, draws at the epoch they were done for skip them */
+   uint32_t state_epoch;
+   uint32_t drawn_epoch;
    bool sampler_state_dirty;
    bool stencil_state_dirty;
    bool image_state_dirty;
@@ -484,12 +887,28 @@ struct vrend_sub_context {
    bool const_dirty[PIPE_SHADER_TYPES];
    struct vrend_sampler_state *sampler_state[PIPE_SHADER_TYPES][PIPE_MAX_SAMPLERS];
 
+   /* binding slots to re-emit on the next draw, and the texture units and
+    * uniform block bindings the slots were last emitted to */
+   uint32_t views_dirty[PIPE_SHADER_TYPES];
+   uint32_t ubos_dirty[PIPE_SHADER_TYPES];
+   uint32_t ssbos_dirty[PIPE_SHADER_TYPES];
+   uint32_t images_dirty[PIPE_SHADER_TYPES];
+   uint32_t abos_dirty;
+   int view_units[PIPE_SHADER_TYPES][PIPE_MAX_SHADER_SAMPLER_VIEWS];
+   int ubo_bindings[PIPE_SHADER_TYPES][PIPE_MAX_CONSTANT_BUFFERS];
+   int const_ubo_bindings[PIPE_SHADER_TYPES];
+
+   struct vrend_const_ring const_ring;
+
    struct pipe_constant_buffer cbs[PIPE_SHADER_TYPES][PIPE_MAX_CONSTANT_BUFFERS];
    uint32_t const_bufs_used_mask[PIPE_SHADER_TYPES];
 
    int num_sampler_states[PIPE_SHADER_TYPES];
 
+   /* bound framebuffer, owned by fbo_cache */
    uint32_t fb_id;
+   struct list_head fbo_cache;
+   unsigned num_fbos;
    int nr_cbufs, old_nr_cbufs;
    struct vrend_surface *zsurf;
    struct vrend_surface *surf[PIPE_MAX_COLOR_BUFS];
@@ -514,17 +933,25 @@ struct vrend_sub_context {
       with 0,0 as the bottom corner */
    bool inverted_fbo_content;
 
-   GLuint blit_fb_ids[2];
 
+   /* bound interned states, referenced */
+   struct pipe_blend_state *blend;
    struct pipe_depth_stencil_alpha_state *dsa;
+   struct pipe_rasterizer_state *rs;
 
    struct pipe_clip_state ucp_state;
+   struct pipe_poly_stipple poly_stipple;
+   unsigned sample_mask;
+   float min_sample_shading;
+   float tess_factors[6];
+   /* begun queries, they are split around work the guest didn't ask for */
+   struct list_head active_queries;
 
    bool depth_test_enabled;
    bool alpha_test_enabled;
    bool stencil_test_enabled;
 
-   GLuint program_id;
+   struct vrend_gl_shadow gl_shadow;
    int last_shader_idx;
 
    struct pipe_rasterizer_state hw_rs_state;
@@ -567,7 +994,8 @@ struct vrend_context {
    enum virgl_ctx_errors last_error;
 
    /* resource bounds to this context */
-   struct util_hash_table *res_hash;
+   struct vrend_object_table *res_hash;
+   uint64_t res_mem_used;
 
    struct list_head active_nontimer_query_list;
    struct list_head ctx_entry;
@@ -577,6 +1005,9 @@ struct vrend_context {
 
 struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx, int res_handle);
 static void vrend_pause_render_condition(struct vrend_context *ctx, bool pause);
+static void vrend_virtual_ctx_switch(struct vrend_sub_context *sub);
+static void vrend_virtual_ctx_suspend(struct vrend_sub_context *sub);
+static void vrend_sub_pause_queries(struct vrend_sub_context *sub, bool pause);
 static void vrend_update_viewport_state(struct vrend_context *ctx);
 static void vrend_update_scissor_state(struct vrend_context *ctx);
 static void vrend_destroy_query_object(void *obj_ptr);
@@ -587,6 +1018,20 @@ static void vrender_get_glsl_version(int *glsl_version);
 static void vrend_destroy_resource_object(void *obj_ptr);
 static void vrend_renderer_detach_res_ctx_p(struct vrend_context *ctx, int res_handle);
 static void vrend_destroy_program(struct vrend_linked_shader_program *ent);
+static void vrend_vao_cache_invalidate(struct vrend_vertex_element_array *ve,
+                                       struct vrend_linked_shader_program *prog,
+                                       GLuint buffer_id);
+static void vrend_buffer_suballoc_init(void);
+static void vrend_buffer_suballoc_fini(void);
+static void vrend_const_ubo_init(void);
+static void vrend_resource_pool_trim(uint64_t max_size);
+static void vrend_resource_pool_fini(void);
+static void vrend_resource_pin(struct vrend_resource *res);
+static void vrend_resource_drop_shadow(struct vrend_resource *res, bool gpu_writable);
+static void vrend_fbo_cache_invalidate(GLuint tex_id);
+static int vrend_resource_make_resident(struct vrend_resource *res);
+static int vrend_resource_use(struct vrend_resource *res);
+static void vrend_resource_enforce_budget(void);
 static void vrend_apply_sampler_state(struct vrend_context *ctx,
                                       struct vrend_resource *res,
                                       uint32_t shader_type,
@@ -595,20 +1040,18 @@ static GLenum tgsitargettogltarget(const enum pipe_texture_target target, int nr
 
 void vrend_update_stencil_state(struct vrend_context *ctx);
 
-static struct vrend_format_table tex_conv_table[VIRGL_FORMAT_MAX];
-
 static inline bool vrend_format_can_sample(enum virgl_formats format)
 {
-   return tex_conv_table[format].bindings & VIRGL_BIND_SAMPLER_VIEW;
+   return vrend_state.tex_conv_table[format].bindings & VIRGL_BIND_SAMPLER_VIEW;
 }
 static inline bool vrend_format_can_render(enum virgl_formats format)
 {
-   return tex_conv_table[format].bindings & VIRGL_BIND_RENDER_TARGET;
+   return vrend_state.tex_conv_table[format].bindings & VIRGL_BIND_RENDER_TARGET;
 }
 
 static inline bool vrend_format_is_ds(enum virgl_formats format)
 {
-   return tex_conv_table[format].bindings & VIRGL_BIND_DEPTH_STENCIL;
+   return vrend_state.tex_conv_table[format].bindings & VIRGL_BIND_DEPTH_STENCIL;
 }
 
 bool vrend_is_ds_format(enum virgl_formats format)
@@ -626,7 +1069,7 @@ bool vrend_format_is_emulated_alpha(enum virgl_formats format)
 
 static bool vrend_format_needs_swizzle(enum virgl_formats format)
 {
-   return tex_conv_table[format].flags & VIRGL_BIND_NEED_SWIZZLE;
+   return vrend_state.tex_conv_table[format].flags & VIRGL_BIND_NEED_SWIZZLE;
 }
 
 static inline const char *pipe_shader_to_prefix(int shader_type)
@@ -736,8 +1179,10 @@ static void init_features(int gl_ver, int gles_ver)
 
 static void vrend_destroy_surface(struct vrend_surface *surf)
 {
-   if (surf->id != surf->texture->id)
+   if (surf->id != surf->texture->id) {
+      vrend_fbo_cache_invalidate(surf->id);
       glDeleteTextures(1, &surf->id);
+   }
    vrend_resource_reference(&surf->texture, NULL);
    free(surf);
 }
@@ -852,25 +1297,25 @@ vrend_shader_state_reference(struct vrend_shader_selector **ptr, struct vrend_sh
 void
 vrend_insert_format(struct vrend_format_table *entry, uint32_t bindings)
 {
-   tex_conv_table[entry->format] = *entry;
-   tex_conv_table[entry->format].bindings = bindings;
+   vrend_state.tex_conv_table[entry->format] = *entry;
+   vrend_state.tex_conv_table[entry->format].bindings = bindings;
 }
 
 void
 vrend_insert_format_swizzle(int override_format, struct vrend_format_table *entry, uint32_t bindings, uint8_t swizzle[4])
 {
    int i;
-   tex_conv_table[override_format] = *entry;
-   tex_conv_table[override_format].bindings = bindings;
-   tex_conv_table[override_format].flags = VIRGL_BIND_NEED_SWIZZLE;
+   vrend_state.tex_conv_table[override_format] = *entry;
+   vrend_state.tex_conv_table[override_format].bindings = bindings;
+   vrend_state.tex_conv_table[override_format].flags = VIRGL_BIND_NEED_SWIZZLE;
    for (i = 0; i < 4; i++)
-      tex_conv_table[override_format].swizzle[i] = swizzle[i];
+      vrend_state.tex_conv_table[override_format].swizzle[i] = swizzle[i];
 }
 
 const struct vrend_format_table *
 vrend_get_format_table_entry(enum virgl_formats format)
 {
-   return &tex_conv_table[format];
+   return &vrend_state.tex_conv_table[format];
 }
 
 static bool vrend_is_timer_query(GLenum gltype)
@@ -879,12 +1324,180 @@ static bool vrend_is_timer_query(GLenum gltype)
       gltype == GL_TIME_ELAPSED;
 }
 
-static void vrend_use_program(struct vrend_context *ctx, GLuint program_id)
+static inline bool vrend_shadow_elide(enum vrend_shadow_stat stat, bool same)
+{
+   vrend_state.shadow_calls[stat]++;
+   if (same)
+      vrend_state.shadow_elided[stat]++;
+   return same;
+}
+
+static int vrend_shadow_index(const GLenum *table, unsigned count, GLenum value)
+{
+   unsigned i;
+   for (i = 0; i < count; i++)
+      if (table[i] == value)
+         return i;
+   return -1;
+}
+
+static void vrend_set_cap(GLenum cap, bool enable)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+   int idx = -1;
+
+   if (shadow)
+      idx = vrend_shadow_index(vrend_shadow_caps, ARRAY_SIZE(vrend_shadow_caps), cap);
+
+   if (idx >= 0) {
+      uint64_t bit = 1ull << idx;
+      if (vrend_shadow_elide(VREND_SHADOW_CAP, (shadow->caps_known & bit) &&
+                             !!(shadow->caps_enabled & bit) == enable))
+         return;
+      shadow->caps_known |= bit;
+      if (enable)
+         shadow->caps_enabled |= bit;
+      else
+         shadow->caps_enabled &= ~bit;
+   }
+
+   if (enable)
+      glEnable(cap);
+   else
+      glDisable(cap);
+}
+
+static inline void vrend_enable(GLenum cap)
+{
+   vrend_set_cap(cap, true);
+}
+
+static inline void vrend_disable(GLenum cap)
+{
+   vrend_set_cap(cap, false);
+}
+
+/* per draw buffer changes make the global cap state unknown */
+static void vrend_set_cap_indexed(GLenum cap, GLuint index, bool enable)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+
+   if (shadow) {
+      int idx = vrend_shadow_index(vrend_shadow_caps, ARRAY_SIZE(vrend_shadow_caps), cap);
+      if (idx >= 0)
+         shadow->caps_known &= ~(1ull << idx);
+   }
+
+   if (enable)
+      glEnableIndexedEXT(cap, index);
+   else
+      glDisableIndexedEXT(cap, index);
+}
+
+void vrend_bind_buffer(GLenum target, GLuint id)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+   int idx = -1;
+
+   if (shadow)
+      idx = vrend_shadow_index(vrend_shadow_buffer_targets,
+                               ARRAY_SIZE(vrend_shadow_buffer_targets), target);
+
+   if (idx >= 0) {
+      uint32_t bit = 1u << idx;
+      /* a deleted buffer name may have been handed out again */
+      if (shadow->buffer_serial != vrend_state.buffer_serial) {
+         shadow->buffers_known = 0;
+         shadow->buffer_serial = vrend_state.buffer_serial;
+      }
+      if (vrend_shadow_elide(VREND_SHADOW_BUFFER, (shadow->buffers_known & bit) &&
+                             shadow->buffers[idx] == id))
+         return;
+      shadow->buffers_known |= bit;
+      shadow->buffers[idx] = id;
+   }
+
+   glBindBufferARB(target, id);
+}
+
+void vrend_delete_buffers(GLsizei n, const GLuint *ids)
+{
+   glDeleteBuffers(n, ids);
+   vrend_state.buffer_serial++;
+}
+
+static void vrend_pixel_store(GLenum pname, GLint param)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+   int idx = -1;
+
+   if (shadow)
+      idx = vrend_shadow_index(vrend_shadow_pixel_stores,
+                               ARRAY_SIZE(vrend_shadow_pixel_stores), pname);
+
+   if (idx >= 0) {
+      uint32_t bit = 1u << idx;
+      if (vrend_shadow_elide(VREND_SHADOW_PIXEL_STORE, (shadow->pixel_stores_known & bit) &&
+                             shadow->pixel_stores[idx] == param))
+         return;
+      shadow->pixel_stores_known |= bit;
+      shadow->pixel_stores[idx] = param;
+   }
+
+   glPixelStorei(pname, param);
+}
+
+static void vrend_active_texture(GLenum texture)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+
+   if (shadow) {
+      if (vrend_shadow_elide(VREND_SHADOW_ACTIVE_TEXTURE, shadow->active_texture == texture))
+         return;
+      shadow->active_texture = texture;
+   }
+
+   glActiveTexture(texture);
+}
+
+void vrend_use_program(UNUSED struct vrend_context *ctx, GLuint program_id)
+{
+   struct vrend_gl_shadow *shadow = vrend_state.gl_shadow;
+
+   if (shadow) {
+      if (vrend_shadow_elide(VREND_SHADOW_PROGRAM, shadow->program == program_id))
+         return;
+      shadow->program = program_id;
+   }
+
+   glUseProgram(program_id);
+}
+
+static void vrend_print_shadow_stats(void)
 {
-   if (ctx->sub->program_id != program_id) {
-      glUseProgram(program_id);
-      ctx->sub->program_id = program_id;
+   int i;
+
+   for (i = 0; i < VREND_SHADOW_NUM_STATS; i++)
+      debug_printf("shadow: %s elided %llu of %llu calls\n",
+              vrend_shadow_stat_names[i],
+              (unsigned long long)vrend_state.shadow_elided[i],
+              (unsigned long long)vrend_state.shadow_calls[i]);
+}
+
+static void vrend_make_current(struct vrend_sub_context *sub)
+{
+   if (vrend_state.use_virtual_ctx) {
+      if (!vrend_state.virtual_ctx_current) {
+         vrend_clicbs->make_current(0, vrend_state.virtual_gl_context);
+         vrend_state.virtual_ctx_current = true;
+      }
+      vrend_state.gl_shadow = &vrend_state.virtual_gl_shadow;
+      vrend_virtual_ctx_switch(sub);
+   } else {
+      vrend_clicbs->make_current(0, sub->gl_context);
+      vrend_state.gl_shadow = &sub->gl_shadow;
    }
+   vrend_renderer_upload_wait(&sub->upload_serial);
 }
 
 static void vrend_init_pstipple_texture(struct vrend_context *ctx)
@@ -905,9 +1518,9 @@ static void vrend_depth_test_enable(struct vrend_context *ctx, bool depth_test_e
    if (ctx->sub->depth_test_enabled != depth_test_enable) {
       ctx->sub->depth_test_enabled = depth_test_enable;
       if (depth_test_enable)
-         glEnable(GL_DEPTH_TEST);
+         vrend_enable(GL_DEPTH_TEST);
       else
-         glDisable(GL_DEPTH_TEST);
+         vrend_disable(GL_DEPTH_TEST);
    }
 }
 
@@ -920,9 +1533,9 @@ static void vrend_alpha_test_enable(struct vrend_context *ctx, bool alpha_test_e
    if (ctx->sub->alpha_test_enabled != alpha_test_enable) {
       ctx->sub->alpha_test_enabled = alpha_test_enable;
       if (alpha_test_enable)
-         glEnable(GL_ALPHA_TEST);
+         vrend_enable(GL_ALPHA_TEST);
       else
-         glDisable(GL_ALPHA_TEST);
+         vrend_disable(GL_ALPHA_TEST);
    }
 }
 
@@ -931,9 +1544,9 @@ static void vrend_stencil_test_enable(struct vrend_context *ctx, bool stencil_te
    if (ctx->sub->stencil_test_enabled != stencil_test_enable) {
       ctx->sub->stencil_test_enabled = stencil_test_enable;
       if (stencil_test_enable)
-         glEnable(GL_STENCIL_TEST);
+         vrend_enable(GL_STENCIL_TEST);
       else
-         glDisable(GL_STENCIL_TEST);
+         vrend_disable(GL_STENCIL_TEST);
    }
 }
 
@@ -1091,7 +1704,13 @@ static void bind_sampler_locs(struct vrend_linked_shader_program *sprog,
 static void bind_const_locs(struct vrend_linked_shader_program *sprog,
                             int id)
 {
-  if (sprog->ss[id]->sel->sinfo.num_consts) {
+  sprog->const_ubo_locs[id] = GL_INVALID_INDEX;
+  if (sprog->ss[id]->sel->sinfo.const_ubo) {
+      char name[32];
+      snprintf(name, 32, "%sconstbuf", pipe_shader_to_prefix(id));
+      sprog->const_ubo_locs[id] = glGetUniformBlockIndex(sprog->id, name);
+      sprog->const_locs[id] = NULL;
+  } else if (sprog->ss[id]->sel->sinfo.num_consts) {
       sprog->const_locs[id] = calloc(sprog->ss[id]->sel->sinfo.num_consts, sizeof(uint32_t));
       if (sprog->const_locs[id]) {
          const char *prefix = pipe_shader_to_prefix(id);
@@ -1450,6 +2069,7 @@ static struct vrend_linked_shader_program *lookup_shader_program(struct vrend_co
 static void vrend_destroy_program(struct vrend_linked_shader_program *ent)
 {
    int i;
+   vrend_vao_cache_invalidate(NULL, ent, 0);
    glDeleteProgram(ent->id);
    list_del(&ent->head);
 
@@ -1505,10 +2125,11 @@ int vrend_create_surface(struct vrend_context *ctx,
    }
 
    res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-   if (!res) {
+   if (!res || vrend_resource_use(res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
    }
+   vrend_resource_pin(res);
 
    surf = CALLOC_STRUCT(vrend_surface);
    if (!surf)
@@ -1535,7 +2156,7 @@ int vrend_create_surface(struct vrend_context *ctx,
       if ((first_layer != last_layer &&
            (first_layer != 0 || (last_layer != (int)util_max_layer(&res->base, surf->val0)))) ||
           surf->format != res->base.format) {
-         GLenum internalformat = tex_conv_table[surf->format].internalformat;
+         GLenum internalformat = vrend_state.tex_conv_table[surf->format].internalformat;
          glGenTextures(1, &surf->id);
          glTextureView(surf->id, res->target, res->id, internalformat,
                        0, res->base.last_level + 1,
@@ -1608,19 +2229,11 @@ static void vrend_destroy_vertex_elements_object(void *obj_ptr)
 
    if (has_feature(feat_gles31_vertex_attrib_binding)) {
       glDeleteVertexArrays(1, &v->id);
-   }
+   } else
+      vrend_vao_cache_invalidate(v, NULL, 0);
    FREE(v);
 }
 
-static void vrend_destroy_sampler_state_object(void *obj_ptr)
-{
-   struct vrend_sampler_state *state = obj_ptr;
-
-   if (has_feature(feat_samplers))
-      glDeleteSamplers(2, state->ids);
-   FREE(state);
-}
-
 static GLuint convert_wrap(int wrap)
 {
    switch(wrap){
@@ -1666,6 +2279,107 @@ static inline GLenum convert_min_filter(unsigned int filter, unsigned int mip_fi
    return 0;
 }
 
+static void vrend_hash_table_noop(UNUSED void *value)
+{
+}
+
+static unsigned vrend_sampler_object_hash(void *key)
+{
+   struct vrend_sampler_object *obj = key;
+   const uint8_t *bytes = (const uint8_t *)&obj->state;
+   unsigned hash = 2166136261u ^ obj->variant;
+   uint32_t i;
+
+   for (i = 0; i < sizeof(obj->state); i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
+   return hash;
+}
+
+static int vrend_sampler_object_compare(void *key1, void *key2)
+{
+   struct vrend_sampler_object *a = key1, *b = key2;
+
+   if (a->variant != b->variant)
+      return 1;
+   return memcmp(&a->state, &b->state, sizeof(a->state));
+}
+
+static struct vrend_sampler_object *
+vrend_sampler_object_get(const struct pipe_sampler_state *templ, uint32_t variant)
+{
+   struct vrend_sampler_object key, *obj;
+   union pipe_color_union border_color;
+
+   memset(&key, 0, sizeof(key));
+   key.state = *templ;
+   key.variant = variant;
+
+   obj = util_hash_table_get(vrend_state.sampler_cache, &key);
+   if (obj) {
+      pipe_reference(NULL, &obj->reference);
+      return obj;
+   }
+
+   obj = CALLOC_STRUCT(vrend_sampler_object);
+   if (!obj)
+      return NULL;
+
+   *obj = key;
+   pipe_reference_init(&obj->reference, 1);
+
+   /*
+    * If we emulate alpha format with red, we need to tell
+    * the sampler to use the red channel and not the alpha one
+    * by swizzling the GL_TEXTURE_BORDER_COLOR parameter.
+    */
+   border_color = templ->border_color;
+   if (variant & VREND_SAMPLER_VARIANT_EMULATED_ALPHA) {
+      border_color.ui[0] = border_color.ui[3];
+      border_color.ui[3] = 0;
+   }
+
+   glGenSamplers(1, &obj->id);
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_S, convert_wrap(templ->wrap_s));
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_T, convert_wrap(templ->wrap_t));
+   glSamplerParameteri(obj->id, GL_TEXTURE_WRAP_R, convert_wrap(templ->wrap_r));
+   glSamplerParameterf(obj->id, GL_TEXTURE_MIN_FILTER, convert_min_filter(templ->min_img_filter, templ->min_mip_filter));
+   glSamplerParameterf(obj->id, GL_TEXTURE_MAG_FILTER, convert_mag_filter(templ->mag_img_filter));
+   glSamplerParameterf(obj->id, GL_TEXTURE_MIN_LOD, templ->min_lod);
+   glSamplerParameterf(obj->id, GL_TEXTURE_MAX_LOD, templ->max_lod);
+   glSamplerParameteri(obj->id, GL_TEXTURE_COMPARE_MODE, templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE);
+   glSamplerParameteri(obj->id, GL_TEXTURE_COMPARE_FUNC, GL_NEVER + templ->compare_func);
+   if (!vrend_state.use_gles) {
+      glSamplerParameteri(obj->id, GL_TEXTURE_CUBE_MAP_SEAMLESS, templ->seamless_cube_map);
+      glSamplerParameterf(obj->id, GL_TEXTURE_LOD_BIAS, templ->lod_bias);
+   }
+   glSamplerParameterIuiv(obj->id, GL_TEXTURE_BORDER_COLOR, border_color.ui);
+   glSamplerParameteri(obj->id, GL_TEXTURE_SRGB_DECODE_EXT,
+                       (variant & VREND_SAMPLER_VARIANT_DECODE) ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT);
+
+   util_hash_table_set(vrend_state.sampler_cache, obj, obj);
+   return obj;
+}
+
+static void vrend_sampler_object_unref(struct vrend_sampler_object *obj)
+{
+   if (!obj || !pipe_reference(&obj->reference, NULL))
+      return;
+
+   util_hash_table_remove(vrend_state.sampler_cache, obj);
+   glDeleteSamplers(1, &obj->id);
+   FREE(obj);
+}
+
+static void vrend_destroy_sampler_state_object(void *obj_ptr)
+{
+   struct vrend_sampler_state *state = obj_ptr;
+   int i;
+
+   for (i = 0; i < VREND_SAMPLER_NUM_VARIANTS; i++)
+      vrend_sampler_object_unref(state->objs[i]);
+   FREE(state);
+}
+
 int vrend_create_sampler_state(struct vrend_context *ctx,
                                uint32_t handle,
                                struct pipe_sampler_state *templ)
@@ -1678,73 +2392,142 @@ int vrend_create_sampler_state(struct vrend_context *ctx,
 
    state->base = *templ;
 
-   if (has_feature(feat_samplers)) {
-      glGenSamplers(2, state->ids);
-
-      for (int i = 0; i < 2; ++i) {
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_S, convert_wrap(templ->wrap_s));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_T, convert_wrap(templ->wrap_t));
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_WRAP_R, convert_wrap(templ->wrap_r));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_FILTER, convert_min_filter(templ->min_img_filter, templ->min_mip_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAG_FILTER, convert_mag_filter(templ->mag_img_filter));
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MIN_LOD, templ->min_lod);
-         glSamplerParameterf(state->ids[i], GL_TEXTURE_MAX_LOD, templ->max_lod);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_MODE, templ->compare_mode ? GL_COMPARE_R_TO_TEXTURE : GL_NONE);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_COMPARE_FUNC, GL_NEVER + templ->compare_func);
-         if (vrend_state.use_gles) {
-            if (templ->lod_bias != 0.0f) {
-               report_gles_warn(ctx, GLES_WARN_LOD_BIAS, 0);
-            }
-         } else {
-            glSamplerParameteri(state->ids[i], GL_TEXTURE_CUBE_MAP_SEAMLESS, templ->seamless_cube_map);
-            glSamplerParameterf(state->ids[i], GL_TEXTURE_LOD_BIAS, templ->lod_bias);
-         }
+   if (vrend_state.use_gles && templ->lod_bias != 0.0f)
+      report_gles_warn(ctx, GLES_WARN_LOD_BIAS, 0);
 
-         glSamplerParameterIuiv(state->ids[i], GL_TEXTURE_BORDER_COLOR, templ->border_color.ui);
-         glSamplerParameteri(state->ids[i], GL_TEXTURE_SRGB_DECODE_EXT, i == 0 ? GL_SKIP_DECODE_EXT : GL_DECODE_EXT);
-      }
-   }
+   /* the GL samplers are looked up on first use, see vrend_apply_sampler_state */
    ret_handle = vrend_renderer_object_insert(ctx, state, sizeof(struct vrend_sampler_state), handle,
                                              VIRGL_OBJECT_SAMPLER_STATE);
    if (!ret_handle) {
-      if (has_feature(feat_samplers))
-         glDeleteSamplers(2, state->ids);
       FREE(state);
       return ENOMEM;
    }
    return 0;
 }
 
-static inline GLenum to_gl_swizzle(int swizzle)
+/*
+ * Blend, DSA and rasterizer states with equal contents share one refcounted
+ * copy across all contexts, so binding an equal state under another handle
+ * is a pointer compare.
+ */
+struct vrend_state_entry {
+   struct pipe_reference reference;
+   enum virgl_object_type type;
+   uint32_t size;
+   unsigned hash;
+   uint64_t data[];
+};
+
+static inline struct vrend_state_entry *vrend_state_entry_from_data(void *data)
 {
-   switch (swizzle) {
-   case PIPE_SWIZZLE_RED: return GL_RED;
-   case PIPE_SWIZZLE_GREEN: return GL_GREEN;
-   case PIPE_SWIZZLE_BLUE: return GL_BLUE;
-   case PIPE_SWIZZLE_ALPHA: return GL_ALPHA;
-   case PIPE_SWIZZLE_ZERO: return GL_ZERO;
-   case PIPE_SWIZZLE_ONE: return GL_ONE;
-   default:
-      assert(0);
-      return 0;
-   }
+   return (struct vrend_state_entry *)((char *)data - offsetof(struct vrend_state_entry, data));
 }
 
-int vrend_create_sampler_view(struct vrend_context *ctx,
-                              uint32_t handle,
-                              uint32_t res_handle, uint32_t format,
-                              uint32_t val0, uint32_t val1, uint32_t swizzle_packed)
+static unsigned vrend_state_entry_hash(void *key)
 {
-   struct vrend_sampler_view *view;
-   struct vrend_resource *res;
-   int ret_handle;
-   uint8_t swizzle[4];
+   struct vrend_state_entry *entry = key;
+   return entry->hash;
+}
 
-   res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-   if (!res) {
-      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
-      return EINVAL;
-   }
+static int vrend_state_entry_compare(void *key1, void *key2)
+{
+   struct vrend_state_entry *a = key1, *b = key2;
+
+   if (a->type != b->type || a->size != b->size)
+      return 1;
+   return memcmp(a->data, b->data, a->size);
+}
+
+static void vrend_interned_state_reference(void **ptr, void *data)
+{
+   struct vrend_state_entry *old_entry = *ptr ? vrend_state_entry_from_data(*ptr) : NULL;
+   struct vrend_state_entry *entry = data ? vrend_state_entry_from_data(data) : NULL;
+
+   if (pipe_reference(old_entry ? &old_entry->reference : NULL,
+                      entry ? &entry->reference : NULL)) {
+      util_hash_table_remove(vrend_state.state_hash, old_entry);
+      FREE(old_entry);
+   }
+   *ptr = data;
+}
+
+static void vrend_destroy_interned_state_object(void *obj_ptr)
+{
+   vrend_interned_state_reference(&obj_ptr, NULL);
+}
+
+uint32_t vrend_renderer_state_insert(struct vrend_context *ctx, void *data,
+                                     uint32_t size, uint32_t handle,
+                                     enum virgl_object_type type)
+{
+   struct vrend_state_entry *entry, *found;
+   const uint8_t *bytes;
+   void *shared = NULL;
+   uint32_t i;
+
+   entry = MALLOC(sizeof(*entry) + size);
+   if (!entry)
+      return 0;
+
+   entry->type = type;
+   entry->size = size;
+   memcpy(entry->data, data, size);
+
+   /* FNV-1a, the states are decoded into zeroed structs so padding matches */
+   bytes = (const uint8_t *)entry->data;
+   entry->hash = 2166136261u ^ type;
+   for (i = 0; i < size; i++)
+      entry->hash = (entry->hash ^ bytes[i]) * 16777619u;
+
+   found = util_hash_table_get(vrend_state.state_hash, entry);
+   if (found) {
+      FREE(entry);
+      vrend_interned_state_reference(&shared, found->data);
+   } else {
+      pipe_reference_init(&entry->reference, 1);
+      util_hash_table_set(vrend_state.state_hash, entry, entry);
+      shared = entry->data;
+   }
+
+   if (!vrend_object_insert(ctx->sub->object_hash, shared, size, handle, type)) {
+      vrend_interned_state_reference(&shared, NULL);
+      return 0;
+   }
+
+   FREE(data);
+   return handle;
+}
+
+static inline GLenum to_gl_swizzle(int swizzle)
+{
+   switch (swizzle) {
+   case PIPE_SWIZZLE_RED: return GL_RED;
+   case PIPE_SWIZZLE_GREEN: return GL_GREEN;
+   case PIPE_SWIZZLE_BLUE: return GL_BLUE;
+   case PIPE_SWIZZLE_ALPHA: return GL_ALPHA;
+   case PIPE_SWIZZLE_ZERO: return GL_ZERO;
+   case PIPE_SWIZZLE_ONE: return GL_ONE;
+   default:
+      assert(0);
+      return 0;
+   }
+}
+
+int vrend_create_sampler_view(struct vrend_context *ctx,
+                              uint32_t handle,
+                              uint32_t res_handle, uint32_t format,
+                              uint32_t val0, uint32_t val1, uint32_t swizzle_packed)
+{
+   struct vrend_sampler_view *view;
+   struct vrend_resource *res;
+   int ret_handle;
+   uint8_t swizzle[4];
+
+   res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
+   if (!res || vrend_resource_use(res)) {
+      report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
+      return EINVAL;
+   }
 
    view = CALLOC_STRUCT(vrend_sampler_view);
    if (!view)
@@ -1798,7 +2581,7 @@ int vrend_create_sampler_view(struct vrend_context *ctx,
          needs_view = true;
       if (needs_view) {
         glGenTextures(1, &view->id);
-        GLenum internalformat = tex_conv_table[format].internalformat;
+        GLenum internalformat = vrend_state.tex_conv_table[format].internalformat;
         unsigned base_layer = view->val0 & 0xffff;
         unsigned max_layer = (view->val0 >> 16) & 0xffff;
         view->cur_base = view->val1 & 0xff;
@@ -1826,15 +2609,15 @@ int vrend_create_sampler_view(struct vrend_context *ctx,
           swizzle[3] = PIPE_SWIZZLE_ONE;
    }
 
-   if (tex_conv_table[view->format].flags & VIRGL_BIND_NEED_SWIZZLE) {
+   if (vrend_state.tex_conv_table[view->format].flags & VIRGL_BIND_NEED_SWIZZLE) {
       if (swizzle[0] <= PIPE_SWIZZLE_ALPHA)
-         swizzle[0] = tex_conv_table[view->format].swizzle[swizzle[0]];
+         swizzle[0] = vrend_state.tex_conv_table[view->format].swizzle[swizzle[0]];
       if (swizzle[1] <= PIPE_SWIZZLE_ALPHA)
-         swizzle[1] = tex_conv_table[view->format].swizzle[swizzle[1]];
+         swizzle[1] = vrend_state.tex_conv_table[view->format].swizzle[swizzle[1]];
       if (swizzle[2] <= PIPE_SWIZZLE_ALPHA)
-         swizzle[2] = tex_conv_table[view->format].swizzle[swizzle[2]];
+         swizzle[2] = vrend_state.tex_conv_table[view->format].swizzle[swizzle[2]];
       if (swizzle[3] <= PIPE_SWIZZLE_ALPHA)
-         swizzle[3] = tex_conv_table[view->format].swizzle[swizzle[3]];
+         swizzle[3] = vrend_state.tex_conv_table[view->format].swizzle[swizzle[3]];
    }
 
    view->gl_swizzle_r = to_gl_swizzle(swizzle[0]);
@@ -1935,44 +2718,35 @@ void vrend_fb_bind_texture(struct vrend_resource *res,
    vrend_fb_bind_texture_id(res, res->id, idx, level, layer);
 }
 
-static void vrend_hw_set_zsurf_texture(struct vrend_context *ctx)
+static void vrend_fbo_entry_destroy(struct vrend_sub_context *sub,
+                                    struct vrend_fbo_entry *entry)
 {
-   struct vrend_surface *surf = ctx->sub->zsurf;
-
-   if (!surf) {
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
-                                GL_TEXTURE_2D, 0, 0);
-   } else {
-      uint32_t first_layer = surf->val1 & 0xffff;
-      uint32_t last_layer = (surf->val1 >> 16) & 0xffff;
-
-      if (!surf->texture)
-         return;
-
-      vrend_fb_bind_texture_id(surf->texture, surf->id, 0, surf->val0,
-			       first_layer != last_layer ? 0xffffffff : first_layer);
-   }
+   glDeleteFramebuffers(1, &entry->id);
+   list_del(&entry->head);
+   list_del(&entry->global);
+   sub->num_fbos--;
+   FREE(entry);
 }
 
-static void vrend_hw_set_color_surface(struct vrend_context *ctx, int index)
+/* entries are only marked here, the FBO is deleted by its own context */
+static void vrend_fbo_cache_invalidate(GLuint tex_id)
 {
-   struct vrend_surface *surf = ctx->sub->surf[index];
-
-   if (!surf) {
-      GLenum attachment = GL_COLOR_ATTACHMENT0 + index;
-
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, attachment,
-                                GL_TEXTURE_2D, 0, 0);
-   } else {
-      uint32_t first_layer = ctx->sub->surf[index]->val1 & 0xffff;
-      uint32_t last_layer = (ctx->sub->surf[index]->val1 >> 16) & 0xffff;
+   struct vrend_fbo_entry *entry;
+   unsigned i;
 
-      vrend_fb_bind_texture_id(surf->texture, surf->id, index, surf->val0,
-                               first_layer != last_layer ? 0xffffffff : first_layer);
+   LIST_FOR_EACH_ENTRY(entry, &vrend_state.fbo_entries, global) {
+      for (i = 0; i <= VREND_FBO_ZS_SLOT; i++) {
+         if (entry->key.ids[i] == tex_id)
+            entry->stale = true;
+      }
    }
 }
 
-static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
+/* returns a complete FBO with the textures in res attached as given by key,
+ * the draw buffers are the first nr_cbufs color attachments */
+static GLuint vrend_fbo_cache_get(struct vrend_sub_context *sub,
+                                  struct vrend_resource *res[PIPE_MAX_COLOR_BUFS + 1],
+                                  const struct vrend_fbo_key *key)
 {
    static const GLenum buffers[8] = {
       GL_COLOR_ATTACHMENT0_EXT,
@@ -1984,18 +2758,121 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
       GL_COLOR_ATTACHMENT6_EXT,
       GL_COLOR_ATTACHMENT7_EXT,
    };
+   const uint8_t *bytes = (const uint8_t *)key;
+   struct vrend_fbo_entry *entry, *tmp;
+   unsigned hash = 2166136261u;
+   GLenum status;
+   unsigned i;
+
+   for (i = 0; i < sizeof(*key); i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
+
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &sub->fbo_cache, head) {
+      if (entry->stale) {
+         vrend_fbo_entry_destroy(sub, entry);
+         continue;
+      }
+      if (entry->hash == hash && !memcmp(&entry->key, key, sizeof(*key))) {
+         list_del(&entry->head);
+         list_add(&entry->head, &sub->fbo_cache);
+         return entry->id;
+      }
+   }
+
+   entry = CALLOC_STRUCT(vrend_fbo_entry);
+   if (!entry)
+      return sub->fb_id;
+   entry->key = *key;
+   entry->hash = hash;
+
+   glGenFramebuffers(1, &entry->id);
+   glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, entry->id);
+   for (i = 0; i <= VREND_FBO_ZS_SLOT; i++) {
+      if (key->ids[i])
+         vrend_fb_bind_texture_id(res[i], key->ids[i], i == VREND_FBO_ZS_SLOT ? 0 : i,
+                                  key->levels[i], key->layers[i]);
+   }
+   if (key->nr_cbufs == 0)
+      glReadBuffer(GL_NONE);
+   glDrawBuffers(key->nr_cbufs, buffers);
+
+   if (key->nr_cbufs > 0 || key->ids[VREND_FBO_ZS_SLOT]) {
+      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+      if (status != GL_FRAMEBUFFER_COMPLETE)
+         fprintf(stderr,"failed to complete framebuffer 0x%x\n", status);
+   }
+
+   list_add(&entry->head, &sub->fbo_cache);
+   list_addtail(&entry->global, &vrend_state.fbo_entries);
+   if (++sub->num_fbos > VREND_FBO_CACHE_SIZE) {
+      /* the bound framebuffer has to stay around */
+      tmp = LIST_ENTRY(struct vrend_fbo_entry, sub->fbo_cache.prev, head);
+      if (tmp->id == sub->fb_id)
+         tmp = LIST_ENTRY(struct vrend_fbo_entry, tmp->head.prev, head);
+      vrend_fbo_entry_destroy(sub, tmp);
+   }
+   return entry->id;
+}
+
+/* an FBO with just res attached, for readback and blits */
+static GLuint vrend_fbo_for_resource(struct vrend_context *ctx,
+                                     struct vrend_resource *res,
+                                     uint32_t level, uint32_t layer)
+{
+   struct vrend_resource *attach[PIPE_MAX_COLOR_BUFS + 1] = { NULL };
+   struct vrend_fbo_key key;
+   int slot = 0;
+
+   memset(&key, 0, sizeof(key));
+   if (vrend_format_is_ds((enum virgl_formats)res->base.format))
+      slot = VREND_FBO_ZS_SLOT;
+   else
+      key.nr_cbufs = 1;
+   attach[slot] = res;
+   key.ids[slot] = res->id;
+   key.levels[slot] = level;
+   key.layers[slot] = layer;
+
+   return vrend_fbo_cache_get(ctx->sub, attach, &key);
+}
+
+static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
+{
+   struct vrend_resource *attach[PIPE_MAX_COLOR_BUFS + 1] = { NULL };
+   struct vrend_surface *surf;
+   struct vrend_fbo_key key;
+   int i;
+
+   memset(&key, 0, sizeof(key));
+   for (i = 0; i <= VREND_FBO_ZS_SLOT; i++) {
+      if (i == VREND_FBO_ZS_SLOT)
+         surf = ctx->sub->zsurf;
+      else
+         surf = i < ctx->sub->nr_cbufs ? ctx->sub->surf[i] : NULL;
+
+      if (!surf || !surf->texture)
+         continue;
+
+      uint32_t first_layer = surf->val1 & 0xffff;
+      uint32_t last_layer = (surf->val1 >> 16) & 0xffff;
+
+      attach[i] = surf->texture;
+      key.ids[i] = surf->id;
+      key.levels[i] = surf->val0;
+      key.layers[i] = first_layer != last_layer ? 0xffffffff : first_layer;
+   }
+   key.nr_cbufs = ctx->sub->nr_cbufs;
+
+   ctx->sub->fb_id = vrend_fbo_cache_get(ctx->sub, attach, &key);
    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, ctx->sub->fb_id);
 
    if (ctx->sub->nr_cbufs == 0) {
-      glReadBuffer(GL_NONE);
       if (!vrend_state.use_gles) {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_disable(GL_FRAMEBUFFER_SRGB_EXT);
       }
    } else if (!vrend_state.use_gles) {
       /* Do not enter this path on GLES as this is not needed. */
-      struct vrend_surface *surf = NULL;
       bool use_srgb = false;
-      int i;
       for (i = 0; i < ctx->sub->nr_cbufs; i++) {
          if (ctx->sub->surf[i]) {
             surf = ctx->sub->surf[i];
@@ -2005,12 +2882,11 @@ static void vrend_hw_emit_framebuffer_state(struct vrend_context *ctx)
          }
       }
       if (use_srgb) {
-         glEnable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_enable(GL_FRAMEBUFFER_SRGB_EXT);
       } else {
-         glDisable(GL_FRAMEBUFFER_SRGB_EXT);
+         vrend_disable(GL_FRAMEBUFFER_SRGB_EXT);
       }
    }
-   glDrawBuffers(ctx->sub->nr_cbufs, buffers);
 }
 
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
@@ -2020,12 +2896,9 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
    struct vrend_surface *surf, *zsurf;
    int i;
    int old_num;
-   GLenum status;
    GLint new_height = -1;
    bool new_ibf = false;
 
-   glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, ctx->sub->fb_id);
-
    if (zsurf_handle) {
       zsurf = vrend_object_lookup(ctx->sub->object_hash, zsurf_handle, VIRGL_OBJECT_SURFACE);
       if (!zsurf) {
@@ -2035,10 +2908,8 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
    } else
       zsurf = NULL;
 
-   if (ctx->sub->zsurf != zsurf) {
+   if (ctx->sub->zsurf != zsurf)
       vrend_surface_reference(&ctx->sub->zsurf, zsurf);
-      vrend_hw_set_zsurf_texture(ctx);
-   }
 
    old_num = ctx->sub->nr_cbufs;
    ctx->sub->nr_cbufs = nr_cbufs;
@@ -2054,17 +2925,13 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
       } else
          surf = NULL;
 
-      if (ctx->sub->surf[i] != surf) {
+      if (ctx->sub->surf[i] != surf)
          vrend_surface_reference(&ctx->sub->surf[i], surf);
-         vrend_hw_set_color_surface(ctx, i);
-      }
    }
 
    if (old_num > ctx->sub->nr_cbufs) {
-      for (i = ctx->sub->nr_cbufs; i < old_num; i++) {
+      for (i = ctx->sub->nr_cbufs; i < old_num; i++)
          vrend_surface_reference(&ctx->sub->surf[i], NULL);
-         vrend_hw_set_color_surface(ctx, i);
-      }
    }
 
    /* find a buffer to set fb_height from */
@@ -2101,13 +2968,7 @@ void vrend_set_framebuffer_state(struct vrend_context *ctx,
    }
 
    vrend_hw_emit_framebuffer_state(ctx);
-
-   if (ctx->sub->nr_cbufs > 0 || ctx->sub->zsurf) {
-      status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-      if (status != GL_FRAMEBUFFER_COMPLETE)
-         fprintf(stderr,"failed to complete framebuffer 0x%x %s\n", status, ctx->debug_name);
-   }
-   ctx->sub->shader_dirty = true;
+   ctx->sub->state_epoch++;
 }
 
 void vrend_set_framebuffer_state_no_attach(UNUSED struct vrend_context *ctx,
@@ -2326,6 +3187,18 @@ void vrend_bind_vertex_elements_state(struct vrend_context *ctx,
    ctx->sub->ve = v;
 }
 
+static void vrend_mark_bindings_dirty(struct vrend_sub_context *sub)
+{
+   for (int i = 0; i < PIPE_SHADER_TYPES; i++) {
+      sub->views_dirty[i] = ~0u;
+      sub->ubos_dirty[i] = ~0u;
+      sub->ssbos_dirty[i] = ~0u;
+      sub->images_dirty[i] = ~0u;
+      sub->const_ubo_bindings[i] = -1;
+   }
+   sub->abos_dirty = ~0u;
+}
+
 void vrend_set_constants(struct vrend_context *ctx,
                          uint32_t shader,
                          UNUSED uint32_t index,
@@ -2359,10 +3232,12 @@ void vrend_set_uniform_buffer(struct vrend_context *ctx,
    if (!has_feature(feat_ubo))
       return;
 
+   ctx->sub->ubos_dirty[shader] |= (1 << index);
+
    if (res_handle) {
       res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
 
-      if (!res) {
+      if (!res || vrend_resource_use(res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
          return;
       }
@@ -2391,7 +3266,7 @@ void vrend_set_index_buffer(struct vrend_context *ctx,
    if (res_handle) {
       if (ctx->sub->index_buffer_res_id != res_handle) {
          res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-         if (!res) {
+         if (!res || vrend_resource_use(res)) {
             vrend_resource_reference((struct vrend_resource **)&ctx->sub->ib.buffer, NULL);
             ctx->sub->index_buffer_res_id = 0;
             report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
@@ -2406,6 +3281,20 @@ void vrend_set_index_buffer(struct vrend_context *ctx,
    }
 }
 
+bool vrend_get_index_buffer(struct vrend_context *ctx,
+                            uint32_t *res_handle,
+                            uint32_t *index_size,
+                            uint32_t *offset)
+{
+   if (!ctx->sub->ib.buffer)
+      return false;
+
+   *res_handle = ctx->sub->index_buffer_res_id;
+   *index_size = ctx->sub->ib.index_size;
+   *offset = ctx->sub->ib.offset;
+   return true;
+}
+
 void vrend_set_single_vbo(struct vrend_context *ctx,
                           int index,
                           uint32_t stride,
@@ -2427,7 +3316,7 @@ void vrend_set_single_vbo(struct vrend_context *ctx,
       ctx->sub->vbo_res_ids[index] = 0;
    } else if (ctx->sub->vbo_res_ids[index] != res_handle) {
       res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-      if (!res) {
+      if (!res || vrend_resource_use(res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
          ctx->sub->vbo_res_ids[index] = 0;
          return;
@@ -2444,7 +3333,6 @@ void vrend_set_num_vbo(struct vrend_context *ctx,
    int i;
 
    ctx->sub->num_vbos = num_vbo;
-   ctx->sub->old_num_vbos = old_num;
 
    if (old_num != num_vbo)
       ctx->sub->vbo_dirty = true;
@@ -2468,6 +3356,7 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
       view = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_SAMPLER_VIEW);
       if (!view) {
          ctx->sub->views[shader_type].views[index] = NULL;
+         ctx->sub->views_dirty[shader_type] |= (1 << index);
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_HANDLE, handle);
          return;
       }
@@ -2540,7 +3429,7 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
             glGenTextures(1, &view->texture->tbo_tex_id);
 
          glBindTexture(GL_TEXTURE_BUFFER, view->texture->tbo_tex_id);
-         internalformat = tex_conv_table[view->format].internalformat;
+         internalformat = vrend_state.tex_conv_table[view->format].internalformat;
          if (has_feature(feat_texture_buffer_range)) {
             unsigned offset = view->val0;
             unsigned size = view->val1 - view->val0 + 1;
@@ -2548,13 +3437,15 @@ void vrend_set_single_sampler_view(struct vrend_context *ctx,
 
             offset *= blsize;
             size *= blsize;
-            glTexBufferRange(GL_TEXTURE_BUFFER, internalformat, view->texture->id, offset, size);
+            glTexBufferRange(GL_TEXTURE_BUFFER, internalformat, view->texture->id,
+                             view->texture->buffer_offset + offset, size);
          } else
             glTexBuffer(GL_TEXTURE_BUFFER, internalformat, view->texture->id);
       }
    }
 
    vrend_sampler_view_reference(&ctx->sub->views[shader_type].views[index], view);
+   ctx->sub->views_dirty[shader_type] |= (1 << index);
 }
 
 void vrend_set_num_sampler_views(struct vrend_context *ctx,
@@ -2565,8 +3456,10 @@ void vrend_set_num_sampler_views(struct vrend_context *ctx,
    int last_slot = start_slot + num_sampler_views;
    int i;
 
-   for (i = last_slot; i < ctx->sub->views[shader_type].num_views; i++)
+   for (i = last_slot; i < ctx->sub->views[shader_type].num_views; i++) {
       vrend_sampler_view_reference(&ctx->sub->views[shader_type].views[i], NULL);
+      ctx->sub->views_dirty[shader_type] |= (1 << i);
+   }
 
    ctx->sub->views[shader_type].num_views = last_slot;
 }
@@ -2584,14 +3477,18 @@ void vrend_set_single_image_view(struct vrend_context *ctx,
    if (!has_feature(feat_images))
       return;
 
+   ctx->sub->images_dirty[shader_type] |= (1 << index);
+
    if (handle) {
       res = vrend_renderer_ctx_res_lookup(ctx, handle);
-      if (!res) {
+      if (!res || vrend_resource_use(res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
       }
+      vrend_resource_pin(res);
+      vrend_resource_drop_shadow(res, true);
       iview->texture = res;
-      iview->format = tex_conv_table[format].internalformat;
+      iview->format = vrend_state.tex_conv_table[format].internalformat;
       iview->access = access;
       iview->u.buf.offset = layer_offset;
       iview->u.buf.size = level_size;
@@ -2615,12 +3512,16 @@ void vrend_set_single_ssbo(struct vrend_context *ctx,
    if (!has_feature(feat_ssbo))
       return;
 
+   ctx->sub->ssbos_dirty[shader_type] |= (1 << index);
+
    if (handle) {
       res = vrend_renderer_ctx_res_lookup(ctx, handle);
-      if (!res) {
+      if (!res || vrend_resource_use(res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
       }
+      vrend_resource_pin(res);
+      vrend_resource_drop_shadow(res, true);
       ssbo->res = res;
       ssbo->buffer_offset = offset;
       ssbo->buffer_size = length;
@@ -2644,12 +3545,16 @@ void vrend_set_single_abo(struct vrend_context *ctx,
    if (!has_feature(feat_atomic_counters))
       return;
 
+   ctx->sub->abos_dirty |= (1 << index);
+
    if (handle) {
       res = vrend_renderer_ctx_res_lookup(ctx, handle);
-      if (!res) {
+      if (!res || vrend_resource_use(res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, handle);
          return;
       }
+      vrend_resource_pin(res);
+      vrend_resource_drop_shadow(res, true);
       abo->res = res;
       abo->buffer_offset = offset;
       abo->buffer_size = length;
@@ -3203,7 +4108,7 @@ void vrend_clear(struct vrend_context *ctx,
    }
 
    if (ctx->sub->hw_rs_state.rasterizer_discard)
-       glDisable(GL_RASTERIZER_DISCARD);
+       vrend_disable(GL_RASTERIZER_DISCARD);
 
    if (buffers & PIPE_CLEAR_COLOR) {
       uint32_t mask = 0;
@@ -3243,7 +4148,7 @@ void vrend_clear(struct vrend_context *ctx,
     * didn't forward them before calling the clear command
     */
    if (ctx->sub->hw_rs_state.rasterizer_discard)
-       glEnable(GL_RASTERIZER_DISCARD);
+       vrend_enable(GL_RASTERIZER_DISCARD);
 
    if (buffers & PIPE_CLEAR_DEPTH) {
       if (!ctx->sub->dsa_state.depth.writemask)
@@ -3286,9 +4191,9 @@ static void vrend_update_scissor_state(struct vrend_context *ctx)
    unsigned mask = ctx->sub->scissor_state_dirty;
 
    if (state->scissor)
-      glEnable(GL_SCISSOR_TEST);
+      vrend_enable(GL_SCISSOR_TEST);
    else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_disable(GL_SCISSOR_TEST);
 
    while (mask) {
       idx = u_bit_scan(&mask);
@@ -3384,17 +4289,135 @@ static GLenum get_xfb_mode(GLenum mode)
    }
 }
 
-static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
-                                          struct vrend_vertex_element_array *va)
+static void vrend_vao_entry_destroy(struct vrend_sub_context *sub,
+                                    struct vrend_vao_entry *entry)
+{
+   glDeleteVertexArrays(1, &entry->id);
+   list_del(&entry->head);
+   list_del(&entry->global);
+   sub->num_vaos--;
+   FREE(entry);
+}
+
+/* entries are only marked here, the VAO is deleted by its own context */
+static void vrend_vao_cache_invalidate(struct vrend_vertex_element_array *ve,
+                                       struct vrend_linked_shader_program *prog,
+                                       GLuint buffer_id)
+{
+   struct vrend_vao_entry *entry;
+   unsigned i;
+
+   if (buffer_id)
+      vrend_state.vbo_serial++;
+
+   LIST_FOR_EACH_ENTRY(entry, &vrend_state.vao_entries, global) {
+      if ((ve && entry->key.ve == ve) || (prog && entry->key.prog == prog))
+         entry->stale = true;
+      for (i = 0; buffer_id && i < PIPE_MAX_ATTRIBS && !entry->stale; i++) {
+         if (entry->key.buffer_ids[i] == buffer_id)
+            entry->stale = true;
+      }
+   }
+}
+
+static struct vrend_vao_entry *vrend_vao_cache_lookup(struct vrend_sub_context *sub,
+                                                      const struct vrend_vao_key *key,
+                                                      unsigned hash)
+{
+   struct vrend_vao_entry *entry, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(entry, tmp, &sub->vao_cache, head) {
+      if (entry->stale) {
+         vrend_vao_entry_destroy(sub, entry);
+         continue;
+      }
+      if (entry->hash == hash && !memcmp(&entry->key, key, sizeof(*key))) {
+         list_del(&entry->head);
+         list_add(&entry->head, &sub->vao_cache);
+         return entry;
+      }
+   }
+   return NULL;
+}
+
+static void vrend_resource_drop_shadow(struct vrend_resource *res, bool gpu_writable)
+{
+   free(res->shadow);
+   res->shadow = NULL;
+   if (gpu_writable)
+      res->no_shadow = true;
+}
+
+static void vrend_resource_create_shadow(struct vrend_resource *res)
+{
+   void *data;
+
+   res->shadow = malloc(res->base.width0);
+   if (!res->shadow)
+      return;
+
+   vrend_bind_buffer(GL_ARRAY_BUFFER, res->id);
+   data = glMapBufferRange(GL_ARRAY_BUFFER, res->buffer_offset, res->base.width0, GL_MAP_READ_BIT);
+   if (!data) {
+      vrend_resource_drop_shadow(res, true);
+      return;
+   }
+   memcpy(res->shadow, data, res->base.width0);
+   glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+static void vrend_vertex_attrib_constant(struct vrend_context *ctx,
+                                         struct vrend_vertex_element *ve,
+                                         struct vrend_resource *res,
+                                         GLint loc)
+{
+   int vbo_index = ve->base.vertex_buffer_index;
+   uint32_t offset = ctx->sub->vbo[vbo_index].buffer_offset;
+   uint32_t size = ve->nr_chan * sizeof(GLfloat);
+   void *data, *map = NULL;
+
+   /* mapping waits for the GPU, so only do it once per buffer */
+   if (!res->shadow && !res->no_shadow &&
+       res->base.width0 <= VREND_ATTRIB_SHADOW_MAX_SIZE)
+      vrend_resource_create_shadow(res);
+
+   if (res->shadow && size <= res->base.width0 && offset <= res->base.width0 - size) {
+      data = res->shadow + offset;
+   } else {
+      vrend_bind_buffer(GL_ARRAY_BUFFER, res->id);
+
+      /* for 0 stride we are kinda screwed */
+      data = map = glMapBufferRange(GL_ARRAY_BUFFER, res->buffer_offset + offset, size, GL_MAP_READ_BIT);
+      if (!data)
+         return;
+   }
+
+   switch (ve->nr_chan) {
+   case 1:
+      glVertexAttrib1fv(loc, data);
+      break;
+   case 2:
+      glVertexAttrib2fv(loc, data);
+      break;
+   case 3:
+      glVertexAttrib3fv(loc, data);
+      break;
+   case 4:
+   default:
+      glVertexAttrib4fv(loc, data);
+      break;
+   }
+   if (map)
+      glUnmapBuffer(GL_ARRAY_BUFFER);
+}
+
+/* set up the freshly bound VAO of entry, returns false if nothing can be drawn */
+static bool vrend_vao_setup_legacy(struct vrend_context *ctx,
+                                   struct vrend_vertex_element_array *va,
+                                   struct vrend_vao_entry *entry)
 {
-   uint32_t num_enable;
-   uint32_t enable_bitmask;
-   uint32_t disable_bitmask;
    int i;
 
-   num_enable = va->count;
-   enable_bitmask = 0;
-   disable_bitmask = ~((1ull << num_enable) - 1);
    for (i = 0; i < (int)va->count; i++) {
       struct vrend_vertex_element *ve = &va->elements[i];
       int vbo_index = ve->base.vertex_buffer_index;
@@ -3403,7 +4426,6 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
 
       if (i >= ctx->sub->prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs) {
          /* XYZZY: debug this? */
-         num_enable = ctx->sub->prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs;
          break;
       }
       res = (struct vrend_resource *)ctx->sub->vbo[vbo_index].buffer;
@@ -3422,10 +4444,9 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
 
          if (loc == -1) {
             fprintf(stderr,"%s: cannot find loc %d %d %d\n", ctx->debug_name, i, va->count, ctx->sub->prog->ss[PIPE_SHADER_VERTEX]->sel->sinfo.num_inputs);
-            num_enable--;
             if (i == 0) {
                fprintf(stderr,"%s: shader probably didn't compile - skipping rendering\n", ctx->debug_name);
-               return;
+               return false;
             }
             continue;
          }
@@ -3433,100 +4454,155 @@ static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
 
       if (ve->type == GL_FALSE) {
          fprintf(stderr,"failed to translate vertex type - skipping render\n");
-         return;
+         return false;
       }
 
-      glBindBuffer(GL_ARRAY_BUFFER, res->id);
-
+      entry->locs[i] = loc;
       if (ctx->sub->vbo[vbo_index].stride == 0) {
-         void *data;
-         /* for 0 stride we are kinda screwed */
-         data = glMapBufferRange(GL_ARRAY_BUFFER, ctx->sub->vbo[vbo_index].buffer_offset, ve->nr_chan * sizeof(GLfloat), GL_MAP_READ_BIT);
-
-         switch (ve->nr_chan) {
-         case 1:
-            glVertexAttrib1fv(loc, data);
-            break;
-         case 2:
-            glVertexAttrib2fv(loc, data);
-            break;
-         case 3:
-            glVertexAttrib3fv(loc, data);
-            break;
-         case 4:
-         default:
-            glVertexAttrib4fv(loc, data);
-            break;
-         }
-         glUnmapBuffer(GL_ARRAY_BUFFER);
-         disable_bitmask |= (1 << loc);
+         vrend_vertex_attrib_constant(ctx, ve, res, loc);
+         entry->zero_stride_mask |= 1 << i;
       } else {
-         enable_bitmask |= (1 << loc);
+         vrend_bind_buffer(GL_ARRAY_BUFFER, res->id);
          if (util_format_is_pure_integer(ve->base.src_format)) {
-            glVertexAttribIPointer(loc, ve->nr_chan, ve->type, ctx->sub->vbo[vbo_index].stride, (void *)(unsigned long)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
+            glVertexAttribIPointer(loc, ve->nr_chan, ve->type, ctx->sub->vbo[vbo_index].stride, (void *)(unsigned long)(res->buffer_offset + ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
          } else {
-            glVertexAttribPointer(loc, ve->nr_chan, ve->type, ve->norm, ctx->sub->vbo[vbo_index].stride, (void *)(unsigned long)(ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
+            glVertexAttribPointer(loc, ve->nr_chan, ve->type, ve->norm, ctx->sub->vbo[vbo_index].stride, (void *)(unsigned long)(res->buffer_offset + ve->base.src_offset + ctx->sub->vbo[vbo_index].buffer_offset));
          }
          glVertexAttribDivisorARB(loc, ve->base.instance_divisor);
+         glEnableVertexAttribArray(loc);
       }
    }
-   if (ctx->sub->enabled_attribs_bitmask != enable_bitmask) {
-      uint32_t mask = ctx->sub->enabled_attribs_bitmask & disable_bitmask;
+   return true;
+}
 
-      while (mask) {
-         i = u_bit_scan(&mask);
-         glDisableVertexAttribArray(i);
+static void vrend_draw_bind_vertex_legacy(struct vrend_context *ctx,
+                                          struct vrend_vertex_element_array *va)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   struct vrend_vao_entry *entry;
+   struct vrend_vao_key key;
+   const uint8_t *bytes = (const uint8_t *)&key;
+   unsigned hash = 2166136261u;
+   uint32_t mask, i;
+
+   memset(&key, 0, sizeof(key));
+   key.ve = va;
+   key.prog = sub->prog;
+   for (i = 0; i < va->count; i++) {
+      int vbo_index = va->elements[i].base.vertex_buffer_index;
+      struct vrend_resource *res = (struct vrend_resource *)sub->vbo[vbo_index].buffer;
+
+      if (res) {
+         key.buffer_ids[i] = res->id;
+         key.offsets[i] = res->buffer_offset + sub->vbo[vbo_index].buffer_offset;
       }
-      ctx->sub->enabled_attribs_bitmask &= ~disable_bitmask;
+      key.strides[i] = sub->vbo[vbo_index].stride;
+   }
+   for (i = 0; i < sizeof(key); i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
 
-      mask = ctx->sub->enabled_attribs_bitmask ^ enable_bitmask;
+   entry = vrend_vao_cache_lookup(sub, &key, hash);
+   if (entry) {
+      glBindVertexArray(entry->id);
+      mask = entry->zero_stride_mask;
       while (mask) {
+         struct vrend_vertex_element *ve;
          i = u_bit_scan(&mask);
-         glEnableVertexAttribArray(i);
+         ve = &va->elements[i];
+         vrend_vertex_attrib_constant(ctx, ve,
+                                      (struct vrend_resource *)sub->vbo[ve->base.vertex_buffer_index].buffer,
+                                      entry->locs[i]);
       }
+      return;
+   }
 
-      ctx->sub->enabled_attribs_bitmask = enable_bitmask;
+   entry = CALLOC_STRUCT(vrend_vao_entry);
+   if (!entry) {
+      glBindVertexArray(sub->vaoid);
+      return;
+   }
+   entry->key = key;
+   entry->hash = hash;
+
+   glGenVertexArrays(1, &entry->id);
+   glBindVertexArray(entry->id);
+   if (!vrend_vao_setup_legacy(ctx, va, entry)) {
+      glBindVertexArray(sub->vaoid);
+      glDeleteVertexArrays(1, &entry->id);
+      FREE(entry);
+      return;
    }
+
+   list_add(&entry->head, &sub->vao_cache);
+   list_addtail(&entry->global, &vrend_state.vao_entries);
+   if (++sub->num_vaos > VREND_VAO_CACHE_SIZE)
+      vrend_vao_entry_destroy(sub, LIST_ENTRY(struct vrend_vao_entry, sub->vao_cache.prev, head));
 }
 
 static void vrend_draw_bind_vertex_binding(struct vrend_context *ctx,
                                            struct vrend_vertex_element_array *va)
 {
+   bool rebind_all = va->vbo_serial != vrend_state.vbo_serial;
    int i;
 
    glBindVertexArray(va->id);
 
-   if (ctx->sub->vbo_dirty) {
-      for (i = 0; i < ctx->sub->num_vbos; i++) {
-         struct vrend_resource *res = (struct vrend_resource *)ctx->sub->vbo[i].buffer;
-         if (!res)
-            glBindVertexBuffer(i, 0, 0, 0);
-         else
-            glBindVertexBuffer(i,
-                               res->id,
-                               ctx->sub->vbo[i].buffer_offset,
-                               ctx->sub->vbo[i].stride);
-      }
-      for (i = ctx->sub->num_vbos; i < ctx->sub->old_num_vbos; i++) {
+   if (!ctx->sub->vbo_dirty && !rebind_all)
+      return;
+
+   /* only rebind the slots that differ from what the VAO has */
+   for (i = 0; i < ctx->sub->num_vbos; i++) {
+      struct vrend_resource *res = (struct vrend_resource *)ctx->sub->vbo[i].buffer;
+      GLuint id = res ? res->id : 0;
+      uint32_t offset = res ? res->buffer_offset + ctx->sub->vbo[i].buffer_offset : 0;
+      uint32_t stride = res ? ctx->sub->vbo[i].stride : 0;
+
+      if (!rebind_all && i < va->num_bound_vbos &&
+          va->bound_vbos[i].id == id &&
+          va->bound_vbos[i].offset == offset &&
+          va->bound_vbos[i].stride == stride)
+         continue;
+
+      glBindVertexBuffer(i, id, offset, stride);
+      va->bound_vbos[i].id = id;
+      va->bound_vbos[i].offset = offset;
+      va->bound_vbos[i].stride = stride;
+   }
+   for (i = ctx->sub->num_vbos; i < va->num_bound_vbos; i++) {
+      if (va->bound_vbos[i].id || rebind_all)
          glBindVertexBuffer(i, 0, 0, 0);
-      }
-      ctx->sub->vbo_dirty = false;
+      memset(&va->bound_vbos[i], 0, sizeof(va->bound_vbos[i]));
    }
+   va->num_bound_vbos = ctx->sub->num_vbos;
+   va->vbo_serial = vrend_state.vbo_serial;
+   ctx->sub->vbo_dirty = false;
 }
 
-static void vrend_draw_bind_samplers_shader(struct vrend_context *ctx,
+static bool vrend_draw_bind_samplers_shader(struct vrend_context *ctx,
                                             int shader_type,
                                             int *sampler_id)
 {
+   uint32_t dirty = ctx->sub->views_dirty[shader_type];
+   bool emitted = false;
    int index = 0;
    for (int i = 0; i < ctx->sub->views[shader_type].num_views; i++) {
       struct vrend_sampler_view *tview = ctx->sub->views[shader_type].views[i];
+      int unit = *sampler_id;
 
-      if (!tview)
+      if (!tview || !(ctx->sub->prog->samplers_used_mask[shader_type] & (1 << i))) {
+         ctx->sub->view_units[shader_type][i] = -1;
          continue;
+      }
 
-      if (!(ctx->sub->prog->samplers_used_mask[shader_type] & (1 << i)))
+      /* units are handed out in order, so a slot also moves when an
+       * earlier one comes or goes */
+      if (!(dirty & (1 << i)) && ctx->sub->view_units[shader_type][i] == unit) {
+         if (tview->texture)
+            (*sampler_id)++;
+         index++;
          continue;
+      }
+      emitted = true;
 
       if (ctx->sub->prog->samp_locs[shader_type])
          glUniform1i(ctx->sub->prog->samp_locs[shader_type][index], *sampler_id);
@@ -3544,7 +4620,7 @@ static void vrend_draw_bind_samplers_shader(struct vrend_context *ctx,
                      tview->gl_swizzle_a == GL_ONE ? 1.0 : 0.0);
       }
 
-      glActiveTexture(GL_TEXTURE0 + *sampler_id);
+      vrend_active_texture(GL_TEXTURE0 + *sampler_id);
       if (tview->texture) {
          GLuint id;
          struct vrend_resource *texture = tview->texture;
@@ -3557,7 +4633,9 @@ static void vrend_draw_bind_samplers_shader(struct vrend_context *ctx,
             id = tview->id;
 
          glBindTexture(target, id);
-         if (ctx->sub->views[shader_type].old_ids[i] != id || ctx->sub->sampler_state_dirty) {
+         if (ctx->sub->views[shader_type].old_ids[i] != id ||
+             ctx->sub->view_units[shader_type][i] != unit ||
+             ctx->sub->sampler_state_dirty) {
             vrend_apply_sampler_state(ctx, texture, shader_type, i, *sampler_id, tview->srgb_decode);
             ctx->sub->views[shader_type].old_ids[i] = id;
          }
@@ -3571,8 +4649,11 @@ static void vrend_draw_bind_samplers_shader(struct vrend_context *ctx,
          }
          (*sampler_id)++;
       }
+      ctx->sub->view_units[shader_type][i] = unit;
       index++;
    }
+   ctx->sub->views_dirty[shader_type] = 0;
+   return emitted;
 }
 
 static void vrend_draw_bind_ubo_shader(struct vrend_context *ctx,
@@ -3612,32 +4693,213 @@ static void vrend_draw_bind_ubo_shader(struct vrend_context *ctx,
       if (shader_ubo_idx == sinfo->num_ubos)
          continue;
 
-      glBindBufferRange(GL_UNIFORM_BUFFER, *ubo_id, res->id,
-                        cb->buffer_offset, cb->buffer_size);
-      /* The ubo_locs array is indexed using the shader ubo index */
-      glUniformBlockBinding(ctx->sub->prog->id, ctx->sub->prog->ubo_locs[shader_type][shader_ubo_idx], *ubo_id);
+      if ((ctx->sub->ubos_dirty[shader_type] & (1 << i)) ||
+          ctx->sub->ubo_bindings[shader_type][i] != *ubo_id) {
+         glBindBufferRange(GL_UNIFORM_BUFFER, *ubo_id, res->id,
+                           res->buffer_offset + cb->buffer_offset, cb->buffer_size);
+         /* The ubo_locs array is indexed using the shader ubo index */
+         glUniformBlockBinding(ctx->sub->prog->id, ctx->sub->prog->ubo_locs[shader_type][shader_ubo_idx], *ubo_id);
+         ctx->sub->ubo_bindings[shader_type][i] = *ubo_id;
+      }
       (*ubo_id)++;
    }
+   ctx->sub->ubos_dirty[shader_type] = 0;
 }
 
-static void vrend_draw_bind_const_shader(struct vrend_context *ctx,
-                                         int shader_type, bool new_program)
+static void vrend_const_ring_destroy(struct vrend_const_ring *ring)
 {
-   if (ctx->sub->consts[shader_type].consts &&
-       ctx->sub->prog->const_locs[shader_type] &&
-       (ctx->sub->const_dirty[shader_type] || new_program)) {
-      for (int i = 0; i < ctx->sub->shaders[shader_type]->sinfo.num_consts; i++) {
-         if (ctx->sub->prog->const_locs[shader_type][i] != -1)
-            glUniform4uiv(ctx->sub->prog->const_locs[shader_type][i], 1, &ctx->sub->consts[shader_type].consts[i * 4]);
-      }
-      ctx->sub->const_dirty[shader_type] = false;
+   int i;
+
+   for (i = 0; i < VREND_CONST_RING_SEGMENTS; i++) {
+      if (ring->fences[i])
+         glDeleteSync(ring->fences[i]);
+      ring->fences[i] = NULL;
+   }
+   if (ring->id) {
+      vrend_bind_buffer(GL_UNIFORM_BUFFER, ring->id);
+      glUnmapBuffer(GL_UNIFORM_BUFFER);
+      vrend_bind_buffer(GL_UNIFORM_BUFFER, 0);
+      vrend_delete_buffers(1, &ring->id);
    }
+   ring->id = 0;
+   ring->map = NULL;
 }
 
-static void vrend_draw_bind_ssbo_shader(struct vrend_context *ctx, int shader_type)
+static bool vrend_const_ring_init(struct vrend_const_ring *ring)
 {
-   uint32_t mask;
-   struct vrend_ssbo *ssbo;
+   const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+   glGenBuffers(1, &ring->id);
+   vrend_bind_buffer(GL_UNIFORM_BUFFER, ring->id);
+   glBufferStorage(GL_UNIFORM_BUFFER, VREND_CONST_RING_SIZE, NULL, flags);
+   ring->map = glMapBufferRange(GL_UNIFORM_BUFFER, 0, VREND_CONST_RING_SIZE, flags);
+   vrend_bind_buffer(GL_UNIFORM_BUFFER, 0);
+   if (!ring->map) {
+      vrend_delete_buffers(1, &ring->id);
+      ring->id = 0;
+      return false;
+   }
+   ring->head = 0;
+   for (int i = 0; i < PIPE_SHADER_TYPES; i++)
+      ring->stage_segs[i] = -1;
+   return true;
+}
+
+/* Returns where the next size bytes of the constant ring go when the last
+ * write ended at head. Writes never straddle a segment and wrap at the end
+ * of the ring. left_seg is set to the segment that was written last if the
+ * new write moves out of it, and to -1 otherwise.
+ */
+static uint32_t
+vrend_const_ring_place(uint32_t head, uint32_t size, uint32_t alignment,
+                       int *left_seg)
+{
+   uint32_t start = (head + alignment - 1) & ~(alignment - 1);
+   uint32_t seg = start / VREND_CONST_RING_SEGMENT_SIZE;
+   uint32_t last_seg;
+
+   if (seg >= VREND_CONST_RING_SEGMENTS) {
+      seg = 0;
+      start = 0;
+   } else if ((start + size - 1) / VREND_CONST_RING_SEGMENT_SIZE != seg) {
+      seg = (seg + 1) % VREND_CONST_RING_SEGMENTS;
+      start = seg * VREND_CONST_RING_SEGMENT_SIZE;
+   }
+
+   /* nothing has been written before the first allocation */
+   last_seg = head ? (head - 1) / VREND_CONST_RING_SEGMENT_SIZE : seg;
+   *left_seg = last_seg != seg ? (int)last_seg : -1;
+   return start;
+}
+
+/* returns where size bytes can be written, waiting for the GPU to be done
+ * with a segment before handing it out again */
+static uint8_t *vrend_const_ring_alloc(struct vrend_const_ring *ring,
+                                       uint32_t size, uint32_t *offset)
+{
+   uint32_t start, seg;
+   int left_seg;
+
+   if (!ring->map && !vrend_const_ring_init(ring))
+      return NULL;
+
+   start = vrend_const_ring_place(ring->head, size, vrend_state.ubo_offset_align,
+                                  &left_seg);
+   seg = start / VREND_CONST_RING_SEGMENT_SIZE;
+
+   if (left_seg >= 0) {
+      if (ring->fences[left_seg])
+         glDeleteSync(ring->fences[left_seg]);
+      ring->fences[left_seg] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      if (ring->fences[seg]) {
+         while (glClientWaitSync(ring->fences[seg], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                 1000000000) == GL_TIMEOUT_EXPIRED);
+         glDeleteSync(ring->fences[seg]);
+         ring->fences[seg] = NULL;
+      }
+      /* stages that kept their range in this segment need a new one */
+      for (int i = 0; i < PIPE_SHADER_TYPES; i++) {
+         if (ring->stage_segs[i] == (int)seg)
+            ring->stage_segs[i] = -1;
+      }
+   }
+
+   ring->head = start + size;
+   *offset = start;
+   return ring->map + start;
+}
+
+static void vrend_draw_bind_const_ubo(struct vrend_context *ctx,
+                                      int shader_type, bool new_program,
+                                      int *ubo_id)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   struct vrend_constants *consts = &sub->consts[shader_type];
+   GLuint block = sub->prog->const_ubo_locs[shader_type];
+   uint32_t size, avail, offset;
+   uint8_t *ptr;
+
+   if (block == GL_INVALID_INDEX)
+      return;
+
+   if (sub->const_dirty[shader_type] || new_program ||
+       sub->const_ubo_bindings[shader_type] != *ubo_id ||
+       sub->const_ring.stage_segs[shader_type] < 0) {
+      /* the range has to cover the whole block, even if the guest has set
+       * fewer constants than the shader declares */
+      size = sub->prog->ss[shader_type]->sel->sinfo.num_consts * 16;
+      ptr = vrend_const_ring_alloc(&sub->const_ring, size, &offset);
+      if (!ptr) {
+         fprintf(stderr, "failed to allocate constant ring space\n");
+         return;
+      }
+
+      avail = consts->consts ? MIN2(consts->num_consts * 4, size) : 0;
+      if (avail)
+         memcpy(ptr, consts->consts, avail);
+      memset(ptr + avail, 0, size - avail);
+
+      glBindBufferRange(GL_UNIFORM_BUFFER, *ubo_id, sub->const_ring.id, offset, size);
+      glUniformBlockBinding(sub->prog->id, block, *ubo_id);
+      sub->const_ubo_bindings[shader_type] = *ubo_id;
+      sub->const_ring.stage_segs[shader_type] = offset / VREND_CONST_RING_SEGMENT_SIZE;
+      sub->const_dirty[shader_type] = false;
+   }
+   (*ubo_id)++;
+}
+
+/* A stage that didn't need new constants keeps its range, and a later stage
+ * of the same draw can move the ring into the segment that range is in. */
+static void vrend_draw_rebind_const_ubos(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   bool again = true;
+   int n, ubo_id;
+
+   for (n = 0; again && n < VREND_CONST_RING_SEGMENTS; n++) {
+      again = false;
+      for (int shader_type = PIPE_SHADER_VERTEX; shader_type <= sub->last_shader_idx; shader_type++) {
+         struct vrend_shader *ss = sub->prog->ss[shader_type];
+
+         if (!ss || !ss->sel->sinfo.const_ubo ||
+             sub->const_ring.stage_segs[shader_type] >= 0)
+            continue;
+         ubo_id = sub->const_ubo_bindings[shader_type];
+         vrend_draw_bind_const_ubo(ctx, shader_type, false, &ubo_id);
+         again = true;
+      }
+   }
+}
+
+static void vrend_draw_bind_const_shader(struct vrend_context *ctx,
+                                         int shader_type, bool new_program,
+                                         int *ubo_id)
+{
+   struct vrend_shader *ss = ctx->sub->prog->ss[shader_type];
+
+   if (ss && ss->sel->sinfo.const_ubo) {
+      vrend_draw_bind_const_ubo(ctx, shader_type, new_program, ubo_id);
+      return;
+   }
+
+   if (ctx->sub->consts[shader_type].consts &&
+       ctx->sub->prog->const_locs[shader_type] &&
+       (ctx->sub->const_dirty[shader_type] || new_program)) {
+      for (int i = 0; i < ctx->sub->shaders[shader_type]->sinfo.num_consts; i++) {
+         if (ctx->sub->prog->const_locs[shader_type][i] != -1)
+            glUniform4uiv(ctx->sub->prog->const_locs[shader_type][i], 1, &ctx->sub->consts[shader_type].consts[i * 4]);
+      }
+      ctx->sub->const_dirty[shader_type] = false;
+   }
+}
+
+/* ssbo, atomic and image slots map to the same binding point in every
+ * stage, so dirty is the union of the masks of all stages */
+static void vrend_draw_bind_ssbo_shader(struct vrend_context *ctx, int shader_type,
+                                        uint32_t dirty)
+{
+   uint32_t mask;
+   struct vrend_ssbo *ssbo;
    struct vrend_resource *res;
    int i;
 
@@ -3650,14 +4912,14 @@ static void vrend_draw_bind_ssbo_shader(struct vrend_context *ctx, int shader_ty
    if (!ctx->sub->ssbo_used_mask[shader_type])
       return;
 
-   mask = ctx->sub->ssbo_used_mask[shader_type];
+   mask = ctx->sub->ssbo_used_mask[shader_type] & dirty;
    while (mask) {
       i = u_bit_scan(&mask);
 
       ssbo = &ctx->sub->ssbo[shader_type][i];
       res = (struct vrend_resource *)ssbo->res;
       glBindBufferRange(GL_SHADER_STORAGE_BUFFER, i, res->id,
-                        ssbo->buffer_offset, ssbo->buffer_size);
+                        res->buffer_offset + ssbo->buffer_offset, ssbo->buffer_size);
       if (ctx->sub->prog->ssbo_locs[shader_type][i] != GL_INVALID_INDEX) {
          if (!vrend_state.use_gles)
             glShaderStorageBlockBinding(ctx->sub->prog->id, ctx->sub->prog->ssbo_locs[shader_type][i], i);
@@ -3677,18 +4939,20 @@ static void vrend_draw_bind_abo_shader(struct vrend_context *ctx)
    if (!has_feature(feat_atomic_counters))
       return;
 
-   mask = ctx->sub->abo_used_mask;
+   mask = ctx->sub->abo_used_mask & ctx->sub->abos_dirty;
    while (mask) {
       i = u_bit_scan(&mask);
 
       abo = &ctx->sub->abo[i];
       res = (struct vrend_resource *)abo->res;
       glBindBufferRange(GL_ATOMIC_COUNTER_BUFFER, i, res->id,
-                        abo->buffer_offset, abo->buffer_size);
+                        res->buffer_offset + abo->buffer_offset, abo->buffer_size);
    }
+   ctx->sub->abos_dirty = 0;
 }
 
-static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_type)
+static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_type,
+                                          uint32_t dirty)
 {
    GLenum access;
    GLboolean layered;
@@ -3704,7 +4968,7 @@ static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_
    if (!ctx->sub->prog->img_locs[shader_type])
       return;
 
-   mask = ctx->sub->images_used_mask[shader_type];
+   mask = ctx->sub->images_used_mask[shader_type] & dirty;
    while (mask) {
       unsigned i = u_bit_scan(&mask);
 
@@ -3719,9 +4983,13 @@ static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_
          /* glTexBuffer doesn't accept GL_RGBA8_SNORM, find an appropriate replacement. */
          uint32_t format = (iview->format == GL_RGBA8_SNORM) ? GL_RGBA8UI : iview->format;
 
-         glBindBufferARB(GL_TEXTURE_BUFFER, iview->texture->id);
+         vrend_bind_buffer(GL_TEXTURE_BUFFER, iview->texture->id);
          glBindTexture(GL_TEXTURE_BUFFER, iview->texture->tbo_tex_id);
-         glTexBuffer(GL_TEXTURE_BUFFER, format, iview->texture->id);
+         if (iview->texture->slab)
+            glTexBufferRange(GL_TEXTURE_BUFFER, format, iview->texture->id,
+                             iview->texture->buffer_offset, iview->texture->base.width0);
+         else
+            glTexBuffer(GL_TEXTURE_BUFFER, format, iview->texture->id);
          tex_id = iview->texture->tbo_tex_id;
          level = first_layer = 0;
          layered = GL_TRUE;
@@ -3754,35 +5022,111 @@ static void vrend_draw_bind_images_shader(struct vrend_context *ctx, int shader_
    }
 }
 
+static void vrend_draw_bind_textures_done(struct vrend_context *ctx, int sampler_id)
+{
+   if (sampler_id < vrend_state.scratch_texture_unit) {
+      vrend_active_texture(GL_TEXTURE0 + vrend_state.scratch_texture_unit);
+   } else {
+      /* no unit to spare, other binds may land on a sampler unit */
+      for (int i = 0; i < PIPE_SHADER_TYPES; i++)
+         ctx->sub->views_dirty[i] = ~0u;
+   }
+}
+
 static void vrend_draw_bind_objects(struct vrend_context *ctx, bool new_program)
 {
    int ubo_id = 0, sampler_id = 0;
+   uint32_t images_dirty = 0, ssbos_dirty = 0;
+   bool emitted = false;
+
+   if (new_program)
+      vrend_mark_bindings_dirty(ctx->sub);
+
+   for (int shader_type = PIPE_SHADER_VERTEX; shader_type <= ctx->sub->last_shader_idx; shader_type++) {
+      images_dirty |= ctx->sub->images_dirty[shader_type];
+      ssbos_dirty |= ctx->sub->ssbos_dirty[shader_type];
+   }
+
    for (int shader_type = PIPE_SHADER_VERTEX; shader_type <= ctx->sub->last_shader_idx; shader_type++) {
       vrend_draw_bind_ubo_shader(ctx, shader_type, &ubo_id);
-      vrend_draw_bind_const_shader(ctx, shader_type, new_program);
-      vrend_draw_bind_samplers_shader(ctx, shader_type, &sampler_id);
-      vrend_draw_bind_images_shader(ctx, shader_type);
-      vrend_draw_bind_ssbo_shader(ctx, shader_type);
+      vrend_draw_bind_const_shader(ctx, shader_type, new_program, &ubo_id);
+      vrend_draw_bind_images_shader(ctx, shader_type, images_dirty);
+      vrend_draw_bind_ssbo_shader(ctx, shader_type, ssbos_dirty);
+      ctx->sub->images_dirty[shader_type] = 0;
+      ctx->sub->ssbos_dirty[shader_type] = 0;
    }
+   vrend_draw_rebind_const_ubos(ctx);
+
+   for (int shader_type = PIPE_SHADER_VERTEX; shader_type <= ctx->sub->last_shader_idx; shader_type++)
+      emitted |= vrend_draw_bind_samplers_shader(ctx, shader_type, &sampler_id);
 
    vrend_draw_bind_abo_shader(ctx);
 
    if (vrend_state.use_core_profile && ctx->sub->prog->fs_stipple_loc != -1) {
-      glActiveTexture(GL_TEXTURE0 + sampler_id);
+      vrend_active_texture(GL_TEXTURE0 + sampler_id);
       glBindTexture(GL_TEXTURE_2D, ctx->pstipple_tex_id);
       glUniform1i(ctx->sub->prog->fs_stipple_loc, sampler_id);
+      emitted = true;
    }
+   if (emitted)
+      vrend_draw_bind_textures_done(ctx, sampler_id);
    ctx->sub->sampler_state_dirty = false;
 }
 
+static void vrend_draw_batch_arrays(GLenum mode, const struct vrend_draw_batch *batch)
+{
+   unsigned i;
+
+   if (has_feature(feat_multi_draw)) {
+      glMultiDrawArrays(mode, batch->starts, batch->counts, batch->num_draws);
+      return;
+   }
+
+   for (i = 0; i < batch->num_draws; i++)
+      glDrawArrays(mode, batch->starts[i], batch->counts[i]);
+}
+
+static void vrend_draw_batch_elements(GLenum mode, GLenum elsz, uint32_t buffer_offset,
+                                      const struct vrend_draw_batch *batch)
+{
+   const GLvoid *indices[VREND_MAX_BATCHED_DRAWS];
+   bool has_bias = false;
+   unsigned i;
+
+   for (i = 0; i < batch->num_draws; i++) {
+      indices[i] = (const GLvoid *)(unsigned long)(buffer_offset + batch->ib_offsets[i]);
+      has_bias |= batch->index_biases[i] != 0;
+   }
+
+   if (has_feature(feat_multi_draw) && !has_bias) {
+      glMultiDrawElements(mode, batch->counts, elsz, indices, batch->num_draws);
+      return;
+   }
+
+   if (has_feature(feat_multi_draw) && has_feature(feat_draw_elements_base_vertex)) {
+      glMultiDrawElementsBaseVertex(mode, batch->counts, elsz, indices,
+                                    batch->num_draws, batch->index_biases);
+      return;
+   }
+
+   for (i = 0; i < batch->num_draws; i++) {
+      if (batch->index_biases[i])
+         glDrawElementsBaseVertex(mode, batch->counts[i], elsz, indices[i], batch->index_biases[i]);
+      else
+         glDrawElements(mode, batch->counts[i], elsz, indices[i]);
+   }
+}
+
 int vrend_draw_vbo(struct vrend_context *ctx,
                    const struct pipe_draw_info *info,
                    uint32_t cso, uint32_t indirect_handle,
-                   uint32_t indirect_draw_count_handle)
+                   uint32_t indirect_draw_count_handle,
+                   const struct vrend_draw_batch *batch)
 {
    int i;
    bool new_program = false;
    struct vrend_resource *indirect_res = NULL;
+   uint32_t ib_offset = 0;
 
    if (ctx->in_error)
       return 0;
@@ -3797,7 +5141,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       if (!has_feature(feat_indirect_draw))
          return EINVAL;
       indirect_res = vrend_renderer_ctx_res_lookup(ctx, indirect_handle);
-      if (!indirect_res) {
+      if (!indirect_res || vrend_resource_use(indirect_res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, indirect_handle);
          return 0;
       }
@@ -3812,7 +5156,6 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (ctx->ctx_switch_pending)
       vrend_finish_context_switch(ctx);
 
-   vrend_update_frontface_state(ctx);
    if (ctx->sub->stencil_state_dirty)
       vrend_update_stencil_state(ctx);
    if (ctx->sub->scissor_state_dirty)
@@ -3821,7 +5164,12 @@ int vrend_draw_vbo(struct vrend_context *ctx,
    if (ctx->sub->viewport_state_dirty)
       vrend_update_viewport_state(ctx);
 
-   vrend_patch_blend_state(ctx);
+   if (ctx->sub->drawn_epoch != ctx->sub->state_epoch) {
+      vrend_update_frontface_state(ctx);
+      vrend_patch_blend_state(ctx);
+      ctx->sub->drawn_epoch = ctx->sub->state_epoch;
+      ctx->sub->shader_dirty = true;
+   }
 
    if (ctx->sub->shader_dirty) {
       struct vrend_linked_shader_program *prog;
@@ -3898,6 +5246,7 @@ int vrend_draw_vbo(struct vrend_context *ctx,
             ctx->sub->prog_ids[PIPE_SHADER_TESS_EVAL] = ctx->sub->shaders[PIPE_SHADER_TESS_EVAL]->current->id;
          ctx->sub->prog = prog;
       }
+      ctx->sub->shader_dirty = false;
    }
    if (!ctx->sub->prog) {
       fprintf(stderr,"dropping rendering due to missing shaders: %s\n", ctx->debug_name);
@@ -3938,9 +5287,10 @@ int vrend_draw_vbo(struct vrend_context *ctx,
 
    if (info->indexed) {
       struct vrend_resource *res = (struct vrend_resource *)ctx->sub->ib.buffer;
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, res->id);
+      vrend_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, res->id);
+      ib_offset = res->buffer_offset + ctx->sub->ib.offset;
    } else
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+      vrend_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
    if (ctx->sub->current_so) {
       if (ctx->sub->current_so->xfb_state == XFB_STATE_STARTED_NEED_BEGIN) {
@@ -3960,21 +5310,21 @@ int vrend_draw_vbo(struct vrend_context *ctx,
 
    if (info->primitive_restart) {
       if (vrend_state.use_gles) {
-         glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+         vrend_enable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
       } else if (has_feature(feat_nv_prim_restart)) {
          glEnableClientState(GL_PRIMITIVE_RESTART_NV);
          glPrimitiveRestartIndexNV(info->restart_index);
       } else if (has_feature(feat_gl_prim_restart)) {
-         glEnable(GL_PRIMITIVE_RESTART);
+         vrend_enable(GL_PRIMITIVE_RESTART);
          glPrimitiveRestartIndex(info->restart_index);
       }
    }
 
    if (has_feature(feat_indirect_draw)) {
       if (indirect_res)
-         glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_res->id);
+         vrend_bind_buffer(GL_DRAW_INDIRECT_BUFFER, indirect_res->id);
       else
-         glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+         vrend_bind_buffer(GL_DRAW_INDIRECT_BUFFER, 0);
    }
 
    if (info->vertices_per_patch && has_feature(feat_tessellation))
@@ -3987,7 +5337,9 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       int start = cso ? 0 : info->start;
 
       if (indirect_handle)
-         glDrawArraysIndirect(mode, (GLvoid const *)(unsigned long)info->indirect.offset);
+         glDrawArraysIndirect(mode, (GLvoid const *)(unsigned long)(indirect_res->buffer_offset + info->indirect.offset));
+      else if (batch)
+         vrend_draw_batch_arrays(mode, batch);
       else if (info->instance_count <= 1)
          glDrawArrays(mode, start, count);
       else if (info->start_instance)
@@ -4011,29 +5363,33 @@ int vrend_draw_vbo(struct vrend_context *ctx,
       }
 
       if (indirect_handle)
-         glDrawElementsIndirect(mode, elsz, (GLvoid const *)(unsigned long)info->indirect.offset);
+         glDrawElementsIndirect(mode, elsz, (GLvoid const *)(unsigned long)(indirect_res->buffer_offset + info->indirect.offset));
+      else if (batch)
+         vrend_draw_batch_elements(mode, elsz,
+                                   ((struct vrend_resource *)ctx->sub->ib.buffer)->buffer_offset,
+                                   batch);
       else if (info->index_bias) {
          if (info->instance_count > 1)
-            glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset, info->instance_count, info->index_bias);
+            glDrawElementsInstancedBaseVertex(mode, info->count, elsz, (void *)(unsigned long)ib_offset, info->instance_count, info->index_bias);
          else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset, info->index_bias);
+            glDrawRangeElementsBaseVertex(mode, info->min_index, info->max_index, info->count, elsz, (void *)(unsigned long)ib_offset, info->index_bias);
          else
-            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset, info->index_bias);
+            glDrawElementsBaseVertex(mode, info->count, elsz, (void *)(unsigned long)ib_offset, info->index_bias);
       } else if (info->instance_count > 1) {
-         glDrawElementsInstancedARB(mode, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset, info->instance_count);
+         glDrawElementsInstancedARB(mode, info->count, elsz, (void *)(unsigned long)ib_offset, info->instance_count);
       } else if (info->min_index != 0 || info->max_index != (unsigned)-1)
-         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset);
+         glDrawRangeElements(mode, info->min_index, info->max_index, info->count, elsz, (void *)(unsigned long)ib_offset);
       else
-         glDrawElements(mode, info->count, elsz, (void *)(unsigned long)ctx->sub->ib.offset);
+         glDrawElements(mode, info->count, elsz, (void *)(unsigned long)ib_offset);
    }
 
    if (info->primitive_restart) {
       if (vrend_state.use_gles) {
-         glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+         vrend_enable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
       } else if (has_feature(feat_nv_prim_restart)) {
          glDisableClientState(GL_PRIMITIVE_RESTART_NV);
       } else if (has_feature(feat_gl_prim_restart)) {
-         glDisable(GL_PRIMITIVE_RESTART);
+         vrend_disable(GL_PRIMITIVE_RESTART);
       }
    }
 
@@ -4094,29 +5450,34 @@ void vrend_launch_grid(struct vrend_context *ctx,
    }
    vrend_use_program(ctx, ctx->sub->prog->id);
 
+   /* compute shares the binding points with the draw stages, emit all of
+    * them and have the next draw do the same */
    int sampler_id = 0, ubo_id = 0;
+   vrend_mark_bindings_dirty(ctx->sub);
    vrend_draw_bind_ubo_shader(ctx, PIPE_SHADER_COMPUTE, &ubo_id);
-   vrend_draw_bind_const_shader(ctx, PIPE_SHADER_COMPUTE, new_program);
-   vrend_draw_bind_samplers_shader(ctx, PIPE_SHADER_COMPUTE, &sampler_id);
-   vrend_draw_bind_images_shader(ctx, PIPE_SHADER_COMPUTE);
-   vrend_draw_bind_ssbo_shader(ctx, PIPE_SHADER_COMPUTE);
+   vrend_draw_bind_const_shader(ctx, PIPE_SHADER_COMPUTE, new_program, &ubo_id);
+   vrend_draw_bind_images_shader(ctx, PIPE_SHADER_COMPUTE, ~0u);
+   vrend_draw_bind_ssbo_shader(ctx, PIPE_SHADER_COMPUTE, ~0u);
+   if (vrend_draw_bind_samplers_shader(ctx, PIPE_SHADER_COMPUTE, &sampler_id))
+      vrend_draw_bind_textures_done(ctx, sampler_id);
    vrend_draw_bind_abo_shader(ctx);
+   vrend_mark_bindings_dirty(ctx->sub);
 
    if (indirect_handle) {
       indirect_res = vrend_renderer_ctx_res_lookup(ctx, indirect_handle);
-      if (!indirect_res) {
+      if (!indirect_res || vrend_resource_use(indirect_res)) {
          report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, indirect_handle);
          return;
       }
    }
 
    if (indirect_res)
-      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, indirect_res->id);
+      vrend_bind_buffer(GL_DISPATCH_INDIRECT_BUFFER, indirect_res->id);
    else
-      glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+      vrend_bind_buffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
 
    if (indirect_res) {
-      glDispatchComputeIndirect(indirect_offset);
+      glDispatchComputeIndirect(indirect_res->buffer_offset + indirect_offset);
    } else {
       glDispatchCompute(grid[0], grid[1], grid[2]);
    }
@@ -4262,10 +5623,10 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
             report_gles_warn(ctx, GLES_WARN_LOGIC_OP, 0);
          }
       } else if (state->logicop_enable) {
-         glEnable(GL_COLOR_LOGIC_OP);
+         vrend_enable(GL_COLOR_LOGIC_OP);
          glLogicOp(translate_logicop(state->logicop_func));
       } else {
-         glDisable(GL_COLOR_LOGIC_OP);
+         vrend_disable(GL_COLOR_LOGIC_OP);
       }
    }
 
@@ -4290,9 +5651,9 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
                                     translate_blend_factor(state->rt[i].alpha_dst_factor));
             glBlendEquationSeparateiARB(i, translate_blend_func(state->rt[i].rgb_func),
                                         translate_blend_func(state->rt[i].alpha_func));
-            glEnableIndexedEXT(GL_BLEND, i);
+            vrend_set_cap_indexed(GL_BLEND, i, true);
          } else
-            glDisableIndexedEXT(GL_BLEND, i);
+            vrend_set_cap_indexed(GL_BLEND, i, false);
 
          if (state->rt[i].colormask != ctx->sub->hw_blend_state.rt[i].colormask) {
             ctx->sub->hw_blend_state.rt[i].colormask = state->rt[i].colormask;
@@ -4314,10 +5675,10 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
                              translate_blend_factor(state->rt[0].alpha_dst_factor));
          glBlendEquationSeparate(translate_blend_func(state->rt[0].rgb_func),
                                  translate_blend_func(state->rt[0].alpha_func));
-         glEnable(GL_BLEND);
+         vrend_enable(GL_BLEND);
       }
       else
-         glDisable(GL_BLEND);
+         vrend_disable(GL_BLEND);
 
       if (state->rt[0].colormask != ctx->sub->hw_blend_state.rt[0].colormask) {
          int i;
@@ -4333,22 +5694,22 @@ static void vrend_hw_emit_blend(struct vrend_context *ctx, struct pipe_blend_sta
 
    if (has_feature(feat_multisample)) {
       if (state->alpha_to_coverage)
-         glEnable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+         vrend_enable(GL_SAMPLE_ALPHA_TO_COVERAGE);
       else
-         glDisable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+         vrend_disable(GL_SAMPLE_ALPHA_TO_COVERAGE);
 
       if (!vrend_state.use_gles) {
          if (state->alpha_to_one)
-            glEnable(GL_SAMPLE_ALPHA_TO_ONE);
+            vrend_enable(GL_SAMPLE_ALPHA_TO_ONE);
          else
-            glDisable(GL_SAMPLE_ALPHA_TO_ONE);
+            vrend_disable(GL_SAMPLE_ALPHA_TO_ONE);
       }
    }
 
    if (state->dither)
-      glEnable(GL_DITHER);
+      vrend_enable(GL_DITHER);
    else
-      glDisable(GL_DITHER);
+      vrend_disable(GL_DITHER);
 }
 
 /* there are a few reasons we might need to patch the blend state.
@@ -4419,7 +5780,9 @@ void vrend_object_bind_blend(struct vrend_context *ctx,
 
    if (handle == 0) {
       memset(&ctx->sub->blend_state, 0, sizeof(ctx->sub->blend_state));
-      glDisable(GL_BLEND);
+      vrend_interned_state_reference((void **)&ctx->sub->blend, NULL);
+      vrend_disable(GL_BLEND);
+      ctx->sub->state_epoch++;
       return;
    }
    state = vrend_object_lookup(ctx->sub->object_hash, handle, VIRGL_OBJECT_BLEND);
@@ -4428,7 +5791,11 @@ void vrend_object_bind_blend(struct vrend_context *ctx,
       return;
    }
 
-   ctx->sub->shader_dirty = true;
+   if (ctx->sub->blend == state)
+      return;
+   vrend_interned_state_reference((void **)&ctx->sub->blend, state);
+
+   ctx->sub->state_epoch++;
    ctx->sub->blend_state = *state;
 
    vrend_hw_emit_blend(ctx, &ctx->sub->blend_state);
@@ -4464,9 +5831,9 @@ void vrend_object_bind_dsa(struct vrend_context *ctx,
 
    if (handle == 0) {
       memset(&ctx->sub->dsa_state, 0, sizeof(ctx->sub->dsa_state));
-      ctx->sub->dsa = NULL;
+      vrend_interned_state_reference((void **)&ctx->sub->dsa, NULL);
       ctx->sub->stencil_state_dirty = true;
-      ctx->sub->shader_dirty = true;
+      ctx->sub->state_epoch++;
       vrend_hw_emit_dsa(ctx);
       return;
    }
@@ -4477,12 +5844,13 @@ void vrend_object_bind_dsa(struct vrend_context *ctx,
       return;
    }
 
-   if (ctx->sub->dsa != state) {
-      ctx->sub->stencil_state_dirty = true;
-      ctx->sub->shader_dirty = true;
-   }
+   if (ctx->sub->dsa == state)
+      return;
+
+   ctx->sub->stencil_state_dirty = true;
+   ctx->sub->state_epoch++;
    ctx->sub->dsa_state = *state;
-   ctx->sub->dsa = state;
+   vrend_interned_state_reference((void **)&ctx->sub->dsa, state);
 
    vrend_hw_emit_dsa(ctx);
 }
@@ -4564,9 +5932,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_DEPTH_CLIP, 0);
       }
    } else if (state->depth_clip) {
-      glDisable(GL_DEPTH_CLAMP);
+      vrend_disable(GL_DEPTH_CLAMP);
    } else {
-      glEnable(GL_DEPTH_CLAMP);
+      vrend_enable(GL_DEPTH_CLAMP);
    }
 
    if (vrend_state.use_gles) {
@@ -4577,9 +5945,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POINT_SIZE, 0);
       }
    } else if (state->point_size_per_vertex) {
-      glEnable(GL_PROGRAM_POINT_SIZE);
+      vrend_enable(GL_PROGRAM_POINT_SIZE);
    } else {
-      glDisable(GL_PROGRAM_POINT_SIZE);
+      vrend_disable(GL_PROGRAM_POINT_SIZE);
       if (state->point_size) {
          glPointSize(state->point_size);
       }
@@ -4591,9 +5959,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (state->rasterizer_discard != ctx->sub->hw_rs_state.rasterizer_discard) {
       ctx->sub->hw_rs_state.rasterizer_discard = state->rasterizer_discard;
       if (state->rasterizer_discard)
-         glEnable(GL_RASTERIZER_DISCARD);
+         vrend_enable(GL_RASTERIZER_DISCARD);
       else
-         glDisable(GL_RASTERIZER_DISCARD);
+         vrend_disable(GL_RASTERIZER_DISCARD);
    }
 
    if (vrend_state.use_gles == true) {
@@ -4612,9 +5980,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       report_core_warn(ctx, CORE_PROFILE_WARN_POLYGON_MODE, 0);
 
    if (state->offset_tri) {
-      glEnable(GL_POLYGON_OFFSET_FILL);
+      vrend_enable(GL_POLYGON_OFFSET_FILL);
    } else {
-      glDisable(GL_POLYGON_OFFSET_FILL);
+      vrend_disable(GL_POLYGON_OFFSET_FILL);
    }
 
    if (vrend_state.use_gles) {
@@ -4622,9 +5990,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_OFFSET_LINE, 0);
       }
    } else if (state->offset_line) {
-      glEnable(GL_POLYGON_OFFSET_LINE);
+      vrend_enable(GL_POLYGON_OFFSET_LINE);
    } else {
-      glDisable(GL_POLYGON_OFFSET_LINE);
+      vrend_disable(GL_POLYGON_OFFSET_LINE);
    }
 
    if (vrend_state.use_gles) {
@@ -4632,9 +6000,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_OFFSET_POINT, 0);
       }
    } else if (state->offset_point) {
-      glEnable(GL_POLYGON_OFFSET_POINT);
+      vrend_enable(GL_POLYGON_OFFSET_POINT);
    } else {
-      glDisable(GL_POLYGON_OFFSET_POINT);
+      vrend_disable(GL_POLYGON_OFFSET_POINT);
    }
 
 
@@ -4669,9 +6037,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
 
    if (vrend_state.use_core_profile == false) {
       if (state->poly_stipple_enable)
-         glEnable(GL_POLYGON_STIPPLE);
+         vrend_enable(GL_POLYGON_STIPPLE);
       else
-         glDisable(GL_POLYGON_STIPPLE);
+         vrend_disable(GL_POLYGON_STIPPLE);
    } else if (state->poly_stipple_enable) {
       if (!ctx->pstip_inited)
          vrend_init_pstipple_texture(ctx);
@@ -4680,7 +6048,7 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (state->point_quad_rasterization) {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glEnable(GL_POINT_SPRITE);
+         vrend_enable(GL_POINT_SPRITE);
       }
 
       if (vrend_state.use_gles == false) {
@@ -4689,7 +6057,7 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    } else {
       if (vrend_state.use_core_profile == false &&
           vrend_state.use_gles == false) {
-         glDisable(GL_POINT_SPRITE);
+         vrend_disable(GL_POINT_SPRITE);
       }
    }
 
@@ -4707,33 +6075,33 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
       default:
          fprintf(stderr, "unhandled cull-face: %x\n", state->cull_face);
       }
-      glEnable(GL_CULL_FACE);
+      vrend_enable(GL_CULL_FACE);
    } else
-      glDisable(GL_CULL_FACE);
+      vrend_disable(GL_CULL_FACE);
 
    /* two sided lighting handled in shader for core profile */
    if (vrend_state.use_core_profile == false) {
       if (state->light_twoside)
-         glEnable(GL_VERTEX_PROGRAM_TWO_SIDE);
+         vrend_enable(GL_VERTEX_PROGRAM_TWO_SIDE);
       else
-         glDisable(GL_VERTEX_PROGRAM_TWO_SIDE);
+         vrend_disable(GL_VERTEX_PROGRAM_TWO_SIDE);
    }
 
    if (state->clip_plane_enable != ctx->sub->hw_rs_state.clip_plane_enable) {
       ctx->sub->hw_rs_state.clip_plane_enable = state->clip_plane_enable;
       for (i = 0; i < 8; i++) {
          if (state->clip_plane_enable & (1 << i))
-            glEnable(GL_CLIP_PLANE0 + i);
+            vrend_enable(GL_CLIP_PLANE0 + i);
          else
-            glDisable(GL_CLIP_PLANE0 + i);
+            vrend_disable(GL_CLIP_PLANE0 + i);
       }
    }
    if (vrend_state.use_core_profile == false) {
       glLineStipple(state->line_stipple_factor, state->line_stipple_pattern);
       if (state->line_stipple_enable)
-         glEnable(GL_LINE_STIPPLE);
+         vrend_enable(GL_LINE_STIPPLE);
       else
-         glDisable(GL_LINE_STIPPLE);
+         vrend_disable(GL_LINE_STIPPLE);
    } else if (state->line_stipple_enable) {
       if (vrend_state.use_gles)
          report_core_warn(ctx, GLES_WARN_STIPPLE, 0);
@@ -4747,9 +6115,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_LINE_SMOOTH, 0);
       }
    } else if (state->line_smooth) {
-      glEnable(GL_LINE_SMOOTH);
+      vrend_enable(GL_LINE_SMOOTH);
    } else {
-      glDisable(GL_LINE_SMOOTH);
+      vrend_disable(GL_LINE_SMOOTH);
    }
 
    if (vrend_state.use_gles) {
@@ -4757,9 +6125,9 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
          report_gles_warn(ctx, GLES_WARN_POLY_SMOOTH, 0);
       }
    } else if (state->poly_smooth) {
-      glEnable(GL_POLYGON_SMOOTH);
+      vrend_enable(GL_POLYGON_SMOOTH);
    } else {
-      glDisable(GL_POLYGON_SMOOTH);
+      vrend_disable(GL_POLYGON_SMOOTH);
    }
 
    if (vrend_state.use_core_profile == false) {
@@ -4780,24 +6148,24 @@ static void vrend_hw_emit_rs(struct vrend_context *ctx)
    if (has_feature(feat_multisample)) {
       if (has_feature(feat_sample_mask)) {
 	 if (state->multisample)
-	    glEnable(GL_SAMPLE_MASK);
+	    vrend_enable(GL_SAMPLE_MASK);
 	 else
-	    glDisable(GL_SAMPLE_MASK);
+	    vrend_disable(GL_SAMPLE_MASK);
       }
 
       /* GLES doesn't have GL_MULTISAMPLE */
       if (!vrend_state.use_gles) {
          if (state->multisample)
-            glEnable(GL_MULTISAMPLE);
+            vrend_enable(GL_MULTISAMPLE);
          else
-            glDisable(GL_MULTISAMPLE);
+            vrend_disable(GL_MULTISAMPLE);
       }
 
       if (has_feature(feat_sample_shading)) {
          if (state->force_persample_interp)
-            glEnable(GL_SAMPLE_SHADING);
+            vrend_enable(GL_SAMPLE_SHADING);
          else
-            glDisable(GL_SAMPLE_SHADING);
+            vrend_disable(GL_SAMPLE_SHADING);
       }
    }
 }
@@ -4809,6 +6177,8 @@ void vrend_object_bind_rasterizer(struct vrend_context *ctx,
 
    if (handle == 0) {
       memset(&ctx->sub->rs_state, 0, sizeof(ctx->sub->rs_state));
+      vrend_interned_state_reference((void **)&ctx->sub->rs, NULL);
+      ctx->sub->state_epoch++;
       return;
    }
 
@@ -4819,9 +6189,18 @@ void vrend_object_bind_rasterizer(struct vrend_context *ctx,
       return;
    }
 
+   if (ctx->sub->rs == state)
+      return;
+   vrend_interned_state_reference((void **)&ctx->sub->rs, state);
+
    ctx->sub->rs_state = *state;
    ctx->sub->scissor_state_dirty = (1 << 0);
-   ctx->sub->shader_dirty = true;
+   ctx->sub->state_epoch++;
+   /* point sprite coord replace is per texture unit state */
+   if (!vrend_state.use_core_profile) {
+      for (int i = 0; i < PIPE_SHADER_TYPES; i++)
+         ctx->sub->views_dirty[i] = ~0u;
+   }
    vrend_hw_emit_rs(ctx);
 }
 
@@ -4854,6 +6233,7 @@ void vrend_bind_sampler_states(struct vrend_context *ctx,
          state = vrend_object_lookup(ctx->sub->object_hash, handles[i], VIRGL_OBJECT_SAMPLER_STATE);
 
       ctx->sub->sampler_state[shader_type][i + start_slot] = state;
+      ctx->sub->views_dirty[shader_type] |= (1 << (i + start_slot));
    }
    ctx->sub->sampler_state_dirty = true;
 }
@@ -4892,16 +6272,13 @@ static void vrend_apply_sampler_state(struct vrend_context *ctx,
     */
    bool is_emulated_alpha = vrend_format_is_emulated_alpha(res->base.format);
    if (has_feature(feat_samplers)) {
-      int sampler = vstate->ids[srgb_decode == GL_SKIP_DECODE_EXT ? 0 : 1];
-      if (is_emulated_alpha) {
-         union pipe_color_union border_color;
-         border_color = state->border_color;
-         border_color.ui[0] = border_color.ui[3];
-         border_color.ui[3] = 0;
-         glSamplerParameterIuiv(sampler, GL_TEXTURE_BORDER_COLOR, border_color.ui);
-      }
+      uint32_t variant = (srgb_decode == GL_SKIP_DECODE_EXT ? 0 : VREND_SAMPLER_VARIANT_DECODE) |
+                         (is_emulated_alpha ? VREND_SAMPLER_VARIANT_EMULATED_ALPHA : 0);
 
-      glBindSampler(sampler_id, sampler);
+      if (!vstate->objs[variant])
+         vstate->objs[variant] = vrend_sampler_object_get(state, variant);
+      if (vstate->objs[variant])
+         glBindSampler(sampler_id, vstate->objs[variant]->id);
       return;
    }
 
@@ -4948,9 +6325,9 @@ static void vrend_apply_sampler_state(struct vrend_context *ctx,
     */
    if (!vrend_state.use_gles) {
       if (state->seamless_cube_map) {
-         glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+         vrend_enable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
       } else {
-         glDisable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+         vrend_disable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
       }
    }
 
@@ -4995,13 +6372,150 @@ static GLenum tgsitargettogltarget(const enum pipe_texture_target target, int nr
    return PIPE_BUFFER;
 }
 
+static void vrend_fence_queue_init(struct vrend_fence_queue *queue)
+{
+   queue->stub.next = NULL;
+   queue->head = &queue->stub;
+   queue->tail = &queue->stub;
+}
+
+static void vrend_fence_queue_push(struct vrend_fence_queue *queue,
+                                   struct vrend_fence *fence)
+{
+   struct vrend_fence *prev;
+
+   fence->next = NULL;
+   prev = __atomic_exchange_n(&queue->head, fence, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&prev->next, fence, __ATOMIC_RELEASE);
+}
+
+/* consumer side only */
+static struct vrend_fence *vrend_fence_queue_pop(struct vrend_fence_queue *queue)
+{
+   struct vrend_fence *tail = queue->tail;
+   struct vrend_fence *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+   if (tail == &queue->stub) {
+      if (!next)
+         return NULL;
+      queue->tail = next;
+      tail = next;
+      next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+   }
+
+   if (next) {
+      queue->tail = next;
+      return tail;
+   }
+
+   /* a producer swapped the head but didn't link it yet */
+   if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+      return NULL;
+
+   vrend_fence_queue_push(queue, &queue->stub);
+   next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+   if (next) {
+      queue->tail = next;
+      return tail;
+   }
+   return NULL;
+}
+
+/* consumer side only */
+static bool vrend_fence_queue_is_empty(struct vrend_fence_queue *queue)
+{
+   return __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == queue->tail;
+}
+
+static bool vrend_fence_is_signalled(struct vrend_fence *fence, GLuint64 timeout)
+{
+   GLenum glret = glClientWaitSync(fence->syncobj, 0, timeout);
+
+   if (glret == GL_WAIT_FAILED)
+      fprintf(stderr, "wait sync failed: illegal fence object %p\n", fence->syncobj);
+   return glret != GL_TIMEOUT_EXPIRED;
+}
+
+static void vrend_fence_retire(struct vrend_fence *fence, struct list_head *retired)
+{
+   if (fence->unordered)
+      fence->timeline->unordered--;
+   list_del(&fence->fences);
+   glDeleteSync(fence->syncobj);
+   list_addtail(&fence->fences, retired);
+}
+
+/* Moves the submitted fences to their timelines and retires the signalled
+ * ones. Sync objects of the same GL context signal in order, so once the
+ * newest one is done a timeline whose fences all come from one context is
+ * retired without looking at the others. Fences from different contexts are
+ * checked one by one. Returns the number of retired fences, and the oldest
+ * one still pending.
+ */
+static int vrend_fence_process(struct vrend_fence **oldest)
+{
+   struct vrend_fence_timeline *timeline, *tmp;
+   struct vrend_fence *fence, *stor, *last;
+   struct list_head retired_list;
+   int retired = 0;
+
+   list_inithead(&retired_list);
+   while ((fence = vrend_fence_queue_pop(&vrend_state.fence_submit))) {
+      timeline = fence->timeline;
+      fence->unordered = false;
+      if (LIST_IS_EMPTY(&timeline->pending)) {
+         list_addtail(&timeline->active, &vrend_state.fence_active);
+      } else {
+         last = LIST_ENTRY(struct vrend_fence, timeline->pending.prev, fences);
+         if (!fence->gl_context || last->gl_context != fence->gl_context) {
+            fence->unordered = true;
+            timeline->unordered++;
+         }
+      }
+      list_addtail(&fence->fences, &timeline->pending);
+   }
+
+   *oldest = NULL;
+   LIST_FOR_EACH_ENTRY_SAFE(timeline, tmp, &vrend_state.fence_active, active) {
+      last = LIST_ENTRY(struct vrend_fence, timeline->pending.prev, fences);
+      if (!timeline->unordered && vrend_fence_is_signalled(last, 0)) {
+         LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &timeline->pending, fences) {
+            vrend_fence_retire(fence, &retired_list);
+            retired++;
+         }
+      } else {
+         LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &timeline->pending, fences) {
+            if (fence == last || !vrend_fence_is_signalled(fence, 0)) {
+               if (!*oldest || fence->seqno < (*oldest)->seqno)
+                  *oldest = fence;
+               break;
+            }
+            vrend_fence_retire(fence, &retired_list);
+            retired++;
+         }
+      }
+
+      if (LIST_IS_EMPTY(&timeline->pending))
+         list_del(&timeline->active);
+   }
+
+   /* the main thread may free a timeline as soon as it has its last fence */
+   LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &retired_list, fences)
+      vrend_fence_queue_push(&vrend_state.fence_done, fence);
+   return retired;
+}
+
+static void vrend_reset_fences(void);
+static void vrend_renderer_use_upload_thread(void);
+static void vrend_free_upload_thread(void);
+
 static void vrend_free_sync_thread(void)
 {
    if (!vrend_state.sync_thread)
       return;
 
    pipe_mutex_lock(vrend_state.fence_mutex);
-   vrend_state.stop_sync_thread = true;
+   __atomic_store_n(&vrend_state.stop_sync_thread, true, __ATOMIC_RELEASE);
    pipe_condvar_signal(vrend_state.fence_cond);
    pipe_mutex_unlock(vrend_state.fence_mutex);
 
@@ -5034,66 +6548,50 @@ write_full(int fd, const void *ptr, size_t count)
    return total;
 }
 
-static void wait_sync(struct vrend_fence *fence)
+/* Polls the timelines, so a context with a long running fence doesn't hold
+ * back the others. When nothing is ready, it blocks for a short while on
+ * the oldest fence, which usually is the next to signal, and it only
+ * sleeps on the condition when there is nothing left to wait for.
+ */
+static int thread_sync(void *arg)
 {
-   GLenum glret;
-   ssize_t n;
+   virgl_gl_context gl_context;
+   struct vrend_fence *oldest;
    uint64_t value = 1;
+   ssize_t n;
 
-   do {
-      glret = glClientWaitSync(fence->syncobj, 0, 1000000000);
+   vrend_instance = arg;
+   gl_context = vrend_state.sync_context;
+   vrend_clicbs->make_current(0, gl_context);
 
-      switch (glret) {
-      case GL_WAIT_FAILED:
-         fprintf(stderr, "wait sync failed: illegal fence object %p\n", fence->syncobj);
-         break;
-      case GL_ALREADY_SIGNALED:
-      case GL_CONDITION_SATISFIED:
-         break;
-      default:
-         break;
+   while (!__atomic_load_n(&vrend_state.stop_sync_thread, __ATOMIC_ACQUIRE)) {
+      if (vrend_fence_process(&oldest)) {
+         /* one write for all fences retired in this pass */
+         n = write_full(vrend_state.eventfd, &value, sizeof(value));
+         if (n != sizeof(value)) {
+            perror("failed to write to eventfd\n");
+         }
+         continue;
       }
-   } while (glret == GL_TIMEOUT_EXPIRED);
-
-   pipe_mutex_lock(vrend_state.fence_mutex);
-   list_addtail(&fence->fences, &vrend_state.fence_list);
-   pipe_mutex_unlock(vrend_state.fence_mutex);
-
-   n = write_full(vrend_state.eventfd, &value, sizeof(value));
-   if (n != sizeof(value)) {
-      perror("failed to write to eventfd\n");
-   }
-}
-
-static int thread_sync(UNUSED void *arg)
-{
-   virgl_gl_context gl_context = vrend_state.sync_context;
-   struct vrend_fence *fence, *stor;
-
-
-   pipe_mutex_lock(vrend_state.fence_mutex);
-   vrend_clicbs->make_current(0, gl_context);
 
-   while (!vrend_state.stop_sync_thread) {
-      if (LIST_IS_EMPTY(&vrend_state.fence_wait_list) &&
-          pipe_condvar_wait(vrend_state.fence_cond, vrend_state.fence_mutex) != 0) {
-         fprintf(stderr, "error while waiting on condition\n");
-         break;
+      if (oldest) {
+         vrend_fence_is_signalled(oldest, 1000000);
+         continue;
       }
 
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_wait_list, fences) {
-         if (vrend_state.stop_sync_thread)
-            break;
-         list_del(&fence->fences);
-         pipe_mutex_unlock(vrend_state.fence_mutex);
-         wait_sync(fence);
-         pipe_mutex_lock(vrend_state.fence_mutex);
+      pipe_mutex_lock(vrend_state.fence_mutex);
+      __atomic_store_n(&vrend_state.sync_thread_sleeping, true, __ATOMIC_SEQ_CST);
+      if (!vrend_state.stop_sync_thread &&
+          vrend_fence_queue_is_empty(&vrend_state.fence_submit)) {
+         if (pipe_condvar_wait(vrend_state.fence_cond, vrend_state.fence_mutex) != 0)
+            fprintf(stderr, "error while waiting on condition\n");
       }
+      __atomic_store_n(&vrend_state.sync_thread_sleeping, false, __ATOMIC_SEQ_CST);
+      pipe_mutex_unlock(vrend_state.fence_mutex);
    }
 
    vrend_clicbs->make_current(0, 0);
    vrend_clicbs->destroy_gl_context(vrend_state.sync_context);
-   pipe_mutex_unlock(vrend_state.fence_mutex);
    return 0;
 }
 
@@ -5126,7 +6624,7 @@ static void vrend_renderer_use_threaded_sync(void)
    pipe_condvar_init(vrend_state.fence_cond);
    pipe_mutex_init(vrend_state.fence_mutex);
 
-   vrend_state.sync_thread = pipe_thread_create(thread_sync, NULL);
+   vrend_state.sync_thread = pipe_thread_create(thread_sync, vrend_instance);
    if (!vrend_state.sync_thread) {
       close(vrend_state.eventfd);
       vrend_state.eventfd = -1;
@@ -5162,6 +6660,14 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
    if (!vrend_state.inited) {
       vrend_state.inited = true;
       vrend_object_init_resource_table();
+      list_inithead(&vrend_state.vao_entries);
+      list_inithead(&vrend_state.fbo_entries);
+      vrend_state.state_hash = util_hash_table_create(vrend_state_entry_hash,
+                                                      vrend_state_entry_compare,
+                                                      vrend_hash_table_noop);
+      vrend_state.sampler_cache = util_hash_table_create(vrend_sampler_object_hash,
+                                                         vrend_sampler_object_compare,
+                                                         vrend_hash_table_noop);
       vrend_clicbs = cbs;
    }
 
@@ -5208,6 +6714,8 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
                  gles ? gl_ver : 0);
 
    glGetIntegerv(GL_MAX_DRAW_BUFFERS, (GLint *) &vrend_state.max_draw_buffers);
+   glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &vrend_state.scratch_texture_unit);
+   vrend_state.scratch_texture_unit--;
 
    if (!has_feature(feat_arb_robustness) &&
        !has_feature(feat_gles_khr_robustness)) {
@@ -5223,6 +6731,9 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
    vrend_object_set_destroy_callback(VIRGL_OBJECT_STREAMOUT_TARGET, vrend_destroy_so_target_object);
    vrend_object_set_destroy_callback(VIRGL_OBJECT_SAMPLER_STATE, vrend_destroy_sampler_state_object);
    vrend_object_set_destroy_callback(VIRGL_OBJECT_VERTEX_ELEMENTS, vrend_destroy_vertex_elements_object);
+   vrend_object_set_destroy_callback(VIRGL_OBJECT_BLEND, vrend_destroy_interned_state_object);
+   vrend_object_set_destroy_callback(VIRGL_OBJECT_DSA, vrend_destroy_interned_state_object);
+   vrend_object_set_destroy_callback(VIRGL_OBJECT_RASTERIZER, vrend_destroy_interned_state_object);
 
    /* disable for format testing, spews a lot of errors */
    if (has_feature(feat_debug_cb)) {
@@ -5237,7 +6748,23 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
       vrend_build_format_list_gl();
    }
 
-   vrend_check_texture_storage(tex_conv_table);
+   vrend_check_texture_storage(vrend_state.tex_conv_table);
+
+   vrend_buffer_suballoc_init();
+   vrend_const_ubo_init();
+   list_inithead(&vrend_state.resource_pool);
+   vrend_state.resource_pool_size = 0;
+   list_inithead(&vrend_state.resource_lru);
+   vrend_state.mem_used = 0;
+   vrend_state.use_lazy_alloc = !getenv("VREND_DISABLE_LAZY_ALLOC");
+   /* transform feedback has to be paused for another context to draw */
+   vrend_state.use_virtual_ctx = getenv("VREND_VIRTUAL_CONTEXTS") &&
+                                 (!has_feature(feat_transform_feedback) ||
+                                  has_feature(feat_transform_feedback2));
+   /* the query buffer only gets the last part of a suspended query */
+   vrend_state.use_qbo = has_feature(feat_qbo) && !getenv("VREND_DISABLE_QBO") &&
+                         !vrend_state.use_virtual_ctx;
+   vrend_state.print_shadow_stats = !!getenv("VREND_PRINT_SHADOW_STATS");
 
    /* disable for format testing */
    if (has_feature(feat_debug_cb)) {
@@ -5245,8 +6772,11 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
    }
 
    vrend_clicbs->destroy_gl_context(gl_context);
-   list_inithead(&vrend_state.fence_list);
-   list_inithead(&vrend_state.fence_wait_list);
+   list_inithead(&vrend_state.fence_timelines);
+   list_inithead(&vrend_state.fence_active);
+   vrend_fence_queue_init(&vrend_state.fence_submit);
+   vrend_fence_queue_init(&vrend_state.fence_done);
+   vrend_state.use_ctx_fences = (flags & VREND_USE_CTX_FENCES) && cbs->write_context_fence;
    list_inithead(&vrend_state.waiting_query_list);
    list_inithead(&vrend_state.active_ctx_list);
    /* create 0 context */
@@ -5255,30 +6785,76 @@ int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags)
    vrend_state.eventfd = -1;
    if (flags & VREND_USE_THREAD_SYNC) {
       vrend_renderer_use_threaded_sync();
+      vrend_renderer_use_upload_thread();
    }
 
    return 0;
 }
 
+int vrend_renderer_create_instance(void)
+{
+   struct vrend_renderer_instance *instance;
+
+   if (vrend_instance != &vrend_null_instance.base)
+      return 0;
+
+   instance = CALLOC_STRUCT(vrend_renderer_instance);
+   if (!instance)
+      return ENOMEM;
+   vrend_instance = &instance->base;
+   return 0;
+}
+
+void vrend_renderer_destroy_instance(void)
+{
+   if (vrend_instance == &vrend_null_instance.base)
+      return;
+
+   FREE(vrend_instance);
+   vrend_instance = (struct vrend_instance *)&vrend_null_instance.base;
+}
+
 void
 vrend_renderer_fini(void)
 {
    if (!vrend_state.inited)
       return;
 
+   vrend_free_upload_thread();
    vrend_free_sync_thread();
    if (vrend_state.eventfd != -1) {
       close(vrend_state.eventfd);
       vrend_state.eventfd = -1;
    }
+   vrend_reset_fences();
 
    vrend_blitter_fini();
    vrend_decode_reset(false);
    vrend_object_fini_resource_table();
+   vrend_buffer_suballoc_fini();
+   vrend_resource_pool_fini();
    vrend_decode_reset(true);
 
+   if (vrend_state.virtual_gl_context) {
+      vrend_clicbs->make_current(0, NULL);
+      vrend_clicbs->destroy_gl_context(vrend_state.virtual_gl_context);
+      vrend_state.virtual_gl_context = NULL;
+      vrend_state.virtual_ctx_current = false;
+      memset(&vrend_state.virtual_gl_shadow, 0, sizeof(vrend_state.virtual_gl_shadow));
+      memset(&vrend_state.virtual_hw, 0, sizeof(vrend_state.virtual_hw));
+   }
+
+   util_hash_table_destroy(vrend_state.state_hash);
+   vrend_state.state_hash = NULL;
+   util_hash_table_destroy(vrend_state.sampler_cache);
+   vrend_state.sampler_cache = NULL;
+
+   if (vrend_state.print_shadow_stats)
+      vrend_print_shadow_stats();
+
    vrend_state.current_ctx = NULL;
    vrend_state.current_hw_ctx = NULL;
+   vrend_state.gl_shadow = NULL;
    vrend_state.inited = false;
 }
 
@@ -5286,25 +6862,32 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
 {
    int i, j;
    struct vrend_streamout_object *obj, *tmp;
+   struct vrend_fbo_entry *fbo, *ftmp;
 
-   if (sub->fb_id)
-      glDeleteFramebuffers(1, &sub->fb_id);
+   if (vrend_state.virtual_sub == sub) {
+      vrend_virtual_ctx_suspend(sub);
+      vrend_state.virtual_sub = NULL;
+   }
 
-   if (sub->blit_fb_ids[0])
-      glDeleteFramebuffers(2, sub->blit_fb_ids);
+   LIST_FOR_EACH_ENTRY_SAFE(fbo, ftmp, &sub->fbo_cache, head)
+      vrend_fbo_entry_destroy(sub, fbo);
 
-   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+   vrend_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
    if (!has_feature(feat_gles31_vertex_attrib_binding)) {
-      while (sub->enabled_attribs_bitmask) {
-         i = u_bit_scan(&sub->enabled_attribs_bitmask);
+      struct vrend_vao_entry *entry, *etmp;
 
-         glDisableVertexAttribArray(i);
-      }
+      glBindVertexArray(0);
+      LIST_FOR_EACH_ENTRY_SAFE(entry, etmp, &sub->vao_cache, head)
+         vrend_vao_entry_destroy(sub, entry);
       glDeleteVertexArrays(1, &sub->vaoid);
    }
 
    glBindVertexArray(0);
+   if (sub->blit_vaoid) {
+      glDeleteVertexArrays(1, &sub->blit_vaoid);
+      glDeleteFramebuffers(1, &sub->blit_fb_id);
+   }
 
    if (sub->current_so)
       glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
@@ -5313,6 +6896,10 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
       vrend_destroy_streamout_object(obj);
    }
 
+   vrend_interned_state_reference((void **)&sub->blend, NULL);
+   vrend_interned_state_reference((void **)&sub->dsa, NULL);
+   vrend_interned_state_reference((void **)&sub->rs, NULL);
+
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_VERTEX], NULL);
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_FRAGMENT], NULL);
    vrend_shader_state_reference(&sub->shaders[PIPE_SHADER_GEOMETRY], NULL);
@@ -5340,9 +6927,13 @@ static void vrend_destroy_sub_context(struct vrend_sub_context *sub)
    }
 
    vrend_resource_reference((struct vrend_resource **)&sub->ib.buffer, NULL);
+   vrend_const_ring_destroy(&sub->const_ring);
 
    vrend_object_fini_ctx_table(sub->object_hash);
-   vrend_clicbs->destroy_gl_context(sub->gl_context);
+   if (sub->gl_context)
+      vrend_clicbs->destroy_gl_context(sub->gl_context);
+   if (vrend_state.gl_shadow == &sub->gl_shadow)
+      vrend_state.gl_shadow = NULL;
 
    list_del(&sub->head);
    FREE(sub);
@@ -5359,6 +6950,10 @@ bool vrend_destroy_context(struct vrend_context *ctx)
       vrend_state.current_hw_ctx = NULL;
    }
 
+   /* the state below is dropped from the host context */
+   if (vrend_state.use_virtual_ctx)
+      vrend_make_current(ctx->sub);
+
    if (vrend_state.use_core_profile) {
       if (ctx->pstip_inited)
          glDeleteTextures(1, &ctx->pstipple_tex_id);
@@ -5417,6 +7012,8 @@ struct vrend_context *vrend_create_context(int id, uint32_t nlen, const char *de
    grctx->shader_cfg.use_core_profile = vrend_state.use_core_profile;
    grctx->shader_cfg.use_explicit_locations = vrend_state.use_explicit_locations;
    grctx->shader_cfg.max_draw_buffers = vrend_state.max_draw_buffers;
+   grctx->shader_cfg.max_const_ubo_size = vrend_state.max_const_ubo_size;
+   grctx->shader_cfg.max_uniform_blocks = vrend_state.max_uniform_blocks;
    vrend_renderer_create_sub_ctx(grctx, 0);
    vrend_renderer_set_sub_ctx(grctx, 0);
 
@@ -5453,6 +7050,14 @@ void vrend_renderer_resource_detach_iov(int res_handle,
    if (!res) {
       return;
    }
+
+   /* without a backing the storage can't be recreated anymore, a deferred
+    * resource that was never written has nothing to keep */
+   if (!(res->deferred && !res->iov_level_mask) &&
+       vrend_resource_make_resident(res))
+      res->iov_level_mask = 0;
+   vrend_resource_pin(res);
+
    if (iov_p)
       *iov_p = res->iov;
    if (num_iovs_p)
@@ -5554,45 +7159,366 @@ static int check_resource_valid(struct vrend_renderer_resource_create_args *args
    return 0;
 }
 
-static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width)
+static struct vrend_buffer_slab *vrend_buffer_slab_create(uint32_t order)
 {
-   glGenBuffersARB(1, &gr->id);
-   glBindBufferARB(gr->target, gr->id);
-   glBufferData(gr->target, width, NULL, GL_STREAM_DRAW);
-   gr->is_buffer = true;
-}
+   struct vrend_buffer_slab *slab;
+   uint32_t num_chunks = VREND_BUFFER_SLAB_SIZE >> order;
 
-static inline void
-vrend_renderer_resource_copy_args(struct vrend_renderer_resource_create_args *args,
-                                  struct vrend_resource *gr)
-{
-   assert(gr);
-   assert(args);
+   slab = CALLOC_STRUCT(vrend_buffer_slab);
+   if (!slab)
+      return NULL;
 
-   gr->handle = args->handle;
-   gr->base.width0 = args->width;
-   gr->base.height0 = args->height;
-   gr->base.depth0 = args->depth;
-   gr->base.format = args->format;
-   gr->base.target = args->target;
-   gr->base.last_level = args->last_level;
-   gr->base.nr_samples = args->nr_samples;
-   gr->base.array_size = args->array_size;
+   slab->order = order;
+   slab->num_free = num_chunks;
+   memset(slab->free_mask, 0xff, num_chunks / 8);
+   if (num_chunks % 32)
+      slab->free_mask[num_chunks / 32] = (1u << (num_chunks % 32)) - 1;
+
+   glGenBuffersARB(1, &slab->id);
+   vrend_bind_buffer(GL_COPY_WRITE_BUFFER, slab->id);
+   glBufferData(GL_COPY_WRITE_BUFFER, VREND_BUFFER_SLAB_SIZE, NULL, GL_STREAM_DRAW);
+   return slab;
 }
 
-static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
-                                                    void *image_oes)
+/* GL storage that is handed to a new resource may still hold the data of
+ * another guest context */
+static void vrend_buffer_clear(GLuint id, uint32_t offset, uint32_t size)
 {
-   uint level;
-   GLenum internalformat, glformat, gltype;
-   struct vrend_texture *gt = (struct vrend_texture *)gr;
-   struct pipe_resource *pr = &gr->base;
-   assert(pr->width0 > 0);
+   void *zero;
 
-   bool format_can_texture_storage = has_feature(feat_texture_storage) &&
-                              (tex_conv_table[pr->format].bindings & VIRGL_BIND_CAN_TEXTURE_STORAGE);
+   vrend_bind_buffer(GL_COPY_WRITE_BUFFER, id);
+   if (has_feature(feat_clear_buffer)) {
+      glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R8, offset, size, GL_RED,
+                           GL_UNSIGNED_BYTE, NULL);
+      return;
+   }
 
-   gr->target = tgsitargettogltarget(pr->target, pr->nr_samples);
+   zero = calloc(1, size);
+   if (!zero) {
+      fprintf(stderr, "failed to clear buffer storage\n");
+      return;
+   }
+   glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, zero);
+   free(zero);
+}
+
+static bool vrend_buffer_suballoc(struct vrend_resource *gr, uint32_t width)
+{
+   struct list_head *slabs;
+   struct vrend_buffer_slab *slab = NULL;
+   uint32_t order, i, bit;
+
+   if (!vrend_state.use_buffer_suballoc || !width ||
+       width > (1u << VREND_SUBALLOC_MAX_ORDER))
+      return false;
+
+   order = MAX2(util_logbase2(util_next_power_of_two(width)),
+                vrend_state.suballoc_min_order);
+   slabs = &vrend_state.buffer_slabs[order - VREND_SUBALLOC_MIN_ORDER];
+
+   /* slabs with free chunks are kept at the head of the list */
+   if (!LIST_IS_EMPTY(slabs)) {
+      slab = LIST_ENTRY(struct vrend_buffer_slab, slabs->next, head);
+      if (!slab->num_free)
+         slab = NULL;
+   }
+
+   if (!slab) {
+      slab = vrend_buffer_slab_create(order);
+      if (!slab)
+         return false;
+      list_add(&slab->head, slabs);
+   }
+
+   for (i = 0; !slab->free_mask[i]; i++)
+      ;
+   bit = ffs(slab->free_mask[i]) - 1;
+   slab->free_mask[i] &= ~(1u << bit);
+   if (--slab->num_free == 0) {
+      list_del(&slab->head);
+      list_addtail(&slab->head, slabs);
+   }
+
+   gr->slab = slab;
+   gr->id = slab->id;
+   gr->buffer_offset = (i * 32 + bit) << order;
+   gr->is_buffer = true;
+   vrend_buffer_clear(gr->id, gr->buffer_offset, 1u << order);
+   return true;
+}
+
+static void vrend_buffer_subfree(struct vrend_resource *res)
+{
+   struct vrend_buffer_slab *slab = res->slab;
+   struct list_head *slabs = &vrend_state.buffer_slabs[slab->order - VREND_SUBALLOC_MIN_ORDER];
+   uint32_t idx = res->buffer_offset >> slab->order;
+
+   slab->free_mask[idx / 32] |= 1u << (idx % 32);
+   slab->num_free++;
+   list_del(&slab->head);
+
+   /* keep one empty slab around per size to avoid create/destroy churn */
+   if (slab->num_free == (VREND_BUFFER_SLAB_SIZE >> slab->order) &&
+       !LIST_IS_EMPTY(slabs)) {
+      vrend_vao_cache_invalidate(NULL, NULL, slab->id);
+      vrend_delete_buffers(1, &slab->id);
+      FREE(slab);
+   } else {
+      list_add(&slab->head, slabs);
+   }
+
+   res->slab = NULL;
+   res->id = 0;
+}
+
+static void vrend_buffer_suballoc_init(void)
+{
+   GLint align = 0;
+   int i;
+
+   for (i = 0; i < VREND_SUBALLOC_NUM_ORDERS; i++)
+      list_inithead(&vrend_state.buffer_slabs[i]);
+
+   /* texture buffers have to be able to address the sub range */
+   vrend_state.use_buffer_suballoc = !has_feature(feat_arb_or_gles_ext_texture_buffer) ||
+                                     has_feature(feat_texture_buffer_range);
+   if (getenv("VREND_DISABLE_BUFFER_SUBALLOC"))
+      vrend_state.use_buffer_suballoc = false;
+
+   /* chunks must satisfy the offset alignment of uniform and storage buffers */
+   vrend_state.suballoc_min_order = VREND_SUBALLOC_MIN_ORDER;
+   if (has_feature(feat_ubo)) {
+      glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+      if (align > 0)
+         vrend_state.suballoc_min_order = MAX2(vrend_state.suballoc_min_order,
+                                               util_logbase2(util_next_power_of_two(align)));
+   }
+   if (has_feature(feat_ssbo)) {
+      glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &align);
+      if (align > 0)
+         vrend_state.suballoc_min_order = MAX2(vrend_state.suballoc_min_order,
+                                               util_logbase2(util_next_power_of_two(align)));
+   }
+   if (vrend_state.suballoc_min_order > VREND_SUBALLOC_MAX_ORDER)
+      vrend_state.use_buffer_suballoc = false;
+}
+
+static void vrend_const_ubo_init(void)
+{
+   GLint val = 0;
+
+   vrend_state.max_const_ubo_size = 0;
+   if (!has_feature(feat_ubo))
+      return;
+
+   glGetIntegerv(GL_MAX_VERTEX_UNIFORM_BLOCKS, &val);
+   vrend_state.max_uniform_blocks = val;
+
+   if (!has_feature(feat_arb_buffer_storage) || getenv("VREND_DISABLE_CONST_UBO"))
+      return;
+
+   glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &val);
+   vrend_state.ubo_offset_align = MAX2(val, 1);
+   glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &val);
+   vrend_state.max_const_ubo_size = MIN2((uint32_t)val, VREND_CONST_RING_SEGMENT_SIZE);
+}
+
+static void vrend_buffer_suballoc_fini(void)
+{
+   struct vrend_buffer_slab *slab, *tmp;
+   int i;
+
+   for (i = 0; i < VREND_SUBALLOC_NUM_ORDERS; i++) {
+      LIST_FOR_EACH_ENTRY_SAFE(slab, tmp, &vrend_state.buffer_slabs[i], head) {
+         vrend_delete_buffers(1, &slab->id);
+         list_del(&slab->head);
+         FREE(slab);
+      }
+   }
+}
+
+static uint64_t vrend_resource_estimate_size(const struct pipe_resource *pr)
+{
+   uint64_t size = 0;
+   uint level;
+
+   if (pr->target == PIPE_BUFFER)
+      return pr->width0;
+
+   for (level = 0; level <= pr->last_level; level++)
+      size += (uint64_t)util_format_get_nblocks(pr->format, u_minify(pr->width0, level),
+                                               u_minify(pr->height0, level)) *
+              u_minify(pr->depth0, level);
+
+   return size * util_format_get_blocksize(pr->format) *
+          MAX2(pr->array_size, 1) * MAX2(pr->nr_samples, 1);
+}
+
+static bool vrend_resource_pool_match(const struct vrend_pooled_object *obj,
+                                      const struct vrend_resource *res)
+{
+   const struct pipe_resource *a = &obj->templ, *b = &res->base;
+
+   return obj->target == res->target &&
+          a->target == b->target &&
+          a->format == b->format &&
+          a->width0 == b->width0 &&
+          a->height0 == b->height0 &&
+          a->depth0 == b->depth0 &&
+          a->array_size == b->array_size &&
+          a->last_level == b->last_level &&
+          a->nr_samples == b->nr_samples &&
+          a->bind == b->bind;
+}
+
+static void vrend_resource_pool_free(struct vrend_pooled_object *obj)
+{
+   if (obj->templ.target == PIPE_BUFFER) {
+      vrend_vao_cache_invalidate(NULL, NULL, obj->id);
+      vrend_delete_buffers(1, &obj->id);
+   } else {
+      vrend_fbo_cache_invalidate(obj->id);
+      glDeleteTextures(1, &obj->id);
+   }
+
+   vrend_state.resource_pool_size -= obj->size;
+   list_del(&obj->head);
+   FREE(obj);
+}
+
+/* pooled storage is shared by all contexts, so it is zeroed before reuse */
+static void vrend_resource_pool_clear(struct vrend_pooled_object *obj)
+{
+   const struct vrend_format_table *tex_conv;
+   uint level;
+
+   if (obj->templ.target == PIPE_BUFFER) {
+      vrend_buffer_clear(obj->id, 0, obj->templ.width0);
+      return;
+   }
+
+   tex_conv = &vrend_state.tex_conv_table[obj->templ.format];
+   for (level = 0; level <= obj->templ.last_level; level++)
+      glClearTexImage(obj->id, level, tex_conv->glformat, tex_conv->gltype, NULL);
+}
+
+/* hand out a pooled GL object with the same storage layout as res */
+static bool vrend_resource_pool_take(struct vrend_resource *res)
+{
+   struct vrend_pooled_object *obj;
+
+   LIST_FOR_EACH_ENTRY(obj, &vrend_state.resource_pool, head) {
+      if (vrend_resource_pool_match(obj, res)) {
+         vrend_resource_pool_clear(obj);
+         res->id = obj->id;
+         vrend_state.resource_pool_size -= obj->size;
+         list_del(&obj->head);
+         FREE(obj);
+         return true;
+      }
+   }
+   return false;
+}
+
+static bool vrend_resource_pool_put(struct vrend_resource *res)
+{
+   struct vrend_pooled_object *obj;
+   uint64_t size = vrend_resource_estimate_size(&res->base);
+
+   if (res->egl_image || size > VREND_POOL_MAX_SIZE / 4)
+      return false;
+
+   /* textures can only be recycled if they can be cleared on reuse */
+   if (res->base.target != PIPE_BUFFER &&
+       (!has_feature(feat_clear_texture) ||
+        util_format_is_compressed(res->base.format)))
+      return false;
+
+   obj = CALLOC_STRUCT(vrend_pooled_object);
+   if (!obj)
+      return false;
+
+   vrend_resource_pool_trim(VREND_POOL_MAX_SIZE - size);
+
+   obj->id = res->id;
+   obj->target = res->target;
+   obj->templ = res->base;
+   obj->size = size;
+   obj->epoch = vrend_state.resource_pool_epoch;
+   list_add(&obj->head, &vrend_state.resource_pool);
+   vrend_state.resource_pool_size += size;
+   return true;
+}
+
+/* drop the oldest entries until the pool fits max_size, and anything that
+ * has not been reused for VREND_POOL_MAX_AGE fences */
+static void vrend_resource_pool_trim(uint64_t max_size)
+{
+   struct vrend_pooled_object *obj, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE_REV(obj, tmp, &vrend_state.resource_pool, head) {
+      if (vrend_state.resource_pool_size <= max_size &&
+          vrend_state.resource_pool_epoch - obj->epoch < VREND_POOL_MAX_AGE)
+         break;
+      vrend_resource_pool_free(obj);
+   }
+}
+
+static void vrend_resource_pool_fini(void)
+{
+   struct vrend_pooled_object *obj, *tmp;
+
+   LIST_FOR_EACH_ENTRY_SAFE(obj, tmp, &vrend_state.resource_pool, head)
+      vrend_resource_pool_free(obj);
+}
+
+static void vrend_create_buffer(struct vrend_resource *gr, uint32_t width, bool suballoc)
+{
+   if (suballoc && vrend_buffer_suballoc(gr, width))
+      return;
+
+   gr->is_buffer = true;
+   if (vrend_resource_pool_take(gr))
+      return;
+
+   /* GL_ELEMENT_ARRAY_BUFFER is VAO state, so don't go through gr->target */
+   glGenBuffersARB(1, &gr->id);
+   vrend_bind_buffer(GL_COPY_WRITE_BUFFER, gr->id);
+   glBufferData(GL_COPY_WRITE_BUFFER, width, NULL, GL_STREAM_DRAW);
+}
+
+static inline void
+vrend_renderer_resource_copy_args(struct vrend_renderer_resource_create_args *args,
+                                  struct vrend_resource *gr)
+{
+   assert(gr);
+   assert(args);
+
+   gr->handle = args->handle;
+   gr->base.width0 = args->width;
+   gr->base.height0 = args->height;
+   gr->base.depth0 = args->depth;
+   gr->base.format = args->format;
+   gr->base.target = args->target;
+   gr->base.last_level = args->last_level;
+   gr->base.nr_samples = args->nr_samples;
+   gr->base.array_size = args->array_size;
+   gr->base.bind = args->bind;
+}
+
+static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
+                                                    void *image_oes)
+{
+   uint level;
+   GLenum internalformat, glformat, gltype;
+   struct vrend_texture *gt = (struct vrend_texture *)gr;
+   struct pipe_resource *pr = &gr->base;
+   assert(pr->width0 > 0);
+
+   bool format_can_texture_storage = has_feature(feat_texture_storage) &&
+                              (vrend_state.tex_conv_table[pr->format].bindings & VIRGL_BIND_CAN_TEXTURE_STORAGE);
+
+   gr->target = tgsitargettogltarget(pr->target, pr->nr_samples);
 
    /* ugly workaround for texture rectangle missing on GLES */
    if (vrend_state.use_gles && gr->target == GL_TEXTURE_RECTANGLE_NV) {
@@ -5613,26 +7539,40 @@ static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
       gr->target = GL_TEXTURE_2D_ARRAY;
    }
 
+   if (!image_oes && vrend_resource_pool_take(gr)) {
+      glBindTexture(gr->target, gr->id);
+      /* sampler views may have changed the level range of the texture */
+      if (pr->nr_samples <= 1) {
+         glTexParameteri(gr->target, GL_TEXTURE_BASE_LEVEL, 0);
+         glTexParameteri(gr->target, GL_TEXTURE_MAX_LEVEL, pr->last_level);
+      }
+      gt->state.max_lod = -1;
+      return 0;
+   }
+
    glGenTextures(1, &gr->id);
    glBindTexture(gr->target, gr->id);
 
-   internalformat = tex_conv_table[pr->format].internalformat;
-   glformat = tex_conv_table[pr->format].glformat;
-   gltype = tex_conv_table[pr->format].gltype;
+   internalformat = vrend_state.tex_conv_table[pr->format].internalformat;
+   glformat = vrend_state.tex_conv_table[pr->format].glformat;
+   gltype = vrend_state.tex_conv_table[pr->format].gltype;
 
    if (internalformat == 0) {
       fprintf(stderr,"unknown format is %d\n", pr->format);
-      FREE(gt);
+      glDeleteTextures(1, &gr->id);
+      gr->id = 0;
       return EINVAL;
    }
 
    if (image_oes) {
       if (epoxy_has_gl_extension("GL_OES_EGL_image_external")) {
          glEGLImageTargetTexture2DOES(gr->target, (GLeglImageOES) image_oes);
+         gr->egl_image = true;
       } else {
          fprintf(stderr, "missing GL_OES_EGL_image_external extension\n");
-	 FREE(gr);
-	 return EINVAL;
+         glDeleteTextures(1, &gr->id);
+         gr->id = 0;
+         return EINVAL;
       }
    } else if (pr->nr_samples > 1) {
       if (vrend_state.use_gles || has_feature(feat_texture_storage)) {
@@ -5725,6 +7665,50 @@ static int vrend_renderer_resource_allocate_texture(struct vrend_resource *gr,
    return 0;
 }
 
+static int vrend_resource_alloc_storage(struct vrend_resource *gr, void *image_oes)
+{
+   struct pipe_resource *pr = &gr->base;
+
+   if (pr->bind == VIRGL_BIND_INDEX_BUFFER) {
+      gr->target = GL_ELEMENT_ARRAY_BUFFER_ARB;
+      vrend_create_buffer(gr, pr->width0, true);
+   } else if (pr->bind == VIRGL_BIND_STREAM_OUTPUT) {
+      gr->target = GL_TRANSFORM_FEEDBACK_BUFFER;
+      vrend_create_buffer(gr, pr->width0, false);
+   } else if (pr->bind == VIRGL_BIND_VERTEX_BUFFER) {
+      gr->target = GL_ARRAY_BUFFER_ARB;
+      vrend_create_buffer(gr, pr->width0, true);
+   } else if (pr->bind == VIRGL_BIND_CONSTANT_BUFFER) {
+      gr->target = GL_UNIFORM_BUFFER;
+      vrend_create_buffer(gr, pr->width0, true);
+   } else if (pr->target == PIPE_BUFFER && (pr->bind == 0 || pr->bind == VIRGL_BIND_SHADER_BUFFER)) {
+      gr->target = GL_ARRAY_BUFFER_ARB;
+      vrend_create_buffer(gr, pr->width0, pr->bind == VIRGL_BIND_SHADER_BUFFER);
+   } else if (pr->target == PIPE_BUFFER && (pr->bind & VIRGL_BIND_SAMPLER_VIEW)) {
+      /*
+       * On Desktop we use GL_ARB_texture_buffer_object on GLES we use
+       * GL_EXT_texture_buffer (it is in the ANDRIOD extension pack).
+       */
+#if GL_TEXTURE_BUFFER != GL_TEXTURE_BUFFER_EXT
+#error "GL_TEXTURE_BUFFER enums differ, they shouldn't."
+#endif
+
+      /* need to check GL version here */
+      if (has_feature(feat_arb_or_gles_ext_texture_buffer)) {
+         gr->target = GL_TEXTURE_BUFFER;
+      } else {
+         gr->target = GL_PIXEL_PACK_BUFFER_ARB;
+      }
+      vrend_create_buffer(gr, pr->width0, false);
+   } else {
+      int r = vrend_renderer_resource_allocate_texture(gr, image_oes);
+      if (r)
+         return r;
+   }
+
+   return 0;
+}
+
 int vrend_renderer_resource_create(struct vrend_renderer_resource_create_args *args, struct iovec *iov, uint32_t num_iovs, void *image_oes)
 {
    struct vrend_resource *gr;
@@ -5754,41 +7738,16 @@ int vrend_renderer_resource_create(struct vrend_renderer_resource_create_args *a
          FREE(gr);
          return ENOMEM;
       }
-   } else if (args->bind == VIRGL_BIND_INDEX_BUFFER) {
-      gr->target = GL_ELEMENT_ARRAY_BUFFER_ARB;
-      vrend_create_buffer(gr, args->width);
-   } else if (args->bind == VIRGL_BIND_STREAM_OUTPUT) {
-      gr->target = GL_TRANSFORM_FEEDBACK_BUFFER;
-      vrend_create_buffer(gr, args->width);
-   } else if (args->bind == VIRGL_BIND_VERTEX_BUFFER) {
-      gr->target = GL_ARRAY_BUFFER_ARB;
-      vrend_create_buffer(gr, args->width);
-   } else if (args->bind == VIRGL_BIND_CONSTANT_BUFFER) {
-      gr->target = GL_UNIFORM_BUFFER;
-      vrend_create_buffer(gr, args->width);
-   } else if (args->target == PIPE_BUFFER && (args->bind == 0 || args->bind == VIRGL_BIND_SHADER_BUFFER)) {
-      gr->target = GL_ARRAY_BUFFER_ARB;
-      vrend_create_buffer(gr, args->width);
-   } else if (args->target == PIPE_BUFFER && (args->bind & VIRGL_BIND_SAMPLER_VIEW)) {
-      /*
-       * On Desktop we use GL_ARB_texture_buffer_object on GLES we use
-       * GL_EXT_texture_buffer (it is in the ANDRIOD extension pack).
-       */
-#if GL_TEXTURE_BUFFER != GL_TEXTURE_BUFFER_EXT
-#error "GL_TEXTURE_BUFFER enums differ, they shouldn't."
-#endif
-
-      /* need to check GL version here */
-      if (has_feature(feat_arb_or_gles_ext_texture_buffer)) {
-         gr->target = GL_TEXTURE_BUFFER;
-      } else {
-         gr->target = GL_PIXEL_PACK_BUFFER_ARB;
-      }
-      vrend_create_buffer(gr, args->width);
+   } else if (vrend_state.use_lazy_alloc && !image_oes && !gr->y_0_top &&
+              vrend_state.tex_conv_table[args->format].internalformat) {
+      /* storage is allocated by vrend_resource_make_resident on first use */
+      gr->deferred = true;
    } else {
-      int r = vrend_renderer_resource_allocate_texture(gr, image_oes);
-      if (r)
-         return r;
+      ret = vrend_resource_alloc_storage(gr, image_oes);
+      if (ret) {
+         FREE(gr);
+         return ret;
+      }
    }
 
    ret = vrend_resource_insert(gr, args->handle);
@@ -5796,23 +7755,51 @@ int vrend_renderer_resource_create(struct vrend_renderer_resource_create_args *a
       vrend_renderer_resource_destroy(gr, true);
       return ENOMEM;
    }
+
+   if (gr->deferred) {
+      /* accounted as if it was allocated, like before */
+      gr->gl_size = vrend_resource_estimate_size(&gr->base);
+      vrend_state.mem_used += gr->gl_size;
+      list_inithead(&gr->lru);
+   } else if (gr->id) {
+      vrend_resource_enforce_budget();
+      gr->gl_size = vrend_resource_estimate_size(&gr->base);
+      vrend_state.mem_used += gr->gl_size;
+      list_add(&gr->lru, &vrend_state.resource_lru);
+      if (image_oes || gr->y_0_top)
+         vrend_resource_pin(gr);
+      if (image_oes)
+         gr->exported = true;
+   }
    return 0;
 }
 
 void vrend_renderer_resource_destroy(struct vrend_resource *res, bool remove)
 {
-   if (res->readback_fb_id)
-      glDeleteFramebuffers(1, &res->readback_fb_id);
+   if (res->gl_size) {
+      list_del(&res->lru);
+      if (!res->evicted)
+         vrend_state.mem_used -= res->gl_size;
+   }
 
    if (res->ptr)
       free(res->ptr);
+   free(res->shadow);
+   free(res->iov_written);
    if (res->id) {
       if (res->is_buffer) {
-         glDeleteBuffers(1, &res->id);
+         if (res->slab)
+            vrend_buffer_subfree(res);
+         else if (!vrend_resource_pool_put(res)) {
+            vrend_vao_cache_invalidate(NULL, NULL, res->id);
+            vrend_delete_buffers(1, &res->id);
+         }
          if (res->tbo_tex_id)
             glDeleteTextures(1, &res->tbo_tex_id);
-      } else
+      } else if (!vrend_resource_pool_put(res)) {
+         vrend_fbo_cache_invalidate(res->id);
          glDeleteTextures(1, &res->id);
+      }
    }
 
    if (res->handle && remove)
@@ -5851,12 +7838,13 @@ static int use_sub_data = 0;
 struct virgl_sub_upload_data {
    GLenum target;
    struct pipe_box *box;
+   uint32_t offset;
 };
 
 static void iov_buffer_upload(void *cookie, uint32_t doff, void *src, int len)
 {
    struct virgl_sub_upload_data *d = cookie;
-   glBufferSubData(d->target, d->box->x + doff, len, src);
+   glBufferSubData(d->target, d->offset + d->box->x + doff, len, src);
 }
 
 static void vrend_scale_depth(void *ptr, int size, float scale_val)
@@ -6073,9 +8061,12 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       struct virgl_sub_upload_data d;
       d.box = info->box;
       d.target = res->target;
+      d.offset = res->buffer_offset;
 
-      glBindBufferARB(res->target, res->id);
-      if (use_sub_data == 1) {
+      vrend_bind_buffer(res->target, res->id);
+      /* a recycled chunk may still be read by the GPU, so don't map it
+       * unsynchronized */
+      if (use_sub_data == 1 || res->slab) {
          vrend_read_from_iovec_cb(iov, num_iovs, info->offset, info->box->width, &iov_buffer_upload, &d);
       } else {
          data = glMapBufferRange(res->target, info->box->x, info->box->width, GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_WRITE_BIT);
@@ -6087,6 +8078,8 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
             glUnmapBuffer(res->target);
          }
       }
+      if (res->shadow)
+         vrend_read_from_iovec(iov, num_iovs, info->offset, res->shadow + info->box->x, info->box->width);
    } else {
       GLenum glformat;
       GLenum gltype;
@@ -6128,53 +8121,41 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       }
 
       if (stride && !need_temp) {
-         glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / elsize);
-         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, u_minify(res->base.height0, info->level));
+         vrend_pixel_store(GL_UNPACK_ROW_LENGTH, stride / elsize);
+         vrend_pixel_store(GL_UNPACK_IMAGE_HEIGHT, u_minify(res->base.height0, info->level));
       } else
-         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+         vrend_pixel_store(GL_UNPACK_ROW_LENGTH, 0);
 
       switch (elsize) {
       case 1:
       case 3:
-         glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+         vrend_pixel_store(GL_UNPACK_ALIGNMENT, 1);
          break;
       case 2:
       case 6:
-         glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+         vrend_pixel_store(GL_UNPACK_ALIGNMENT, 2);
          break;
       case 4:
       default:
-         glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+         vrend_pixel_store(GL_UNPACK_ALIGNMENT, 4);
          break;
       case 8:
-         glPixelStorei(GL_UNPACK_ALIGNMENT, 8);
+         vrend_pixel_store(GL_UNPACK_ALIGNMENT, 8);
          break;
       }
 
-      glformat = tex_conv_table[res->base.format].glformat;
-      gltype = tex_conv_table[res->base.format].gltype;
+      glformat = vrend_state.tex_conv_table[res->base.format].glformat;
+      gltype = vrend_state.tex_conv_table[res->base.format].gltype;
 
       if ((!vrend_state.use_core_profile) && (res->y_0_top)) {
-         GLuint buffers;
-
-         if (res->readback_fb_id == 0 || (int)res->readback_fb_level != info->level) {
-            GLuint fb_id;
-            if (res->readback_fb_id)
-               glDeleteFramebuffers(1, &res->readback_fb_id);
-
-            glGenFramebuffers(1, &fb_id);
-            glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb_id);
-            vrend_fb_bind_texture(res, 0, info->level, 0);
-
-            res->readback_fb_id = fb_id;
-            res->readback_fb_level = info->level;
-         } else {
-            glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, res->readback_fb_id);
-         }
-
-         buffers = GL_COLOR_ATTACHMENT0_EXT;
-         glDrawBuffers(1, &buffers);
-         glDisable(GL_BLEND);
+         /* the cached FBO draws to the resource already */
+         glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                              vrend_fbo_for_resource(ctx, res, info->level, 0));
+
+         vrend_disable(GL_BLEND);
+         /* make the next blend bind and draw emit the state again */
+         vrend_interned_state_reference((void **)&ctx->sub->blend, NULL);
+         ctx->sub->state_epoch++;
          vrend_depth_test_enable(ctx, false);
          vrend_alpha_test_enable(ctx, false);
          vrend_stencil_test_enable(ctx, false);
@@ -6187,7 +8168,7 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
          glBindTexture(res->target, res->id);
 
          if (compressed) {
-            glformat = tex_conv_table[res->base.format].internalformat;
+            glformat = vrend_state.tex_conv_table[res->base.format].internalformat;
             comp_size = util_format_get_nblocks(res->base.format, info->box->width,
                                                 info->box->height) * util_format_get_blocksize(res->base.format);
          }
@@ -6274,11 +8255,11 @@ static int vrend_renderer_transfer_write_iov(struct vrend_context *ctx,
       }
 
       if (stride && !need_temp) {
-         glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-         glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+         vrend_pixel_store(GL_UNPACK_ROW_LENGTH, 0);
+         vrend_pixel_store(GL_UNPACK_IMAGE_HEIGHT, 0);
       }
 
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      vrend_pixel_store(GL_UNPACK_ALIGNMENT, 4);
 
       if (need_temp)
          free(data);
@@ -6310,11 +8291,11 @@ static int vrend_transfer_send_getteximage(struct vrend_context *ctx,
    int compressed = util_format_is_compressed(res->base.format);
    GLenum target;
    uint32_t send_offset = 0;
-   format = tex_conv_table[res->base.format].glformat;
-   type = tex_conv_table[res->base.format].gltype;
+   format = vrend_state.tex_conv_table[res->base.format].glformat;
+   type = vrend_state.tex_conv_table[res->base.format].gltype;
 
    if (compressed)
-      format = tex_conv_table[res->base.format].internalformat;
+      format = vrend_state.tex_conv_table[res->base.format].internalformat;
 
    tex_size = util_format_get_nblocks(res->base.format, u_minify(res->base.width0, info->level), u_minify(res->base.height0, info->level)) *
               util_format_get_blocksize(res->base.format) * vrend_get_texture_depth(res, info->level);
@@ -6329,17 +8310,17 @@ static int vrend_transfer_send_getteximage(struct vrend_context *ctx,
 
    switch (elsize) {
    case 1:
-      glPixelStorei(GL_PACK_ALIGNMENT, 1);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 1);
       break;
    case 2:
-      glPixelStorei(GL_PACK_ALIGNMENT, 2);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 2);
       break;
    case 4:
    default:
-      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
       break;
    case 8:
-      glPixelStorei(GL_PACK_ALIGNMENT, 8);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 8);
       break;
    }
 
@@ -6367,7 +8348,7 @@ static int vrend_transfer_send_getteximage(struct vrend_context *ctx,
       }
    }
 
-   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
 
    write_transfer_data(&res->base, iov, num_iovs, data + send_offset,
                        info->stride, info->box, info->level, info->offset,
@@ -6383,7 +8364,6 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
 {
    char *myptr = (char*)iov[0].iov_base + info->offset;
    int need_temp = 0;
-   GLuint fb_id;
    char *data;
    bool actually_invert, separate_invert = false;
    GLenum format, type;
@@ -6396,8 +8376,8 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
 
    vrend_use_program(ctx, 0);
 
-   format = tex_conv_table[res->base.format].glformat;
-   type = tex_conv_table[res->base.format].gltype;
+   format = vrend_state.tex_conv_table[res->base.format].glformat;
+   type = vrend_state.tex_conv_table[res->base.format].gltype;
    /* if we are asked to invert and reading from a front then don't */
 
    actually_invert = res->y_0_top;
@@ -6422,47 +8402,33 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
          row_stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level));
    }
 
-   if (res->readback_fb_id == 0 || (int)res->readback_fb_level != info->level ||
-       (int)res->readback_fb_z != info->box->z) {
-
-      if (res->readback_fb_id)
-         glDeleteFramebuffers(1, &res->readback_fb_id);
-
-      glGenFramebuffers(1, &fb_id);
-      glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb_id);
-
-      vrend_fb_bind_texture(res, 0, info->level, info->box->z);
-
-      res->readback_fb_id = fb_id;
-      res->readback_fb_level = info->level;
-      res->readback_fb_z = info->box->z;
-   } else
-      glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, res->readback_fb_id);
+   glBindFramebufferEXT(GL_FRAMEBUFFER_EXT,
+                        vrend_fbo_for_resource(ctx, res, info->level, info->box->z));
    if (actually_invert)
       y1 = h - info->box->y - info->box->height;
    else
       y1 = info->box->y;
 
    if (has_feature(feat_mesa_invert) && actually_invert)
-      glPixelStorei(GL_PACK_INVERT_MESA, 1);
+      vrend_pixel_store(GL_PACK_INVERT_MESA, 1);
    if (!vrend_format_is_ds(res->base.format))
       glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
    if (!need_temp && row_stride)
-      glPixelStorei(GL_PACK_ROW_LENGTH, row_stride);
+      vrend_pixel_store(GL_PACK_ROW_LENGTH, row_stride);
 
    switch (elsize) {
    case 1:
-      glPixelStorei(GL_PACK_ALIGNMENT, 1);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 1);
       break;
    case 2:
-      glPixelStorei(GL_PACK_ALIGNMENT, 2);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 2);
       break;
    case 4:
    default:
-      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
       break;
    case 8:
-      glPixelStorei(GL_PACK_ALIGNMENT, 8);
+      vrend_pixel_store(GL_PACK_ALIGNMENT, 8);
       break;
    }
 
@@ -6519,10 +8485,10 @@ static int vrend_transfer_send_readpixels(struct vrend_context *ctx,
          vrend_scale_depth(data, send_size, depth_scale);
    }
    if (has_feature(feat_mesa_invert) && actually_invert)
-      glPixelStorei(GL_PACK_INVERT_MESA, 0);
+      vrend_pixel_store(GL_PACK_INVERT_MESA, 0);
    if (!need_temp && row_stride)
-      glPixelStorei(GL_PACK_ROW_LENGTH, 0);
-   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      vrend_pixel_store(GL_PACK_ROW_LENGTH, 0);
+   vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
    if (need_temp) {
       write_transfer_data(&res->base, iov, num_iovs, data,
                           info->stride, info->box, info->level, info->offset,
@@ -6584,8 +8550,8 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
       uint32_t send_size = info->box->width * util_format_get_blocksize(res->base.format);
       void *data;
 
-      glBindBufferARB(res->target, res->id);
-      data = glMapBufferRange(res->target, info->box->x, info->box->width, GL_MAP_READ_BIT);
+      vrend_bind_buffer(res->target, res->id);
+      data = glMapBufferRange(res->target, res->buffer_offset + info->box->x, info->box->width, GL_MAP_READ_BIT);
       if (!data)
          fprintf(stderr,"unable to open buffer for reading %d\n", res->target);
       else
@@ -6612,30 +8578,645 @@ static int vrend_renderer_transfer_send_iov(struct vrend_context *ctx,
    return 0;
 }
 
-int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
-                                int transfer_mode)
+/*
+ * GL memory accounting and eviction.
+ *
+ * Resident resources that are neither pinned nor deferred sit on
+ * vrend_state.resource_lru, roughly most recently used first: a use only
+ * sets lru_used, and the list is reordered when the budget is enforced.
+ * A resource is pinned once its GL storage may hold data that can't be
+ * recreated from its iov backing, e.g. it was rendered to or written
+ * inline. When over budget, idle unpinned resources get their GL storage
+ * dropped, and the regions uploaded from the iov are replayed the next
+ * time they are bound or accessed.
+ */
+static void vrend_resource_pin(struct vrend_resource *res)
 {
-   struct vrend_resource *res;
-   struct vrend_context *ctx;
-   struct iovec *iov;
-   int num_iovs;
-
-   if (!info->box)
-      return EINVAL;
+   if (res->pinned || !res->gl_size)
+      return;
 
-   ctx = vrend_lookup_renderer_ctx(info->ctx_id);
-   if (!ctx)
-      return EINVAL;
+   res->pinned = true;
+   list_delinit(&res->lru);
+}
 
-   if (info->ctx_id == 0)
-      res = vrend_resource_lookup(info->handle, 0);
-   else
-      res = vrend_renderer_ctx_res_lookup(ctx, info->handle);
+/* grows the region of a level that has to be replayed after eviction */
+static void vrend_resource_track_box(struct vrend_resource *res, uint32_t level,
+                                     const struct pipe_box *box)
+{
+   struct pipe_box *written;
+   int x1, y1, z1;
 
-   if (!res) {
-      if (info->ctx_id)
-         report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, info->handle);
-      return EINVAL;
+   if (!res->iov_written) {
+      res->iov_written = calloc(res->base.last_level + 1, sizeof(struct pipe_box));
+      if (!res->iov_written) {
+         vrend_resource_pin(res);
+         return;
+      }
+   }
+
+   written = &res->iov_written[level];
+   if (!(res->iov_level_mask & (1 << level))) {
+      *written = *box;
+      res->iov_level_mask |= 1 << level;
+      return;
+   }
+
+   x1 = MAX2(written->x + written->width, box->x + box->width);
+   y1 = MAX2(written->y + written->height, box->y + box->height);
+   z1 = MAX2(written->z + written->depth, box->z + box->depth);
+   written->x = MIN2(written->x, box->x);
+   written->y = MIN2(written->y, box->y);
+   written->z = MIN2(written->z, box->z);
+   written->width = x1 - written->x;
+   written->height = y1 - written->y;
+   written->depth = z1 - written->z;
+}
+
+static void vrend_resource_track_upload(struct vrend_resource *res,
+                                        const struct vrend_transfer_info *info)
+{
+   uint32_t stride, level_height;
+
+   if (res->pinned)
+      return;
+
+   if (res->is_buffer) {
+      if (info->offset != (uint64_t)info->box->x)
+         vrend_resource_pin(res);
+      else
+         vrend_resource_track_box(res, 0, info->box);
+      return;
+   }
+
+   /* uploads are replayed with the layout vrend_renderer_transfer_write_iov
+    * assumes when computing mipmap_offsets */
+   stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level)) *
+            util_format_get_blocksize(res->base.format);
+   level_height = u_minify(res->base.height0, info->level);
+   if (info->level >= VR_MAX_TEXTURE_2D_LEVELS ||
+       (info->stride && info->stride != stride) ||
+       (info->layer_stride && info->layer_stride != stride * level_height) ||
+       util_format_is_compressed(res->base.format))
+      vrend_resource_pin(res);
+   else
+      vrend_resource_track_box(res, info->level, info->box);
+}
+
+static bool vrend_resource_can_evict(struct vrend_resource *res)
+{
+   if (!res->iov || res->slab || res->base.nr_samples > 1)
+      return false;
+
+   /* only the table holds a reference, nothing is bound */
+   if (pipe_is_referenced(&res->base.reference) && res->base.reference.count > 1)
+      return false;
+
+   switch (res->base.target) {
+   case PIPE_BUFFER:
+   case PIPE_TEXTURE_1D:
+   case PIPE_TEXTURE_2D:
+   case PIPE_TEXTURE_RECT:
+   case PIPE_TEXTURE_2D_ARRAY:
+   case PIPE_TEXTURE_3D:
+   case PIPE_TEXTURE_CUBE:
+      return true;
+   default:
+      return false;
+   }
+}
+
+static void vrend_resource_evict(struct vrend_resource *res)
+{
+   if (res->is_buffer) {
+      vrend_vao_cache_invalidate(NULL, NULL, res->id);
+      vrend_delete_buffers(1, &res->id);
+      if (res->tbo_tex_id) {
+         glDeleteTextures(1, &res->tbo_tex_id);
+         res->tbo_tex_id = 0;
+      }
+   } else {
+      vrend_fbo_cache_invalidate(res->id);
+      glDeleteTextures(1, &res->id);
+   }
+
+   /* the storage comes back from the backing, which may have moved on */
+   vrend_resource_drop_shadow(res, false);
+   res->id = 0;
+   res->deferred = true;
+   res->evicted = true;
+   vrend_state.mem_used -= res->gl_size;
+   list_delinit(&res->lru);
+}
+
+static void vrend_resource_enforce_budget(void)
+{
+   struct vrend_resource *res, *tmp;
+
+   if (!vrend_state.mem_budget ||
+       vrend_state.mem_used + vrend_state.resource_pool_size <= vrend_state.mem_budget)
+      return;
+
+   /* recycled objects go first */
+   vrend_resource_pool_trim(0);
+
+   /* resources used since the last pass get a second chance */
+   LIST_FOR_EACH_ENTRY_SAFE_REV(res, tmp, &vrend_state.resource_lru, lru) {
+      if (vrend_state.mem_used <= vrend_state.mem_budget)
+         break;
+      if (res->lru_used) {
+         res->lru_used = false;
+         list_del(&res->lru);
+         list_add(&res->lru, &vrend_state.resource_lru);
+         continue;
+      }
+      if (vrend_resource_can_evict(res))
+         vrend_resource_evict(res);
+   }
+}
+
+static int vrend_resource_make_resident(struct vrend_resource *res)
+{
+   struct vrend_context *ctx = vrend_state.current_hw_ctx;
+   struct vrend_transfer_info info;
+   struct pipe_box box, *written;
+   uint32_t mask, level, layer, stride, elsize;
+   int ret;
+
+   if (!res->deferred) {
+      res->lru_used = true;
+      return 0;
+   }
+
+   if (!ctx) {
+      ctx = vrend_lookup_renderer_ctx(0);
+      vrend_hw_switch_context(ctx, true);
+   }
+
+   ret = vrend_resource_alloc_storage(res, NULL);
+   if (ret) {
+      fprintf(stderr, "failed to allocate storage of resource %d\n", res->handle);
+      return ret;
+   }
+   res->deferred = false;
+   if (res->evicted)
+      vrend_state.mem_used += res->gl_size;
+   res->evicted = false;
+   if (!res->pinned)
+      list_add(&res->lru, &vrend_state.resource_lru);
+
+   memset(&info, 0, sizeof(info));
+   info.handle = res->handle;
+   info.iovec = res->iov;
+   info.iovec_cnt = res->num_iovs;
+   info.box = &box;
+
+   if (res->is_buffer) {
+      if (res->iov_level_mask) {
+         struct virgl_sub_upload_data d;
+
+         /* bound through a target that isn't VAO state */
+         written = &res->iov_written[0];
+         d.box = written;
+         d.target = GL_COPY_WRITE_BUFFER;
+         d.offset = res->buffer_offset;
+         vrend_bind_buffer(GL_COPY_WRITE_BUFFER, res->id);
+         vrend_read_from_iovec_cb(res->iov, res->num_iovs, written->x, written->width,
+                                  &iov_buffer_upload, &d);
+         if (res->shadow)
+            vrend_read_from_iovec(res->iov, res->num_iovs, written->x,
+                                  res->shadow + written->x, written->width);
+      }
+      return 0;
+   }
+
+   elsize = util_format_get_blocksize(res->base.format);
+   mask = res->iov_level_mask;
+   while (mask) {
+      level = u_bit_scan(&mask);
+      written = &res->iov_written[level];
+      stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, level)) *
+               elsize;
+
+      for (layer = written->z; layer < (uint32_t)(written->z + written->depth); layer++) {
+         u_box_3d(written->x, written->y, layer, written->width, written->height, 1, &box);
+         info.level = level;
+         info.stride = stride;
+         info.offset = res->mipmap_offsets[level] +
+                       ((uint64_t)layer * u_minify(res->base.height0, level) + written->y) * stride +
+                       written->x * elsize;
+         if (check_iov_bounds(res, &info, res->iov, res->num_iovs))
+            vrend_renderer_transfer_write_iov(ctx, res, res->iov, res->num_iovs, &info);
+      }
+   }
+   return 0;
+}
+
+void vrend_renderer_set_mem_budget(uint64_t budget)
+{
+   vrend_state.mem_budget = budget;
+}
+
+int vrend_renderer_get_mem_usage(int ctx_id, uint64_t *ctx_bytes, uint64_t *total_bytes)
+{
+   struct vrend_context *ctx = NULL;
+
+   if (ctx_bytes) {
+      ctx = vrend_lookup_renderer_ctx(ctx_id);
+      if (!ctx)
+         return EINVAL;
+      *ctx_bytes = ctx->res_mem_used;
+   }
+   if (total_bytes)
+      *total_bytes = vrend_state.mem_used;
+   return 0;
+}
+
+/*
+ * Asynchronous uploads.
+ *
+ * Large transfers to resources that nothing is bound to are copied to a
+ * staging buffer, since the guest may reuse its memory once the transfer
+ * returns, and the upload thread passes them to GL on its own shared
+ * context. Every job is fenced. Before a resource with queued jobs is
+ * used again, the main thread waits for the worker, and each context
+ * waits on the GPU for the last upload fence the next time it is made
+ * current.
+ */
+#define VREND_UPLOAD_MIN_SIZE (64 * 1024)
+
+struct vrend_upload_job {
+   struct list_head head;
+   struct vrend_resource *res;
+   /* commands issued before the transfer */
+   GLsync wait_sync;
+   GLenum target;
+   GLuint id;
+   uint32_t level;
+   struct pipe_box box;
+   GLenum glformat;
+   GLenum gltype;
+   uint32_t size;
+   char *data;
+};
+
+/* runs on the upload thread, which has no shadowed state */
+static void vrend_upload_job_run(struct vrend_upload_job *job)
+{
+   const struct pipe_box *box = &job->box;
+
+   glWaitSync(job->wait_sync, 0, GL_TIMEOUT_IGNORED);
+   glDeleteSync(job->wait_sync);
+   job->wait_sync = NULL;
+
+   if (job->target == GL_COPY_WRITE_BUFFER) {
+      glBindBuffer(GL_COPY_WRITE_BUFFER, job->id);
+      glBufferSubData(GL_COPY_WRITE_BUFFER, box->x, job->size, job->data);
+      glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+      return;
+   }
+
+   glBindTexture(job->target, job->id);
+   switch (job->target) {
+   case GL_TEXTURE_CUBE_MAP:
+      glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + box->z, job->level,
+                      box->x, box->y, box->width, box->height,
+                      job->glformat, job->gltype, job->data);
+      break;
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+      glTexSubImage3D(job->target, job->level, box->x, box->y, box->z,
+                      box->width, box->height, box->depth,
+                      job->glformat, job->gltype, job->data);
+      break;
+   default:
+      glTexSubImage2D(job->target, job->level, box->x, box->y,
+                      box->width, box->height,
+                      job->glformat, job->gltype, job->data);
+      break;
+   }
+   glBindTexture(job->target, 0);
+}
+
+static int thread_upload(void *arg)
+{
+   struct vrend_upload_job *job;
+   GLsync sync;
+
+   vrend_instance = arg;
+   vrend_clicbs->make_current(0, vrend_state.upload_context);
+   /* the staging copies are tightly packed */
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+   pipe_mutex_lock(vrend_state.upload_mutex);
+   while (!vrend_state.stop_upload_thread) {
+      if (LIST_IS_EMPTY(&vrend_state.upload_queue)) {
+         pipe_condvar_wait(vrend_state.upload_cond, vrend_state.upload_mutex);
+         continue;
+      }
+
+      job = LIST_ENTRY(struct vrend_upload_job, vrend_state.upload_queue.next, head);
+      list_del(&job->head);
+      pipe_mutex_unlock(vrend_state.upload_mutex);
+
+      vrend_upload_job_run(job);
+      sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      glFlush();
+      free(job->data);
+      job->data = NULL;
+
+      pipe_mutex_lock(vrend_state.upload_mutex);
+      /* a later fence covers the earlier jobs too */
+      if (vrend_state.upload_sync)
+         glDeleteSync(vrend_state.upload_sync);
+      vrend_state.upload_sync = sync;
+      list_addtail(&job->head, &vrend_state.upload_done);
+      if (--vrend_state.upload_pending == 0)
+         pipe_condvar_broadcast(vrend_state.upload_idle_cond);
+   }
+   pipe_mutex_unlock(vrend_state.upload_mutex);
+
+   vrend_clicbs->make_current(0, 0);
+   vrend_clicbs->destroy_gl_context(vrend_state.upload_context);
+   return 0;
+}
+
+static void vrend_renderer_use_upload_thread(void)
+{
+   struct virgl_gl_ctx_param ctx_params;
+
+   if (getenv("VIRGL_DISABLE_MT") || getenv("VREND_DISABLE_UPLOAD_THREAD"))
+      return;
+
+   ctx_params.shared = true;
+   ctx_params.major_ver = vrend_state.gl_major_ver;
+   ctx_params.minor_ver = vrend_state.gl_minor_ver;
+
+   vrend_state.upload_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+   if (vrend_state.upload_context == NULL) {
+      fprintf(stderr, "failed to create upload opengl context\n");
+      return;
+   }
+
+   list_inithead(&vrend_state.upload_queue);
+   list_inithead(&vrend_state.upload_done);
+   vrend_state.upload_pending = 0;
+   vrend_state.stop_upload_thread = false;
+   pipe_condvar_init(vrend_state.upload_cond);
+   pipe_condvar_init(vrend_state.upload_idle_cond);
+   pipe_mutex_init(vrend_state.upload_mutex);
+
+   vrend_state.upload_thread = pipe_thread_create(thread_upload, vrend_instance);
+   if (!vrend_state.upload_thread) {
+      vrend_clicbs->destroy_gl_context(vrend_state.upload_context);
+      pipe_condvar_destroy(vrend_state.upload_cond);
+      pipe_condvar_destroy(vrend_state.upload_idle_cond);
+      pipe_mutex_destroy(vrend_state.upload_mutex);
+   }
+}
+
+/* Hands the finished jobs back, with wait after the queue ran empty. */
+static void vrend_upload_retire(bool wait)
+{
+   struct vrend_upload_job *job, *tmp;
+   struct list_head done;
+   GLsync sync;
+   bool idle;
+
+   list_inithead(&done);
+
+   pipe_mutex_lock(vrend_state.upload_mutex);
+   while (wait && vrend_state.upload_pending)
+      pipe_condvar_wait(vrend_state.upload_idle_cond, vrend_state.upload_mutex);
+   LIST_FOR_EACH_ENTRY_SAFE(job, tmp, &vrend_state.upload_done, head) {
+      list_del(&job->head);
+      list_addtail(&job->head, &done);
+   }
+   sync = vrend_state.upload_sync;
+   vrend_state.upload_sync = NULL;
+   idle = vrend_state.upload_pending == 0;
+   pipe_mutex_unlock(vrend_state.upload_mutex);
+
+   if (sync) {
+      if (vrend_state.upload_wait_sync)
+         glDeleteSync(vrend_state.upload_wait_sync);
+      vrend_state.upload_wait_sync = sync;
+      vrend_state.upload_serial++;
+      if (vrend_state.current_hw_ctx)
+         vrend_renderer_upload_wait(&vrend_state.current_hw_ctx->sub->upload_serial);
+   }
+
+   LIST_FOR_EACH_ENTRY_SAFE(job, tmp, &done, head) {
+      list_del(&job->head);
+      job->res->upload_jobs--;
+      vrend_resource_reference(&job->res, NULL);
+      FREE(job);
+   }
+
+   if (idle)
+      vrend_state.upload_batch_open = false;
+}
+
+static void vrend_free_upload_thread(void)
+{
+   if (!vrend_state.upload_thread)
+      return;
+
+   vrend_renderer_upload_sync();
+
+   pipe_mutex_lock(vrend_state.upload_mutex);
+   vrend_state.stop_upload_thread = true;
+   pipe_condvar_signal(vrend_state.upload_cond);
+   pipe_mutex_unlock(vrend_state.upload_mutex);
+
+   pipe_thread_wait(vrend_state.upload_thread);
+   vrend_state.upload_thread = 0;
+
+   pipe_condvar_destroy(vrend_state.upload_cond);
+   pipe_condvar_destroy(vrend_state.upload_idle_cond);
+   pipe_mutex_destroy(vrend_state.upload_mutex);
+
+   if (vrend_state.upload_wait_sync) {
+      glDeleteSync(vrend_state.upload_wait_sync);
+      vrend_state.upload_wait_sync = NULL;
+   }
+   vrend_state.upload_serial = 0;
+}
+
+void vrend_renderer_upload_sync(void)
+{
+   if (vrend_state.upload_batch_open)
+      vrend_upload_retire(true);
+}
+
+void vrend_renderer_upload_wait(uint32_t *serial)
+{
+   if (*serial == vrend_state.upload_serial)
+      return;
+
+   glWaitSync(vrend_state.upload_wait_sync, 0, GL_TIMEOUT_IGNORED);
+   *serial = vrend_state.upload_serial;
+}
+
+static inline void vrend_resource_wait_upload(struct vrend_resource *res)
+{
+   if (res->upload_jobs)
+      vrend_renderer_upload_sync();
+}
+
+/* called where a resource gets bound or its storage is accessed */
+static int vrend_resource_use(struct vrend_resource *res)
+{
+   vrend_resource_wait_upload(res);
+   return vrend_resource_make_resident(res);
+}
+
+/* Consumers outside of the renderer don't wait for the upload worker, so
+ * the uploads done so far have to be complete when the resource is handed
+ * out, and later ones are done in the renderer's own context.
+ */
+static void vrend_resource_export(struct vrend_resource *res)
+{
+   res->exported = true;
+
+   if (!vrend_state.upload_wait_sync)
+      return;
+   while (glClientWaitSync(vrend_state.upload_wait_sync, GL_SYNC_FLUSH_COMMANDS_BIT,
+                           1000000000) == GL_TIMEOUT_EXPIRED);
+}
+
+static bool vrend_upload_queue(struct vrend_resource *res,
+                               struct iovec *iov, int num_iovs,
+                               const struct vrend_transfer_info *info)
+{
+   struct vrend_upload_job *job;
+   uint32_t size, stride;
+   int elsize = 0;
+
+   if (!vrend_state.upload_thread || res->exported)
+      return false;
+
+   /* whatever is bound may still read the old contents */
+   if (res->base.reference.count > 1 + res->upload_jobs)
+      return false;
+
+   if (res->is_buffer) {
+      if (res->slab || res->target == 0)
+         return false;
+      size = info->box->width;
+   } else {
+      if (res->y_0_top || res->base.nr_samples > 1 ||
+          util_format_is_compressed(res->base.format) ||
+          res->base.format == (enum pipe_format)VIRGL_FORMAT_Z24X8_UNORM)
+         return false;
+
+      switch (res->target) {
+      case GL_TEXTURE_2D:
+      case GL_TEXTURE_RECTANGLE_NV:
+      case GL_TEXTURE_2D_ARRAY:
+      case GL_TEXTURE_3D:
+         break;
+      case GL_TEXTURE_CUBE_MAP:
+         if (info->box->depth != 1)
+            return false;
+         break;
+      default:
+         return false;
+      }
+
+      elsize = util_format_get_blocksize(res->base.format);
+      size = util_format_get_nblocks(res->base.format, info->box->width,
+                                     info->box->height) * elsize * info->box->depth;
+   }
+
+   if (size < VREND_UPLOAD_MIN_SIZE)
+      return false;
+
+   if (vrend_state.upload_batch_open)
+      vrend_upload_retire(false);
+
+   job = CALLOC_STRUCT(vrend_upload_job);
+   if (!job)
+      return false;
+   job->data = malloc(size);
+   if (!job->data) {
+      FREE(job);
+      return false;
+   }
+
+   if (res->is_buffer) {
+      vrend_read_from_iovec(iov, num_iovs, info->offset, job->data, size);
+      if (res->shadow)
+         memcpy(res->shadow + info->box->x, job->data, size);
+      job->target = GL_COPY_WRITE_BUFFER;
+   } else {
+      stride = info->stride;
+      if (!stride)
+         stride = util_format_get_nblocksx(res->base.format, u_minify(res->base.width0, info->level)) * elsize;
+      read_transfer_data(&res->base, iov, num_iovs, job->data, stride,
+                         info->box, info->level, info->offset, false);
+
+      /* see vrend_renderer_transfer_write_iov */
+      if (info->level < VR_MAX_TEXTURE_2D_LEVELS) {
+         int64_t level_height = u_minify(res->base.height0, info->level);
+         res->mipmap_offsets[info->level] = info->offset -
+                                            ((info->box->z * level_height + info->box->y) * stride + info->box->x * elsize);
+      }
+
+      job->target = res->target;
+      job->glformat = vrend_state.tex_conv_table[res->base.format].glformat;
+      job->gltype = vrend_state.tex_conv_table[res->base.format].gltype;
+      if (job->glformat == 0) {
+         job->glformat = GL_BGRA;
+         job->gltype = GL_UNSIGNED_BYTE;
+      }
+   }
+
+   job->id = res->id;
+   job->level = info->level;
+   job->box = *info->box;
+   job->size = size;
+   vrend_resource_reference(&job->res, res);
+   res->upload_jobs++;
+
+   /* the upload must not overtake earlier draws reading the resource */
+   job->wait_sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   glFlush();
+   vrend_state.upload_batch_open = true;
+
+   pipe_mutex_lock(vrend_state.upload_mutex);
+   list_addtail(&job->head, &vrend_state.upload_queue);
+   vrend_state.upload_pending++;
+   pipe_condvar_signal(vrend_state.upload_cond);
+   pipe_mutex_unlock(vrend_state.upload_mutex);
+   return true;
+}
+
+int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
+                                int transfer_mode)
+{
+   struct vrend_resource *res;
+   struct vrend_context *ctx;
+   struct iovec *iov;
+   int num_iovs;
+   int ret;
+
+   if (!info->box)
+      return EINVAL;
+
+   ctx = vrend_lookup_renderer_ctx(info->ctx_id);
+   if (!ctx)
+      return EINVAL;
+
+   /* made resident below */
+   if (info->ctx_id == 0)
+      res = vrend_resource_lookup(info->handle, 0);
+   else
+      res = vrend_object_lookup(ctx->res_hash, info->handle, 1);
+
+   if (!res) {
+      if (info->ctx_id)
+         report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, info->handle);
+      return EINVAL;
    }
 
    iov = info->iovec;
@@ -6659,13 +9240,26 @@ int vrend_renderer_transfer_iov(const struct vrend_transfer_info *info,
       return EINVAL;
 
    vrend_hw_switch_context(vrend_lookup_renderer_ctx(0), true);
+   ret = vrend_resource_make_resident(res);
+   if (ret)
+      return ret;
 
-   if (transfer_mode == VREND_TRANSFER_WRITE)
+   if (transfer_mode == VREND_TRANSFER_WRITE) {
+      if (iov == res->iov)
+         vrend_resource_track_upload(res, info);
+      else
+         vrend_resource_pin(res);
+      if (vrend_upload_queue(res, iov, num_iovs, info))
+         return 0;
+      vrend_resource_wait_upload(res);
       return vrend_renderer_transfer_write_iov(ctx, res, iov, num_iovs,
                                                info);
-   else
+   }
+   else {
+      vrend_resource_wait_upload(res);
       return vrend_renderer_transfer_send_iov(ctx, res, iov, num_iovs,
                                               info);
+   }
 }
 
 int vrend_transfer_inline_write(struct vrend_context *ctx,
@@ -6675,7 +9269,7 @@ int vrend_transfer_inline_write(struct vrend_context *ctx,
    struct vrend_resource *res;
 
    res = vrend_renderer_ctx_res_lookup(ctx, info->handle);
-   if (!res) {
+   if (!res || vrend_resource_use(res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, info->handle);
       return EINVAL;
    }
@@ -6690,6 +9284,7 @@ int vrend_transfer_inline_write(struct vrend_context *ctx,
       return EINVAL;
    }
 
+   vrend_resource_pin(res);
    return vrend_renderer_transfer_write_iov(ctx, res, info->iovec, info->iovec_cnt, info);
 
 }
@@ -6711,6 +9306,7 @@ void vrend_set_blend_color(struct vrend_context *ctx,
    ctx->sub->blend_color = *color;
    glBlendColor(color->color[0], color->color[1], color->color[2],
                 color->color[3]);
+   ctx->sub->state_epoch++;
 }
 
 void vrend_set_scissor_state(struct vrend_context *ctx,
@@ -6736,6 +9332,8 @@ void vrend_set_scissor_state(struct vrend_context *ctx,
 void vrend_set_polygon_stipple(struct vrend_context *ctx,
                                struct pipe_poly_stipple *ps)
 {
+   ctx->sub->poly_stipple = *ps;
+
    if (vrend_state.use_core_profile) {
       static const unsigned bit31 = 1 << 31;
       GLubyte *stip = calloc(1, 1024);
@@ -6766,24 +9364,28 @@ void vrend_set_polygon_stipple(struct vrend_context *ctx,
    glPolygonStipple((const GLubyte *)ps->stipple);
 }
 
-void vrend_set_clip_state(struct vrend_context *ctx, struct pipe_clip_state *ucp)
+static void vrend_hw_emit_clip_planes(struct pipe_clip_state *ucp)
 {
-   if (vrend_state.use_core_profile) {
-      ctx->sub->ucp_state = *ucp;
-   } else {
-      int i, j;
-      GLdouble val[4];
+   int i, j;
+   GLdouble val[4];
 
-      for (i = 0; i < 8; i++) {
-         for (j = 0; j < 4; j++)
-            val[j] = ucp->ucp[i][j];
-         glClipPlane(GL_CLIP_PLANE0 + i, val);
-      }
+   for (i = 0; i < 8; i++) {
+      for (j = 0; j < 4; j++)
+         val[j] = ucp->ucp[i][j];
+      glClipPlane(GL_CLIP_PLANE0 + i, val);
    }
 }
 
-void vrend_set_sample_mask(UNUSED struct vrend_context *ctx, unsigned sample_mask)
+void vrend_set_clip_state(struct vrend_context *ctx, struct pipe_clip_state *ucp)
 {
+   ctx->sub->ucp_state = *ucp;
+   if (!vrend_state.use_core_profile)
+      vrend_hw_emit_clip_planes(ucp);
+}
+
+void vrend_set_sample_mask(struct vrend_context *ctx, unsigned sample_mask)
+{
+   ctx->sub->sample_mask = sample_mask;
    if (has_feature(feat_sample_mask))
       glSampleMaski(0, sample_mask);
 }
@@ -6796,12 +9398,14 @@ void vrend_set_min_samples(struct vrend_context *ctx, unsigned min_samples)
       min_sample_shading /= MAX2(1, ctx->sub->surf[0]->texture->base.nr_samples);
    }
 
+   ctx->sub->min_sample_shading = min_sample_shading;
    if (has_feature(feat_sample_shading))
       glMinSampleShading(min_sample_shading);
 }
 
-void vrend_set_tess_state(UNUSED struct vrend_context *ctx, const float tess_factors[6])
+void vrend_set_tess_state(struct vrend_context *ctx, const float tess_factors[6])
 {
+   memcpy(ctx->sub->tess_factors, tess_factors, sizeof(ctx->sub->tess_factors));
    if (has_feature(feat_tessellation) && !vrend_state.use_gles) {
       glPatchParameterfv(GL_PATCH_DEFAULT_OUTER_LEVEL, tess_factors);
       glPatchParameterfv(GL_PATCH_DEFAULT_INNER_LEVEL, &tess_factors[4]);
@@ -6815,8 +9419,11 @@ static void vrend_hw_emit_streamout_targets(UNUSED struct vrend_context *ctx, st
    for (i = 0; i < so_obj->num_targets; i++) {
       if (!so_obj->so_targets[i])
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, 0);
-      else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0)
-         glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id, so_obj->so_targets[i]->buffer_offset, so_obj->so_targets[i]->buffer_size);
+      else if (so_obj->so_targets[i]->buffer_offset || so_obj->so_targets[i]->buffer->slab ||
+               so_obj->so_targets[i]->buffer_size < so_obj->so_targets[i]->buffer->base.width0)
+         glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id,
+                           so_obj->so_targets[i]->buffer->buffer_offset + so_obj->so_targets[i]->buffer_offset,
+                           so_obj->so_targets[i]->buffer_size);
       else
          glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, i, so_obj->so_targets[i]->buffer->id);
    }
@@ -6885,12 +9492,172 @@ static void vrend_resource_buffer_copy(UNUSED struct vrend_context *ctx,
                                        uint32_t dstx, uint32_t srcx,
                                        uint32_t width)
 {
-   glBindBuffer(GL_COPY_READ_BUFFER, src_res->id);
-   glBindBuffer(GL_COPY_WRITE_BUFFER, dst_res->id);
+   vrend_bind_buffer(GL_COPY_READ_BUFFER, src_res->id);
+   vrend_bind_buffer(GL_COPY_WRITE_BUFFER, dst_res->id);
+
+   glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                       src_res->buffer_offset + srcx, dst_res->buffer_offset + dstx, width);
+   vrend_bind_buffer(GL_COPY_READ_BUFFER, 0);
+   vrend_bind_buffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+/*
+ * Copy through a pixel buffer object so the data never leaves the GPU. With
+ * GL_ARB_get_texture_sub_image only src_box is packed, otherwise the whole
+ * source level is and the unpack skips to the box.
+ */
+static bool vrend_resource_copy_pbo(struct vrend_resource *src_res,
+                                    struct vrend_resource *dst_res,
+                                    uint32_t dst_level,
+                                    uint32_t dstx, uint32_t dsty,
+                                    uint32_t dstz, uint32_t src_level,
+                                    const struct pipe_box *src_box)
+{
+   enum pipe_format format = src_res->base.format;
+   bool sub_image = has_feature(feat_get_texture_sub_image);
+   bool compressed = util_format_is_compressed(format);
+   GLenum glformat = vrend_state.tex_conv_table[format].glformat;
+   GLenum gltype = vrend_state.tex_conv_table[format].gltype;
+   uint32_t slice_size, total_size, layer_offset;
+   GLuint pbo;
+   int i;
+
+   if (vrend_state.use_gles || src_res->base.nr_samples > 1 ||
+       dst_res->base.nr_samples > 1 || src_res->target != dst_res->target)
+      return false;
+
+   /* compressed data can only be unpacked tightly */
+   if (compressed && !sub_image)
+      return false;
+
+   if (compressed)
+      glformat = vrend_state.tex_conv_table[format].internalformat;
+
+   if (sub_image) {
+      slice_size = util_format_get_nblocks(format, src_box->width, src_box->height) *
+                   util_format_get_blocksize(format);
+      total_size = slice_size * src_box->depth;
+   } else {
+      slice_size = util_format_get_nblocks(format, u_minify(src_res->base.width0, src_level),
+                                           u_minify(src_res->base.height0, src_level)) *
+                   util_format_get_blocksize(format);
+      total_size = slice_size * vrend_get_texture_depth(src_res, src_level);
+   }
+
+   glGenBuffers(1, &pbo);
+   vrend_bind_buffer(GL_PIXEL_PACK_BUFFER, pbo);
+   glBufferData(GL_PIXEL_PACK_BUFFER, total_size, NULL, GL_STREAM_COPY);
+   vrend_pixel_store(GL_PACK_ALIGNMENT, 1);
+
+   if (sub_image) {
+      int y = src_box->y, height = src_box->height;
+      int z = src_box->z, depth = src_box->depth;
+
+      /* 1D array layers are rows in GL */
+      if (src_res->target == GL_TEXTURE_1D_ARRAY) {
+         y = z;
+         height = depth;
+         z = 0;
+         depth = 1;
+      }
+
+      if (compressed)
+         glGetCompressedTextureSubImage(src_res->id, src_level, src_box->x, y, z,
+                                        src_box->width, height, depth, total_size, NULL);
+      else
+         glGetTextureSubImage(src_res->id, src_level, src_box->x, y, z,
+                              src_box->width, height, depth,
+                              glformat, gltype, total_size, NULL);
+   } else {
+      glBindTexture(src_res->target, src_res->id);
+      if (src_res->target == GL_TEXTURE_CUBE_MAP) {
+         for (i = 0; i < 6; i++)
+            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, src_level, glformat, gltype,
+                          (void *)(uintptr_t)(i * slice_size));
+      } else
+         glGetTexImage(src_res->target, src_level, glformat, gltype, NULL);
+
+      vrend_pixel_store(GL_UNPACK_ROW_LENGTH, u_minify(src_res->base.width0, src_level));
+      vrend_pixel_store(GL_UNPACK_IMAGE_HEIGHT, u_minify(src_res->base.height0, src_level));
+      vrend_pixel_store(GL_UNPACK_SKIP_PIXELS, src_box->x);
+      if (src_res->target == GL_TEXTURE_1D_ARRAY) {
+         vrend_pixel_store(GL_UNPACK_SKIP_ROWS, src_box->z);
+      } else {
+         vrend_pixel_store(GL_UNPACK_SKIP_ROWS, src_box->y);
+         if (src_res->target != GL_TEXTURE_CUBE_MAP)
+            vrend_pixel_store(GL_UNPACK_SKIP_IMAGES, src_box->z);
+      }
+   }
+
+   vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
+   vrend_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+   vrend_bind_buffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+   vrend_pixel_store(GL_UNPACK_ALIGNMENT, 1);
+   glBindTexture(dst_res->target, dst_res->id);
+
+   switch (dst_res->target) {
+   case GL_TEXTURE_1D:
+      if (compressed)
+         glCompressedTexSubImage1D(GL_TEXTURE_1D, dst_level, dstx, src_box->width,
+                                   glformat, total_size, NULL);
+      else
+         glTexSubImage1D(GL_TEXTURE_1D, dst_level, dstx, src_box->width,
+                         glformat, gltype, NULL);
+      break;
+   case GL_TEXTURE_1D_ARRAY:
+      if (compressed)
+         glCompressedTexSubImage2D(GL_TEXTURE_1D_ARRAY, dst_level, dstx, dstz,
+                                   src_box->width, src_box->depth,
+                                   glformat, total_size, NULL);
+      else
+         glTexSubImage2D(GL_TEXTURE_1D_ARRAY, dst_level, dstx, dstz,
+                         src_box->width, src_box->depth, glformat, gltype, NULL);
+      break;
+   case GL_TEXTURE_CUBE_MAP:
+      for (i = 0; i < src_box->depth; i++) {
+         GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X + dstz + i;
+         layer_offset = (sub_image ? i : src_box->z + i) * slice_size;
+         if (compressed)
+            glCompressedTexSubImage2D(face, dst_level, dstx, dsty,
+                                      src_box->width, src_box->height,
+                                      glformat, slice_size, (void *)(uintptr_t)layer_offset);
+         else
+            glTexSubImage2D(face, dst_level, dstx, dsty, src_box->width, src_box->height,
+                            glformat, gltype, (void *)(uintptr_t)layer_offset);
+      }
+      break;
+   case GL_TEXTURE_3D:
+   case GL_TEXTURE_2D_ARRAY:
+   case GL_TEXTURE_CUBE_MAP_ARRAY:
+      if (compressed)
+         glCompressedTexSubImage3D(dst_res->target, dst_level, dstx, dsty, dstz,
+                                   src_box->width, src_box->height, src_box->depth,
+                                   glformat, total_size, NULL);
+      else
+         glTexSubImage3D(dst_res->target, dst_level, dstx, dsty, dstz,
+                         src_box->width, src_box->height, src_box->depth,
+                         glformat, gltype, NULL);
+      break;
+   default:
+      if (compressed)
+         glCompressedTexSubImage2D(dst_res->target, dst_level, dstx, dsty,
+                                   src_box->width, src_box->height,
+                                   glformat, total_size, NULL);
+      else
+         glTexSubImage2D(dst_res->target, dst_level, dstx, dsty,
+                         src_box->width, src_box->height, glformat, gltype, NULL);
+      break;
+   }
 
-   glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, srcx, dstx, width);
-   glBindBuffer(GL_COPY_READ_BUFFER, 0);
-   glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   vrend_pixel_store(GL_UNPACK_ROW_LENGTH, 0);
+   vrend_pixel_store(GL_UNPACK_IMAGE_HEIGHT, 0);
+   vrend_pixel_store(GL_UNPACK_SKIP_PIXELS, 0);
+   vrend_pixel_store(GL_UNPACK_SKIP_ROWS, 0);
+   vrend_pixel_store(GL_UNPACK_SKIP_IMAGES, 0);
+   vrend_pixel_store(GL_UNPACK_ALIGNMENT, 4);
+   vrend_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   vrend_delete_buffers(1, &pbo);
+   return true;
 }
 
 static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
@@ -6918,6 +9685,10 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       return;
    }
 
+   if (vrend_resource_copy_pbo(src_res, dst_res, dst_level, dstx, dsty, dstz,
+                               src_level, src_box))
+      return;
+
    box = *src_box;
    box.depth = vrend_get_texture_depth(src_res, src_level);
    dst_stride = util_format_get_stride(dst_res->base.format, dst_res->base.width0);
@@ -6931,11 +9702,11 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
    if (!tptr)
       return;
 
-   glformat = tex_conv_table[src_res->base.format].glformat;
-   gltype = tex_conv_table[src_res->base.format].gltype;
+   glformat = vrend_state.tex_conv_table[src_res->base.format].glformat;
+   gltype = vrend_state.tex_conv_table[src_res->base.format].gltype;
 
    if (compressed)
-      glformat = tex_conv_table[src_res->base.format].internalformat;
+      glformat = vrend_state.tex_conv_table[src_res->base.format].internalformat;
 
    /* If we are on gles we need to rely on the textures backing
     * iovec to have the data we need, otherwise we can use glGetTexture
@@ -6968,18 +9739,18 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       switch (elsize) {
       case 1:
       case 3:
-         glPixelStorei(GL_PACK_ALIGNMENT, 1);
+         vrend_pixel_store(GL_PACK_ALIGNMENT, 1);
          break;
       case 2:
       case 6:
-         glPixelStorei(GL_PACK_ALIGNMENT, 2);
+         vrend_pixel_store(GL_PACK_ALIGNMENT, 2);
          break;
       case 4:
       default:
-         glPixelStorei(GL_PACK_ALIGNMENT, 4);
+         vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
          break;
       case 8:
-         glPixelStorei(GL_PACK_ALIGNMENT, 8);
+         vrend_pixel_store(GL_PACK_ALIGNMENT, 8);
          break;
       }
       glBindTexture(src_res->target, src_res->id);
@@ -7003,22 +9774,22 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       }
    }
 
-   glPixelStorei(GL_PACK_ALIGNMENT, 4);
+   vrend_pixel_store(GL_PACK_ALIGNMENT, 4);
    switch (elsize) {
    case 1:
    case 3:
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      vrend_pixel_store(GL_UNPACK_ALIGNMENT, 1);
       break;
    case 2:
    case 6:
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+      vrend_pixel_store(GL_UNPACK_ALIGNMENT, 2);
       break;
    case 4:
    default:
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+      vrend_pixel_store(GL_UNPACK_ALIGNMENT, 4);
       break;
    case 8:
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 8);
+      vrend_pixel_store(GL_UNPACK_ALIGNMENT, 8);
       break;
    }
 
@@ -7053,7 +9824,7 @@ static void vrend_resource_copy_fallback(struct vrend_resource *src_res,
       slice_offset += slice_size;
    }
 
-   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+   vrend_pixel_store(GL_UNPACK_ALIGNMENT, 4);
    free(tptr);
 }
 
@@ -7082,6 +9853,7 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    struct vrend_resource *src_res, *dst_res;
    GLbitfield glmask = 0;
    GLint sy1, sy2, dy1, dy2;
+   GLuint src_fbo, dst_fbo;
 
    if (ctx->in_error)
       return;
@@ -7089,14 +9861,16 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
    src_res = vrend_renderer_ctx_res_lookup(ctx, src_handle);
    dst_res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
 
-   if (!src_res) {
+   if (!src_res || vrend_resource_use(src_res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
       return;
    }
-   if (!dst_res) {
+   if (!dst_res || vrend_resource_use(dst_res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, dst_handle);
       return;
    }
+   vrend_resource_pin(dst_res);
+   vrend_resource_drop_shadow(dst_res, false);
 
    if (src_res->base.target == PIPE_BUFFER && dst_res->base.target == PIPE_BUFFER) {
       /* do a buffer copy */
@@ -7120,22 +9894,13 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       return;
    }
 
-   glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[0]);
-   /* clean out fb ids */
-   glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
-                             GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(src_res, 0, src_level, src_box->z);
-
-   glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[1]);
-   glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
-                             GL_TEXTURE_2D, 0, 0);
-   vrend_fb_bind_texture(dst_res, 0, dst_level, dstz);
-   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
-
-   glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+   src_fbo = vrend_fbo_for_resource(ctx, src_res, src_level, src_box->z);
+   dst_fbo = vrend_fbo_for_resource(ctx, dst_res, dst_level, dstz);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst_fbo);
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, src_fbo);
 
    glmask = GL_COLOR_BUFFER_BIT;
-   glDisable(GL_SCISSOR_TEST);
+   vrend_disable(GL_SCISSOR_TEST);
 
    if (!src_res->y_0_top) {
       sy1 = src_box->y;
@@ -7153,14 +9918,119 @@ void vrend_renderer_resource_copy_region(struct vrend_context *ctx,
       dy2 = dst_res->base.height0 - dsty;
    }
 
-   glBlitFramebuffer(src_box->x, sy1,
-                     src_box->x + src_box->width,
-                     sy2,
-                     dstx, dy1,
-                     dstx + src_box->width,
-                     dy2,
-                     glmask, GL_NEAREST);
+   glBlitFramebuffer(src_box->x, sy1,
+                     src_box->x + src_box->width,
+                     sy2,
+                     dstx, dy1,
+                     dstx + src_box->width,
+                     dy2,
+                     glmask, GL_NEAREST);
+
+}
+
+/* The GL blitter draws in the context of the sub context, into the
+ * framebuffer and with the vertex array bound here. Whatever of the sub
+ * context state would get in the way is switched off through the caches,
+ * and emitted again or marked dirty once the blit is done.
+ */
+static void vrend_blit_gl_begin(struct vrend_context *ctx, bool blit_depth)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   int i;
+
+   if (!sub->blit_vaoid) {
+      glGenVertexArrays(1, &sub->blit_vaoid);
+      glGenFramebuffers(1, &sub->blit_fb_id);
+   }
+
+   /* the blit draw doesn't count towards the guest's queries */
+   vrend_sub_pause_queries(sub, true);
+
+   glBindVertexArray(sub->blit_vaoid);
+   glBindFramebuffer(GL_FRAMEBUFFER_EXT, sub->blit_fb_id);
+
+   vrend_active_texture(GL_TEXTURE0);
+   if (has_feature(feat_samplers))
+      glBindSampler(0, 0);
+
+   vrend_disable(GL_SCISSOR_TEST);
+   vrend_disable(GL_CULL_FACE);
+   vrend_disable(GL_BLEND);
+   if (has_feature(feat_multisample)) {
+      vrend_disable(GL_SAMPLE_ALPHA_TO_COVERAGE);
+      if (has_feature(feat_sample_mask))
+         vrend_disable(GL_SAMPLE_MASK);
+   }
+   if (!vrend_state.use_gles) {
+      vrend_disable(GL_COLOR_LOGIC_OP);
+      vrend_disable(GL_SAMPLE_ALPHA_TO_ONE);
+      vrend_enable(GL_FRAMEBUFFER_SRGB);
+      glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+   }
+   if (!vrend_state.use_core_profile)
+      vrend_disable(GL_POLYGON_STIPPLE);
+   sub->hw_blend_state.logicop_enable = false;
+
+   if (sub->hw_rs_state.rasterizer_discard) {
+      sub->hw_rs_state.rasterizer_discard = false;
+      vrend_disable(GL_RASTERIZER_DISCARD);
+   }
+   if (sub->hw_rs_state.clip_plane_enable) {
+      for (i = 0; i < 8; i++) {
+         if (sub->hw_rs_state.clip_plane_enable & (1 << i))
+            vrend_disable(GL_CLIP_PLANE0 + i);
+      }
+      sub->hw_rs_state.clip_plane_enable = 0;
+   }
+
+   for (i = 0; i < PIPE_MAX_COLOR_BUFS; i++) {
+      if (sub->hw_blend_state.rt[i].colormask != PIPE_MASK_RGBA)
+         break;
+   }
+   if (i < PIPE_MAX_COLOR_BUFS) {
+      for (i = 0; i < PIPE_MAX_COLOR_BUFS; i++)
+         sub->hw_blend_state.rt[i].colormask = PIPE_MASK_RGBA;
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+   }
+
+   vrend_stencil_test_enable(ctx, false);
+   vrend_alpha_test_enable(ctx, false);
+   vrend_depth_test_enable(ctx, blit_depth);
+   if (blit_depth) {
+      glDepthFunc(GL_ALWAYS);
+      glDepthMask(GL_TRUE);
+   }
+}
+
+static void vrend_blit_gl_end(struct vrend_context *ctx)
+{
+   struct vrend_sub_context *sub = ctx->sub;
+   int i, j;
+
+   if (!has_feature(feat_gles31_vertex_attrib_binding))
+      glBindVertexArray(sub->vaoid);
+   vrend_hw_emit_framebuffer_state(ctx);
+
+   if (sub->rs)
+      vrend_hw_emit_rs(ctx);
+   vrend_hw_emit_dsa(ctx);
+
+   /* blend and the color mask go out with the next draw */
+   sub->stencil_state_dirty = true;
+   sub->scissor_state_dirty = (1 << 0);
+   sub->viewport_state_dirty = (1 << PIPE_MAX_VIEWPORTS) - 1;
+   /* the source texture went to unit 0 */
+   for (i = 0; i < PIPE_SHADER_TYPES; i++) {
+      for (j = 0; j < PIPE_MAX_SHADER_SAMPLER_VIEWS; j++) {
+         if (sub->view_units[i][j] == 0)
+            sub->views_dirty[i] |= 1 << j;
+      }
+   }
+   if (has_feature(feat_samplers))
+      sub->sampler_state_dirty = true;
+   sub->state_epoch++;
 
+   vrend_sub_pause_queries(sub, false);
 }
 
 static void vrend_renderer_blit_int(struct vrend_context *ctx,
@@ -7174,7 +10044,7 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
    int n_layers = 1, i;
    bool use_gl = false;
    bool make_intermediate_copy = false;
-   GLuint intermediate_fbo = 0;
+   GLuint intermediate_fbo = 0, src_fbo, dst_fbo, read_fbo;
    struct vrend_resource *intermediate_copy = 0;
 
    filter = convert_mag_filter(info->filter);
@@ -7227,9 +10097,12 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       use_gl = true;
 
    if (use_gl) {
+      vrend_blit_gl_begin(ctx, (info->mask & PIPE_MASK_Z) &&
+                          util_format_has_depth(util_format_description(src_res->base.format)) &&
+                          util_format_has_depth(util_format_description(dst_res->base.format)));
       vrend_renderer_blit_gl(ctx, src_res, dst_res, info,
                              has_feature(feat_texture_srgb_decode));
-      vrend_clicbs->make_current(0, ctx->sub->gl_context);
+      vrend_blit_gl_end(ctx);
       return;
    }
 
@@ -7258,9 +10131,9 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
 
    if (info->scissor_enable) {
       glScissor(info->scissor.minx, info->scissor.miny, info->scissor.maxx - info->scissor.minx, info->scissor.maxy - info->scissor.miny);
-      glEnable(GL_SCISSOR_TEST);
+      vrend_enable(GL_SCISSOR_TEST);
    } else
-      glDisable(GL_SCISSOR_TEST);
+      vrend_disable(GL_SCISSOR_TEST);
    ctx->sub->scissor_state_dirty = (1 << 0);
 
    /* An GLES GL_INVALID_OPERATION is generated if one wants to blit from a
@@ -7300,33 +10173,16 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
       vrend_renderer_resource_allocate_texture(intermediate_copy, NULL);
 
       glGenFramebuffers(1, &intermediate_fbo);
-   } else {
-      /* If no intermediate copy is needed make the variables point to the
-       * original source to simplify the code below.
-       */
-      intermediate_fbo = ctx->sub->blit_fb_ids[0];
-      intermediate_copy = src_res;
    }
 
-   glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[0]);
-   if (info->mask & PIPE_MASK_RGBA)
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
-                                GL_TEXTURE_2D, 0, 0);
-   else
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0,
-                                GL_TEXTURE_2D, 0, 0);
-   glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[1]);
-   if (info->mask & PIPE_MASK_RGBA)
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_STENCIL_ATTACHMENT,
-                                GL_TEXTURE_2D, 0, 0);
-   else if (info->mask & (PIPE_MASK_Z | PIPE_MASK_S))
-      glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0,
-                                GL_TEXTURE_2D, 0, 0);
    if (info->src.box.depth == info->dst.box.depth)
       n_layers = info->dst.box.depth;
    for (i = 0; i < n_layers; i++) {
-      glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[0]);
-      vrend_fb_bind_texture(src_res, 0, info->src.level, info->src.box.z + i);
+      /* the FBOs only have the resource attached, so they don't need
+       * cleaning out for the mask */
+      src_fbo = vrend_fbo_for_resource(ctx, src_res, info->src.level, info->src.box.z + i);
+      dst_fbo = vrend_fbo_for_resource(ctx, dst_res, info->dst.level, info->dst.box.z + i);
+      read_fbo = src_fbo;
 
       if (make_intermediate_copy) {
          int level_width = u_minify(src_res->base.width0, info->src.level);
@@ -7337,24 +10193,23 @@ static void vrend_renderer_blit_int(struct vrend_context *ctx,
          vrend_fb_bind_texture(intermediate_copy, 0, info->src.level, info->src.box.z + i);
 
          glBindFramebuffer(GL_DRAW_FRAMEBUFFER, intermediate_fbo);
-         glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->sub->blit_fb_ids[0]);
+         glBindFramebuffer(GL_READ_FRAMEBUFFER, src_fbo);
          glBlitFramebuffer(0, 0, level_width, level_height,
                            0, 0, level_width, level_height,
                            glmask, filter);
+         read_fbo = intermediate_fbo;
       }
 
-      glBindFramebuffer(GL_FRAMEBUFFER_EXT, ctx->sub->blit_fb_ids[1]);
-      vrend_fb_bind_texture(dst_res, 0, info->dst.level, info->dst.box.z + i);
-      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->sub->blit_fb_ids[1]);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst_fbo);
 
       if (!vrend_state.use_gles) {
          if (util_format_is_srgb(dst_res->base.format))
-            glEnable(GL_FRAMEBUFFER_SRGB);
+            vrend_enable(GL_FRAMEBUFFER_SRGB);
          else
-            glDisable(GL_FRAMEBUFFER_SRGB);
+            vrend_disable(GL_FRAMEBUFFER_SRGB);
       }
 
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, intermediate_fbo);
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, read_fbo);
 
       glBlitFramebuffer(info->src.box.x,
                         src_y1,
@@ -7381,14 +10236,15 @@ void vrend_renderer_blit(struct vrend_context *ctx,
    src_res = vrend_renderer_ctx_res_lookup(ctx, src_handle);
    dst_res = vrend_renderer_ctx_res_lookup(ctx, dst_handle);
 
-   if (!src_res) {
+   if (!src_res || vrend_resource_use(src_res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, src_handle);
       return;
    }
-   if (!dst_res) {
+   if (!dst_res || vrend_resource_use(dst_res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, dst_handle);
       return;
    }
+   vrend_resource_pin(dst_res);
 
    if (ctx->in_error)
       return;
@@ -7423,42 +10279,141 @@ void vrend_renderer_blit(struct vrend_context *ctx,
       vrend_pause_render_condition(ctx, false);
 }
 
+/* the GL context commands currently go to, NULL if it isn't known */
+static virgl_gl_context vrend_current_gl_context(void)
+{
+   if (vrend_state.use_virtual_ctx)
+      return vrend_state.virtual_gl_context;
+   if (!vrend_state.current_hw_ctx)
+      return NULL;
+   return vrend_state.current_hw_ctx->sub->gl_context;
+}
+
+static struct vrend_fence_timeline *vrend_fence_timeline_get(uint32_t ctx_id)
+{
+   struct vrend_fence_timeline *timeline;
+
+   if (!vrend_state.use_ctx_fences)
+      ctx_id = 0;
+
+   LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_timelines, head) {
+      if (timeline->ctx_id == ctx_id && !timeline->destroyed)
+         return timeline;
+   }
+
+   timeline = CALLOC_STRUCT(vrend_fence_timeline);
+   if (!timeline)
+      return NULL;
+   timeline->ctx_id = ctx_id;
+   list_inithead(&timeline->pending);
+   list_addtail(&timeline->head, &vrend_state.fence_timelines);
+   return timeline;
+}
+
+static struct vrend_fence *vrend_fence_alloc(void)
+{
+   struct vrend_fence *fence = vrend_state.fence_pool;
+
+   if (!fence)
+      return malloc(sizeof(struct vrend_fence));
+   vrend_state.fence_pool = fence->next;
+   return fence;
+}
+
+static void vrend_fence_free(struct vrend_fence *fence)
+{
+   fence->next = vrend_state.fence_pool;
+   vrend_state.fence_pool = fence;
+}
+
 int vrend_renderer_create_fence(int client_fence_id, uint32_t ctx_id)
 {
    struct vrend_fence *fence;
+   struct vrend_fence_timeline *timeline;
+
+   timeline = vrend_fence_timeline_get(ctx_id);
+   if (!timeline)
+      return ENOMEM;
 
-   fence = malloc(sizeof(struct vrend_fence));
+   /* the sync objects of a timeline must come from the same context */
+   if (timeline->ctx_id) {
+      struct vrend_context *ctx = vrend_lookup_renderer_ctx(ctx_id);
+      if (ctx)
+         vrend_hw_switch_context(ctx, true);
+   }
+
+   fence = vrend_fence_alloc();
    if (!fence)
       return ENOMEM;
 
    fence->ctx_id = ctx_id;
    fence->fence_id = client_fence_id;
+   fence->timeline = timeline;
+   fence->seqno = ++vrend_state.fence_seqno;
+   fence->gl_context = vrend_current_gl_context();
    fence->syncobj = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   /* the sync thread waits from another context */
    glFlush();
 
+   if (vrend_state.upload_batch_open)
+      vrend_upload_retire(false);
+
+   vrend_state.resource_pool_epoch++;
+   vrend_resource_pool_trim(VREND_POOL_MAX_SIZE);
+   vrend_resource_enforce_budget();
+
    if (fence->syncobj == NULL)
       goto fail;
 
-   if (vrend_state.sync_thread) {
+   timeline->num_fences++;
+   vrend_fence_queue_push(&vrend_state.fence_submit, fence);
+
+   /* only wake the sync thread when it went to sleep */
+   if (vrend_state.sync_thread &&
+       __atomic_load_n(&vrend_state.sync_thread_sleeping, __ATOMIC_SEQ_CST)) {
       pipe_mutex_lock(vrend_state.fence_mutex);
-      list_addtail(&fence->fences, &vrend_state.fence_wait_list);
       pipe_condvar_signal(vrend_state.fence_cond);
       pipe_mutex_unlock(vrend_state.fence_mutex);
-   } else
-      list_addtail(&fence->fences, &vrend_state.fence_list);
+   }
    return 0;
 
  fail:
    fprintf(stderr, "failed to create fence sync object\n");
-   free(fence);
+   vrend_fence_free(fence);
    return ENOMEM;
 }
 
-static void free_fence_locked(struct vrend_fence *fence)
+static void vrend_fence_timeline_put(struct vrend_fence_timeline *timeline)
 {
-   list_del(&fence->fences);
-   glDeleteSync(fence->syncobj);
-   free(fence);
+   if (--timeline->num_fences || !timeline->destroyed)
+      return;
+   list_del(&timeline->head);
+   FREE(timeline);
+}
+
+/* The fences still pending on the timeline of a destroyed context are
+ * retired as usual but not reported, the last one frees the timeline.
+ */
+void vrend_renderer_destroy_fence_timeline(uint32_t ctx_id)
+{
+   struct vrend_fence_timeline *timeline;
+
+   if (!vrend_state.use_ctx_fences || !ctx_id)
+      return;
+
+   LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_timelines, head) {
+      if (timeline->ctx_id == ctx_id && !timeline->destroyed)
+         break;
+   }
+   if (&timeline->head == &vrend_state.fence_timelines)
+      return;
+
+   timeline->destroyed = true;
+   timeline->signalled = false;
+   if (!timeline->num_fences) {
+      list_del(&timeline->head);
+      FREE(timeline);
+   }
 }
 
 static void flush_eventfd(int fd)
@@ -7472,41 +10427,39 @@ static void flush_eventfd(int fd)
 
 void vrend_renderer_check_fences(void)
 {
-   struct vrend_fence *fence, *stor;
-   uint32_t latest_id = 0;
-   GLenum glret;
+   struct vrend_fence_timeline *timeline;
+   struct vrend_fence *fence;
 
    if (!vrend_state.inited)
       return;
 
    if (vrend_state.sync_thread) {
       flush_eventfd(vrend_state.eventfd);
-      pipe_mutex_lock(vrend_state.fence_mutex);
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-         if (fence->fence_id > latest_id)
-            latest_id = fence->fence_id;
-         free_fence_locked(fence);
-      }
-      pipe_mutex_unlock(vrend_state.fence_mutex);
    } else {
       vrend_renderer_force_ctx_0();
+      vrend_fence_process(&fence);
+   }
 
-      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-         glret = glClientWaitSync(fence->syncobj, 0, 0);
-         if (glret == GL_ALREADY_SIGNALED){
-            latest_id = fence->fence_id;
-            free_fence_locked(fence);
-         }
-         /* don't bother checking any subsequent ones */
-         else if (glret == GL_TIMEOUT_EXPIRED) {
-            break;
-         }
+   /* only the latest retired fence of each timeline is reported */
+   while ((fence = vrend_fence_queue_pop(&vrend_state.fence_done))) {
+      timeline = fence->timeline;
+      if (!timeline->destroyed) {
+         timeline->signalled_id = fence->fence_id;
+         timeline->signalled = true;
       }
+      vrend_fence_free(fence);
+      vrend_fence_timeline_put(timeline);
    }
 
-   if (latest_id == 0)
-      return;
-   vrend_clicbs->write_fence(latest_id);
+   LIST_FOR_EACH_ENTRY(timeline, &vrend_state.fence_timelines, head) {
+      if (!timeline->signalled)
+         continue;
+      timeline->signalled = false;
+      if (vrend_state.use_ctx_fences && timeline->ctx_id)
+         vrend_clicbs->write_context_fence(timeline->ctx_id, timeline->signalled_id);
+      else
+         vrend_clicbs->write_fence(timeline->signalled_id);
+   }
 }
 
 static bool vrend_get_one_query_result(GLuint query_id, bool use_64, uint64_t *result)
@@ -7530,19 +10483,81 @@ static bool vrend_get_one_query_result(GLuint query_id, bool use_64, uint64_t *r
    return true;
 }
 
-static bool vrend_check_query(struct vrend_query *query)
+static void vrend_write_query_result(struct vrend_query *query, uint64_t result)
 {
-   uint64_t result;
    struct virgl_host_query_state *state;
+
+   state = (struct virgl_host_query_state *)query->res->ptr;
+   state->result = result;
+   state->query_state = VIRGL_QUERY_STATE_DONE;
+}
+
+static bool vrend_check_query(struct vrend_query *query)
+{
+   bool use_64 = vrend_is_timer_query(query->gltype);
+   uint64_t result, part;
+   unsigned i;
    bool ret;
 
-   ret = vrend_get_one_query_result(query->id, vrend_is_timer_query(query->gltype), &result);
+   ret = vrend_get_one_query_result(query->id, use_64, &result);
    if (ret == false)
       return false;
 
-   state = (struct virgl_host_query_state *)query->res->ptr;
-   state->result = result;
-   state->query_state = VIRGL_QUERY_STATE_DONE;
+   for (i = 0; i < query->num_segments; i++) {
+      if (!vrend_get_one_query_result(query->segments[i], use_64, &part))
+         return false;
+      result += part;
+   }
+
+   if (query->num_segments &&
+       (query->gltype == GL_ANY_SAMPLES_PASSED ||
+        query->gltype == GL_ANY_SAMPLES_PASSED_CONSERVATIVE ||
+        query->gltype == GL_TRANSFORM_FEEDBACK_STREAM_OVERFLOW_ARB ||
+        query->gltype == GL_TRANSFORM_FEEDBACK_OVERFLOW_ARB))
+      result = !!result;
+
+   vrend_write_query_result(query, result);
+   return true;
+}
+
+/* Has the GPU write the result into the query buffer, the CPU doesn't wait
+ * for it, and it doesn't need the query's context to be current later on.
+ */
+static void vrend_query_qbo_fetch(struct vrend_query *query)
+{
+   if (query->qbo_sync)
+      return;
+
+   vrend_bind_buffer(GL_QUERY_BUFFER, query->qbo);
+   glGetQueryObjectui64v(query->id, GL_QUERY_RESULT, (GLuint64 *)0);
+   vrend_bind_buffer(GL_QUERY_BUFFER, 0);
+   query->qbo_sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* buffers and sync objects are shared, so any context will do */
+static bool vrend_check_query_qbo(struct vrend_query *query)
+{
+   uint64_t result;
+   GLbitfield flags = 0;
+   GLenum glret;
+
+   /* switching contexts flushes, otherwise flush the one we're in */
+   if (vrend_state.current_hw_ctx &&
+       vrend_state.current_hw_ctx->ctx_id == (uint32_t)query->ctx_id)
+      flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+
+   glret = glClientWaitSync(query->qbo_sync, flags, 0);
+   if (glret == GL_TIMEOUT_EXPIRED)
+      return false;
+
+   glDeleteSync(query->qbo_sync);
+   query->qbo_sync = NULL;
+
+   vrend_bind_buffer(GL_COPY_READ_BUFFER, query->qbo);
+   glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(result), &result);
+   vrend_bind_buffer(GL_COPY_READ_BUFFER, 0);
+
+   vrend_write_query_result(query, result);
    return true;
 }
 
@@ -7553,7 +10568,14 @@ void vrend_renderer_check_queries(void)
    if (!vrend_state.inited)
       return;
 
+   /* the list is grouped by context, so each context is switched to once */
    LIST_FOR_EACH_ENTRY_SAFE(query, stor, &vrend_state.waiting_query_list, waiting_queries) {
+      if (query->qbo_sync) {
+         if (vrend_check_query_qbo(query))
+            list_delinit(&query->waiting_queries);
+         continue;
+      }
+
       vrend_hw_switch_context(vrend_lookup_renderer_ctx(query->ctx_id), true);
       if (vrend_check_query(query))
          list_delinit(&query->waiting_queries);
@@ -7588,7 +10610,7 @@ static void vrend_finish_context_switch(struct vrend_context *ctx)
 
    vrend_state.current_hw_ctx = ctx;
 
-   vrend_clicbs->make_current(0, ctx->sub->gl_context);
+   vrend_make_current(ctx->sub);
 }
 
 void
@@ -7611,7 +10633,7 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
    struct vrend_resource *res;
    uint32_t ret_handle;
    res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-   if (!res) {
+   if (!res || vrend_resource_use(res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
    }
@@ -7621,6 +10643,7 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
       return ENOMEM;
 
    list_inithead(&q->waiting_queries);
+   list_inithead(&q->active);
    q->type = query_type;
    q->index = query_index;
    q->ctx_id = ctx->ctx_id;
@@ -7666,6 +10689,13 @@ int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
 
    glGenQueries(1, &q->id);
 
+   if (vrend_state.use_qbo) {
+      glGenBuffers(1, &q->qbo);
+      vrend_bind_buffer(GL_QUERY_BUFFER, q->qbo);
+      glBufferData(GL_QUERY_BUFFER, sizeof(uint64_t), NULL, GL_STREAM_READ);
+      vrend_bind_buffer(GL_QUERY_BUFFER, 0);
+   }
+
    ret_handle = vrend_renderer_object_insert(ctx, q, sizeof(struct vrend_query), handle,
                                              VIRGL_OBJECT_QUERY);
    if (!ret_handle) {
@@ -7679,7 +10709,15 @@ static void vrend_destroy_query(struct vrend_query *query)
 {
    vrend_resource_reference(&query->res, NULL);
    list_del(&query->waiting_queries);
+   list_del(&query->active);
    glDeleteQueries(1, &query->id);
+   if (query->num_segments)
+      glDeleteQueries(query->num_segments, query->segments);
+   free(query->segments);
+   if (query->qbo_sync)
+      glDeleteSync(query->qbo_sync);
+   if (query->qbo)
+      vrend_delete_buffers(1, &query->qbo);
    free(query);
 }
 
@@ -7689,6 +10727,31 @@ static void vrend_destroy_query_object(void *obj_ptr)
    vrend_destroy_query(query);
 }
 
+static void vrend_query_gl_begin(struct vrend_query *q)
+{
+   if (q->index > 0)
+      glBeginQueryIndexed(q->gltype, q->index, q->id);
+   else
+      glBeginQuery(q->gltype, q->id);
+}
+
+static void vrend_query_gl_end(struct vrend_query *q)
+{
+   if (q->index > 0)
+      glEndQueryIndexed(q->gltype, q->index);
+   else
+      glEndQuery(q->gltype);
+}
+
+static void vrend_query_drop_segments(struct vrend_query *q)
+{
+   if (!q->num_segments)
+      return;
+
+   glDeleteQueries(q->num_segments, q->segments);
+   q->num_segments = 0;
+}
+
 int vrend_begin_query(struct vrend_context *ctx, uint32_t handle)
 {
    struct vrend_query *q;
@@ -7700,13 +10763,22 @@ int vrend_begin_query(struct vrend_context *ctx, uint32_t handle)
    if (q->index > 0 && !has_feature(feat_transform_feedback3))
       return EINVAL;
 
+   /* a fetch of the previous result that is still pending would be
+    * reported for this one */
+   if (q->qbo_sync) {
+      glDeleteSync(q->qbo_sync);
+      q->qbo_sync = NULL;
+   }
+   list_delinit(&q->waiting_queries);
+
    if (q->gltype == GL_TIMESTAMP)
       return 0;
 
-   if (q->index > 0)
-      glBeginQueryIndexed(q->gltype, q->index, q->id);
-   else
-      glBeginQuery(q->gltype, q->id);
+   vrend_query_drop_segments(q);
+   list_del(&q->active);
+   list_addtail(&q->active, &ctx->sub->active_queries);
+
+   vrend_query_gl_begin(q);
    return 0;
 }
 
@@ -7720,6 +10792,8 @@ int vrend_end_query(struct vrend_context *ctx, uint32_t handle)
    if (q->index > 0 && !has_feature(feat_transform_feedback3))
       return EINVAL;
 
+   list_delinit(&q->active);
+
    if (vrend_is_timer_query(q->gltype)) {
       if (vrend_state.use_gles && q->gltype == GL_TIMESTAMP) {
          report_gles_warn(ctx, GLES_WARN_TIMESTAMP, 0);
@@ -7732,13 +10806,24 @@ int vrend_end_query(struct vrend_context *ctx, uint32_t handle)
       return 0;
    }
 
-   if (q->index > 0)
-      glEndQueryIndexed(q->gltype, q->index);
-   else
-      glEndQuery(q->gltype);
+   vrend_query_gl_end(q);
    return 0;
 }
 
+/* keep the waiting queries of a context next to each other */
+static void vrend_query_wait(struct vrend_query *query)
+{
+   struct vrend_query *iter;
+
+   LIST_FOR_EACH_ENTRY(iter, &vrend_state.waiting_query_list, waiting_queries) {
+      if (iter->ctx_id == query->ctx_id) {
+         list_addtail(&query->waiting_queries, &iter->waiting_queries);
+         return;
+      }
+   }
+   list_addtail(&query->waiting_queries, &vrend_state.waiting_query_list);
+}
+
 void vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
                             UNUSED uint32_t wait)
 {
@@ -7749,29 +10834,71 @@ void vrend_get_query_result(struct vrend_context *ctx, uint32_t handle,
    if (!q)
       return;
 
-   ret = vrend_check_query(q);
+   if (!LIST_IS_EMPTY(&q->waiting_queries))
+      return;
+
+   /* the query buffer only gets the last segment */
+   if (q->qbo && !q->num_segments) {
+      vrend_query_qbo_fetch(q);
+      ret = false;
+   } else
+      ret = vrend_check_query(q);
+
    if (ret == false)
-      list_addtail(&q->waiting_queries, &vrend_state.waiting_query_list);
+      vrend_query_wait(q);
 }
 
-static void vrend_pause_render_condition(struct vrend_context *ctx, bool pause)
+static void vrend_sub_pause_render_condition(struct vrend_sub_context *sub, bool pause)
 {
    if (pause) {
-      if (ctx->sub->cond_render_q_id) {
+      if (sub->cond_render_q_id) {
          if (has_feature(feat_gl_conditional_render))
             glEndConditionalRender();
          else if (has_feature(feat_nv_conditional_render))
             glEndConditionalRenderNV();
       }
    } else {
-      if (ctx->sub->cond_render_q_id) {
+      if (sub->cond_render_q_id) {
          if (has_feature(feat_gl_conditional_render))
-            glBeginConditionalRender(ctx->sub->cond_render_q_id,
-                                     ctx->sub->cond_render_gl_mode);
+            glBeginConditionalRender(sub->cond_render_q_id,
+                                     sub->cond_render_gl_mode);
          else if (has_feature(feat_nv_conditional_render))
-            glBeginConditionalRenderNV(ctx->sub->cond_render_q_id,
-                                       ctx->sub->cond_render_gl_mode);
+            glBeginConditionalRenderNV(sub->cond_render_q_id,
+                                       sub->cond_render_gl_mode);
+      }
+   }
+}
+
+static void vrend_pause_render_condition(struct vrend_context *ctx, bool pause)
+{
+   vrend_sub_pause_render_condition(ctx->sub, pause);
+}
+
+/* transform feedback is paused after each draw, but queries count
+ * whatever is drawn while they are active, so they are ended into a
+ * segment and begun again with a fresh id */
+static void vrend_sub_pause_queries(struct vrend_sub_context *sub, bool pause)
+{
+   struct vrend_query *q;
+   GLuint *segments;
+   unsigned max;
+
+   LIST_FOR_EACH_ENTRY(q, &sub->active_queries, active) {
+      if (!pause) {
+         vrend_query_gl_begin(q);
+         continue;
+      }
+      vrend_query_gl_end(q);
+      if (q->num_segments == q->max_segments) {
+         max = MAX2(q->max_segments * 2, 4);
+         segments = realloc(q->segments, max * sizeof(GLuint));
+         if (!segments)
+            continue;
+         q->segments = segments;
+         q->max_segments = max;
       }
+      q->segments[q->num_segments++] = q->id;
+      glGenQueries(1, &q->id);
    }
 }
 
@@ -7834,11 +10961,13 @@ int vrend_create_so_target(struct vrend_context *ctx,
    struct vrend_resource *res;
    int ret_handle;
    res = vrend_renderer_ctx_res_lookup(ctx, res_handle);
-   if (!res) {
+   if (!res || vrend_resource_use(res)) {
       report_context_error(ctx, VIRGL_ERROR_CTX_ILLEGAL_RESOURCE, res_handle);
       return EINVAL;
    }
 
+   vrend_resource_pin(res);
+   vrend_resource_drop_shadow(res, true);
    target = CALLOC_STRUCT(vrend_so_target);
    if (!target)
       return ENOMEM;
@@ -8125,7 +11254,7 @@ static void vrend_renderer_fill_caps_v1(int gl_ver, int gles_ver, union virgl_ca
       uint32_t offset = i / 32;
       uint32_t index = i % 32;
 
-      if (tex_conv_table[i].internalformat != 0) {
+      if (vrend_state.tex_conv_table[i].internalformat != 0) {
          if (vrend_format_can_sample(i)) {
             caps->v1.sampler.bitmask[offset] |= (1 << index);
             if (vrend_format_can_render(i))
@@ -8382,6 +11511,10 @@ void *vrend_renderer_get_cursor_contents(uint32_t res_handle, uint32_t *width, u
    if (res->base.width0 > 128 || res->base.height0 > 128)
       return NULL;
 
+   vrend_resource_wait_upload(res);
+   if (vrend_resource_make_resident(res))
+      return NULL;
+
    if (res->target != GL_TEXTURE_2D)
       return NULL;
 
@@ -8389,8 +11522,8 @@ void *vrend_renderer_get_cursor_contents(uint32_t res_handle, uint32_t *width, u
       *width = res->base.width0;
    if (height)
       *height = res->base.height0;
-   format = tex_conv_table[res->base.format].glformat;
-   type = tex_conv_table[res->base.format].gltype;
+   format = vrend_state.tex_conv_table[res->base.format].glformat;
+   type = vrend_state.tex_conv_table[res->base.format].gltype;
    blsize = util_format_get_blocksize(res->base.format);
    size = util_format_get_nblocks(res->base.format, res->base.width0, res->base.height0) * blsize;
    data = malloc(size);
@@ -8408,22 +11541,11 @@ void *vrend_renderer_get_cursor_contents(uint32_t res_handle, uint32_t *width, u
    } else if (vrend_state.use_gles) {
       GLuint fb_id;
 
-      if (res->readback_fb_id == 0 || res->readback_fb_level != 0 || res->readback_fb_z != 0) {
-
-         if (res->readback_fb_id)
-            glDeleteFramebuffers(1, &res->readback_fb_id);
-
-         glGenFramebuffers(1, &fb_id);
-         glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb_id);
-
-         vrend_fb_bind_texture(res, 0, 0, 0);
-
-         res->readback_fb_id = fb_id;
-         res->readback_fb_level = 0;
-         res->readback_fb_z = 0;
-      } else {
-         glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, res->readback_fb_id);
-      }
+      /* no sub context here, so use a throwaway FBO in whatever context
+       * is current */
+      glGenFramebuffers(1, &fb_id);
+      glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fb_id);
+      vrend_fb_bind_texture(res, 0, 0, 0);
 
       if (has_feature(feat_arb_robustness)) {
          glReadnPixelsARB(0, 0, *width, *height, format, type, size, data);
@@ -8432,7 +11554,7 @@ void *vrend_renderer_get_cursor_contents(uint32_t res_handle, uint32_t *width, u
       } else {
          glReadPixels(0, 0, *width, *height, format, type, data);
       }
-
+      glDeleteFramebuffers(1, &fb_id);
    } else {
       glBindTexture(res->target, res->id);
       glGetTexImage(res->target, 0, format, type, data);
@@ -8455,7 +11577,17 @@ void vrend_renderer_force_ctx_0(void)
    vrend_state.current_ctx = NULL;
    vrend_state.current_hw_ctx = NULL;
    vrend_hw_switch_context(ctx0, true);
-   vrend_clicbs->make_current(0, ctx0->sub->gl_context);
+   vrend_make_current(ctx0->sub);
+}
+
+/* lets another thread make the contexts of the renderer current */
+void vrend_renderer_release_current(void)
+{
+   vrend_state.current_ctx = NULL;
+   vrend_state.current_hw_ctx = NULL;
+   vrend_state.gl_shadow = NULL;
+   vrend_state.virtual_ctx_current = false;
+   vrend_clicbs->make_current(0, NULL);
 }
 
 void vrend_renderer_get_rect(int res_handle, struct iovec *iov, unsigned int num_iovs,
@@ -8498,7 +11630,11 @@ void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id)
    if (!res)
       return;
 
+   if (vrend_object_lookup(ctx->res_hash, resource_id, 1))
+      return;
+
    vrend_object_insert_nofree(ctx->res_hash, res, sizeof(*res), resource_id, 1, false);
+   ctx->res_mem_used += vrend_resource_estimate_size(&res->base);
 }
 
 static void vrend_renderer_detach_res_ctx_p(struct vrend_context *ctx, int res_handle)
@@ -8508,6 +11644,7 @@ static void vrend_renderer_detach_res_ctx_p(struct vrend_context *ctx, int res_h
    if (!res)
       return;
 
+   ctx->res_mem_used -= vrend_resource_estimate_size(&res->base);
    vrend_object_remove(ctx->res_hash, res_handle, 1);
 }
 
@@ -8519,11 +11656,10 @@ void vrend_renderer_detach_res_ctx(int ctx_id, int res_handle)
    vrend_renderer_detach_res_ctx_p(ctx, res_handle);
 }
 
+/* callers that bind or access the storage go through vrend_resource_use */
 struct vrend_resource *vrend_renderer_ctx_res_lookup(struct vrend_context *ctx, int res_handle)
 {
-   struct vrend_resource *res = vrend_object_lookup(ctx->res_hash, res_handle, 1);
-
-   return res;
+   return vrend_object_lookup(ctx->res_hash, res_handle, 1);
 }
 
 int vrend_renderer_resource_get_info(int res_handle,
@@ -8540,6 +11676,14 @@ int vrend_renderer_resource_get_info(int res_handle,
 
    elsize = util_format_get_blocksize(res->base.format);
 
+   /* the GL object is handed out, so it has to stay around */
+   vrend_resource_wait_upload(res);
+   if (vrend_resource_make_resident(res))
+      return ENOMEM;
+   vrend_resource_pin(res);
+   vrend_resource_export(res);
+   vrend_resource_drop_shadow(res, true);
+
    info->handle = res_handle;
    info->tex_id = res->id;
    info->width = res->base.width0;
@@ -8572,10 +11716,120 @@ void vrend_renderer_get_cap_set(uint32_t cap_set, uint32_t *max_ver,
    }
 }
 
+/*
+ * Virtual contexts.
+ *
+ * With VREND_VIRTUAL_CONTEXTS set, the sub contexts share one host GL
+ * context, so switching between them doesn't go through make_current.
+ * The state vrend shadows or caches belongs to the host context and is
+ * handed from one sub context to the next, the rest of the state of the
+ * incoming sub context is emitted again or marked dirty, so that mostly
+ * the differences reach GL. Objects that GL doesn't share between
+ * contexts, like VAOs and framebuffers, all live in the host context.
+ */
+static void vrend_virtual_ctx_suspend(struct vrend_sub_context *sub)
+{
+   struct vrend_virtual_hw *hw = &vrend_state.virtual_hw;
+
+   hw->rs_state = sub->hw_rs_state;
+   hw->blend_state = sub->hw_blend_state;
+   hw->depth_test_enabled = sub->depth_test_enabled;
+   hw->alpha_test_enabled = sub->alpha_test_enabled;
+   hw->stencil_test_enabled = sub->stencil_test_enabled;
+
+   vrend_sub_pause_render_condition(sub, true);
+   vrend_sub_pause_queries(sub, true);
+}
+
+/* the rasterizer state a new GL context starts out with */
+static const struct pipe_rasterizer_state vrend_default_rs_state = {
+   .front_ccw = 1,
+   .multisample = 1,
+   .depth_clip = 1,
+   .line_stipple_pattern = 0xffff,
+   .line_width = 1.0f,
+   .point_size = 1.0f,
+};
+
+static void vrend_virtual_ctx_resume(struct vrend_sub_context *sub)
+{
+   struct vrend_virtual_hw *hw = &vrend_state.virtual_hw;
+   struct vrend_context *ctx = sub->parent;
+   int i;
+
+   sub->hw_rs_state = hw->rs_state;
+   sub->hw_blend_state = hw->blend_state;
+   sub->depth_test_enabled = hw->depth_test_enabled;
+   sub->alpha_test_enabled = hw->alpha_test_enabled;
+   sub->stencil_test_enabled = hw->stencil_test_enabled;
+
+   if (!has_feature(feat_gles31_vertex_attrib_binding))
+      glBindVertexArray(sub->vaoid);
+   vrend_hw_emit_framebuffer_state(ctx);
+
+   /* don't keep what the previous sub context had bound */
+   if (!sub->rs)
+      sub->rs_state = vrend_default_rs_state;
+   vrend_hw_emit_rs(ctx);
+   vrend_hw_emit_dsa(ctx);
+   if (sub->blend)
+      vrend_hw_emit_blend(ctx, &sub->blend_state);
+   else
+      vrend_disable(GL_BLEND);
+   glBlendColor(sub->blend_color.color[0], sub->blend_color.color[1],
+                sub->blend_color.color[2], sub->blend_color.color[3]);
+
+   if (has_feature(feat_sample_mask))
+      glSampleMaski(0, sub->sample_mask);
+   if (has_feature(feat_sample_shading))
+      glMinSampleShading(sub->min_sample_shading);
+   if (has_feature(feat_tessellation) && !vrend_state.use_gles) {
+      glPatchParameterfv(GL_PATCH_DEFAULT_OUTER_LEVEL, sub->tess_factors);
+      glPatchParameterfv(GL_PATCH_DEFAULT_INNER_LEVEL, &sub->tess_factors[4]);
+   }
+   if (!vrend_state.use_core_profile) {
+      vrend_hw_emit_clip_planes(&sub->ucp_state);
+      glPolygonStipple((const GLubyte *)sub->poly_stipple.stipple);
+   }
+
+   /* the rest goes out with the next draw */
+   sub->stencil_state_dirty = true;
+   sub->scissor_state_dirty = (1 << PIPE_MAX_VIEWPORTS) - 1;
+   sub->viewport_state_dirty = (1 << PIPE_MAX_VIEWPORTS) - 1;
+   sub->vbo_dirty = true;
+   sub->sampler_state_dirty = true;
+   sub->image_state_dirty = true;
+   for (i = 0; i < PIPE_SHADER_TYPES; i++)
+      sub->const_dirty[i] = true;
+   vrend_mark_bindings_dirty(sub);
+   sub->state_epoch++;
+
+   if (has_feature(feat_transform_feedback2))
+      glBindTransformFeedback(GL_TRANSFORM_FEEDBACK,
+                              sub->current_so ? sub->current_so->id : 0);
+
+   vrend_sub_pause_queries(sub, false);
+   vrend_sub_pause_render_condition(sub, false);
+}
+
+/* the host context must be current, and sub the current one of its parent */
+static void vrend_virtual_ctx_switch(struct vrend_sub_context *sub)
+{
+   if (vrend_state.virtual_sub == sub || !sub->parent)
+      return;
+
+   if (vrend_state.virtual_sub)
+      vrend_virtual_ctx_suspend(vrend_state.virtual_sub);
+   vrend_state.virtual_sub = sub;
+   vrend_virtual_ctx_resume(sub);
+}
+
 void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
 {
    struct vrend_sub_context *sub;
    struct virgl_gl_ctx_param ctx_params;
+   struct vrend_resource *fbo_attach[PIPE_MAX_COLOR_BUFS + 1] = { NULL };
+   struct vrend_fbo_key fbo_key;
    GLuint i;
 
    LIST_FOR_EACH_ENTRY(sub, &ctx->sub_ctxs, head) {
@@ -8591,8 +11845,13 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    ctx_params.shared = (ctx->ctx_id == 0 && sub_ctx_id == 0) ? false : true;
    ctx_params.major_ver = vrend_state.gl_major_ver;
    ctx_params.minor_ver = vrend_state.gl_minor_ver;
-   sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
-   vrend_clicbs->make_current(0, sub->gl_context);
+   if (!vrend_state.use_virtual_ctx) {
+      sub->gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+   } else if (!vrend_state.virtual_gl_context) {
+      vrend_state.virtual_gl_context = vrend_clicbs->create_gl_context(0, &ctx_params);
+      vrend_state.virtual_ctx_current = false;
+   }
+   vrend_make_current(sub);
 
    /* enable if vrend_renderer_init function has done it as well */
    if (has_feature(feat_debug_cb)) {
@@ -8602,6 +11861,10 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    }
 
    sub->sub_ctx_id = sub_ctx_id;
+   sub->state_epoch = 1;
+   sub->sample_mask = ~0u;
+   for (i = 0; i < ARRAY_SIZE(sub->tess_factors); i++)
+      sub->tess_factors[i] = 1.0f;
 
    /* initialize the depth far_val to 1 */
    for (i = 0; i < PIPE_MAX_VIEWPORTS; i++) {
@@ -8613,11 +11876,15 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
       glBindVertexArray(sub->vaoid);
    }
 
-   glGenFramebuffers(1, &sub->fb_id);
-   glGenFramebuffers(2, sub->blit_fb_ids);
+   /* start out with a framebuffer without attachments */
+   list_inithead(&sub->fbo_cache);
+   memset(&fbo_key, 0, sizeof(fbo_key));
+   sub->fb_id = vrend_fbo_cache_get(sub, fbo_attach, &fbo_key);
 
    list_inithead(&sub->programs);
    list_inithead(&sub->streamout_list);
+   list_inithead(&sub->vao_cache);
+   list_inithead(&sub->active_queries);
 
    sub->object_hash = vrend_object_init_ctx_table();
 
@@ -8625,6 +11892,10 @@ void vrend_renderer_create_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    list_add(&sub->head, &ctx->sub_ctxs);
    if (sub_ctx_id == 0)
       ctx->sub0 = sub;
+
+   sub->parent = ctx;
+   if (vrend_state.use_virtual_ctx)
+      vrend_virtual_ctx_switch(sub);
 }
 
 void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
@@ -8644,7 +11915,7 @@ void vrend_renderer_destroy_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    if (tofree) {
       if (ctx->sub == tofree) {
          ctx->sub = ctx->sub0;
-         vrend_clicbs->make_current(0, ctx->sub->gl_context);
+         vrend_make_current(ctx->sub);
       }
       vrend_destroy_sub_context(tofree);
    }
@@ -8661,29 +11932,43 @@ void vrend_renderer_set_sub_ctx(struct vrend_context *ctx, int sub_ctx_id)
    LIST_FOR_EACH_ENTRY(sub, &ctx->sub_ctxs, head) {
       if (sub->sub_ctx_id == sub_ctx_id) {
          ctx->sub = sub;
-         vrend_clicbs->make_current(0, sub->gl_context);
+         vrend_make_current(sub);
          break;
       }
    }
 }
 
+/* the sync thread must be stopped */
 static void vrend_reset_fences(void)
 {
+   struct vrend_fence_timeline *timeline, *tmp;
    struct vrend_fence *fence, *stor;
 
-   if (vrend_state.sync_thread)
-      pipe_mutex_lock(vrend_state.fence_mutex);
-
-   LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &vrend_state.fence_list, fences) {
-      free_fence_locked(fence);
+   while ((fence = vrend_fence_queue_pop(&vrend_state.fence_submit))) {
+      glDeleteSync(fence->syncobj);
+      free(fence);
+   }
+   while ((fence = vrend_fence_queue_pop(&vrend_state.fence_done)))
+      free(fence);
+   while ((fence = vrend_state.fence_pool)) {
+      vrend_state.fence_pool = fence->next;
+      free(fence);
    }
 
-   if (vrend_state.sync_thread)
-      pipe_mutex_unlock(vrend_state.fence_mutex);
+   LIST_FOR_EACH_ENTRY_SAFE(timeline, tmp, &vrend_state.fence_timelines, head) {
+      LIST_FOR_EACH_ENTRY_SAFE(fence, stor, &timeline->pending, fences) {
+         glDeleteSync(fence->syncobj);
+         free(fence);
+      }
+      list_del(&timeline->head);
+      FREE(timeline);
+   }
+   list_inithead(&vrend_state.fence_active);
 }
 
 void vrend_renderer_reset(void)
 {
+   vrend_renderer_upload_sync();
    if (vrend_state.sync_thread) {
       vrend_free_sync_thread();
       vrend_state.stop_sync_thread = false;
@@ -8704,3 +11989,16 @@ int vrend_renderer_get_poll_fd(void)
 
    return vrend_state.eventfd;
 }
+
+/* for fences that are reported on a later poll than the one that found
+ * them, after the poll fd was drained */
+void vrend_renderer_signal_poll_fd(void)
+{
+#ifdef HAVE_EVENTFD
+   uint64_t value = 1;
+
+   if (vrend_state.eventfd != -1 &&
+       write_full(vrend_state.eventfd, &value, sizeof(value)) != sizeof(value))
+      perror("failed to write to eventfd\n");
+#endif
+}
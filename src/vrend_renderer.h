@@ -27,6 +27,7 @@
 
 #include "pipe/p_state.h"
 #include "util/u_inlines.h"
+#include "util/u_double_list.h"
 #include "virgl_protocol.h"
 #include "vrend_iov.h"
 #include "virgl_hw.h"
@@ -49,18 +50,42 @@ struct vrend_context;
  */
 #define VR_MAX_TEXTURE_2D_LEVELS 15
 
+struct vrend_buffer_slab;
+
 struct vrend_resource {
    struct pipe_resource base;
    GLuint id;
    GLenum target;
-   /* fb id if we need to readback this resource */
-   GLuint readback_fb_id;
-   GLuint readback_fb_level;
-   GLuint readback_fb_z;
 
    GLuint tbo_tex_id;/* tbos have two ids to track */
    bool y_0_top;
    bool is_buffer;
+   bool egl_image;
+
+   /* small buffers live in a shared GL buffer at buffer_offset */
+   struct vrend_buffer_slab *slab;
+   uint32_t buffer_offset;
+
+   /* memory accounting, see vrend_resource_pin */
+   struct list_head lru;
+   bool lru_used;
+   uint64_t gl_size;
+   /* levels uploaded from the iov, and the region written in each */
+   uint32_t iov_level_mask;
+   struct pipe_box *iov_written;
+   bool pinned;
+   /* no GL storage yet, or it was evicted; allocated on next use */
+   bool deferred;
+   /* gl_size isn't counted in the memory in use */
+   bool evicted;
+   /* transfers still queued on the upload thread */
+   uint32_t upload_jobs;
+   /* the GL object is used outside of the renderer */
+   bool exported;
+
+   /* CPU copy of a small buffer read as a constant vertex attribute */
+   char *shadow;
+   bool no_shadow;
 
    GLuint handle;
 
@@ -102,9 +127,51 @@ struct vrend_if_cbs {
    virgl_gl_context (*create_gl_context)(int scanout, struct virgl_gl_ctx_param *params);
    void (*destroy_gl_context)(virgl_gl_context ctx);
    int (*make_current)(int scanout, virgl_gl_context ctx);
+
+   void (*write_context_fence)(uint32_t ctx_id, uint32_t fence_id);
 };
 
 #define VREND_USE_THREAD_SYNC 1
+#define VREND_USE_CTX_FENCES 2
+
+#define VREND_MAX_CTX 64
+
+struct vrend_decode_ctx;
+struct vrend_blitter_ctx;
+struct util_hash_table;
+struct virgl_renderer_callbacks;
+struct virgl_egl;
+struct virgl_glx;
+struct virgl_render_thread;
+
+/* Everything a renderer keeps between calls. Each thread works on its own
+ * current instance, so independent renderers can run in parallel on
+ * separate threads of one process. Threads started by the renderer adopt
+ * the instance of the thread that started them.
+ */
+struct vrend_instance {
+   struct vrend_if_cbs *clicbs;
+
+   /* vrend_decode.c */
+   struct vrend_decode_ctx *dec_ctx[VREND_MAX_CTX];
+   /* vrend_object.c */
+   struct vrend_object_table *res_hash;
+   /* vrend_blitter.c */
+   struct vrend_blitter_ctx *blit_ctx;
+
+   /* virglrenderer.c */
+   int use_context;
+   struct virgl_egl *egl_info;
+   struct virgl_glx *glx_info;
+   struct virgl_renderer_callbacks *rcbs;
+   void *dev_cookie;
+   struct virgl_render_thread *render_thread;
+};
+
+extern __thread struct vrend_instance *vrend_instance;
+
+int vrend_renderer_create_instance(void);
+void vrend_renderer_destroy_instance(void);
 
 int vrend_renderer_init(struct vrend_if_cbs *cbs, uint32_t flags);
 
@@ -129,9 +196,23 @@ void vrend_clear(struct vrend_context *ctx,
                  const union pipe_color_union *color,
                  double depth, unsigned stencil);
 
+/* consecutive draws that only differ in the range they draw, issued
+ * together after a single state validation */
+#define VREND_MAX_BATCHED_DRAWS 64
+
+struct vrend_draw_batch {
+   GLsizei num_draws;
+   GLint starts[VREND_MAX_BATCHED_DRAWS];
+   GLsizei counts[VREND_MAX_BATCHED_DRAWS];
+   GLint index_biases[VREND_MAX_BATCHED_DRAWS];
+   /* index buffer offset of each draw, in bytes */
+   uint32_t ib_offsets[VREND_MAX_BATCHED_DRAWS];
+};
+
 int vrend_draw_vbo(struct vrend_context *ctx,
                    const struct pipe_draw_info *info,
-                   uint32_t cso, uint32_t indirect_handle, uint32_t indirect_draw_count_handle);
+                   uint32_t cso, uint32_t indirect_handle, uint32_t indirect_draw_count_handle,
+                   const struct vrend_draw_batch *batch);
 
 void vrend_set_framebuffer_state(struct vrend_context *ctx,
                                  uint32_t nr_cbufs, uint32_t surf_handle[PIPE_MAX_COLOR_BUFS],
@@ -142,6 +223,7 @@ bool vrend_destroy_context(struct vrend_context *ctx);
 int vrend_renderer_context_create(uint32_t handle, uint32_t nlen, const char *name);
 void vrend_renderer_context_create_internal(uint32_t handle, uint32_t nlen, const char *name);
 void vrend_renderer_context_destroy(uint32_t handle);
+void vrend_renderer_destroy_fence_timeline(uint32_t ctx_id);
 
 struct vrend_renderer_resource_create_args {
    uint32_t handle;
@@ -232,6 +314,10 @@ void vrend_set_index_buffer(struct vrend_context *ctx,
                             uint32_t res_handle,
                             uint32_t index_size,
                             uint32_t offset);
+bool vrend_get_index_buffer(struct vrend_context *ctx,
+                            uint32_t *res_handle,
+                            uint32_t *index_size,
+                            uint32_t *offset);
 void vrend_set_single_image_view(struct vrend_context *ctx,
                                  uint32_t shader_type,
                                  int index,
@@ -311,6 +397,8 @@ void vrend_renderer_check_queries(void);
 bool vrend_hw_switch_context(struct vrend_context *ctx, bool now);
 uint32_t vrend_renderer_object_insert(struct vrend_context *ctx, void *data,
                                       uint32_t size, uint32_t handle, enum virgl_object_type type);
+uint32_t vrend_renderer_state_insert(struct vrend_context *ctx, void *data,
+                                     uint32_t size, uint32_t handle, enum virgl_object_type type);
 void vrend_renderer_object_destroy(struct vrend_context *ctx, uint32_t handle);
 
 int vrend_create_query(struct vrend_context *ctx, uint32_t handle,
@@ -358,12 +446,21 @@ vrend_resource_reference(struct vrend_resource **ptr, struct vrend_resource *tex
 }
 
 void vrend_renderer_force_ctx_0(void);
+void vrend_renderer_release_current(void);
+
+/* wait for the transfers queued on the upload thread */
+void vrend_renderer_upload_sync(void);
+/* have the current context wait for uploads newer than serial */
+void vrend_renderer_upload_wait(uint32_t *serial);
 
 void vrend_renderer_get_rect(int resource_id, struct iovec *iov, unsigned int num_iovs,
                              uint32_t offset, int x, int y, int width, int height);
 void vrend_renderer_attach_res_ctx(int ctx_id, int resource_id);
 void vrend_renderer_detach_res_ctx(int ctx_id, int resource_id);
 
+void vrend_renderer_set_mem_budget(uint64_t budget);
+int vrend_renderer_get_mem_usage(int ctx_id, uint64_t *ctx_bytes, uint64_t *total_bytes);
+
 struct vrend_renderer_resource_info {
    uint32_t handle;
    uint32_t format;
@@ -398,6 +495,9 @@ boolean format_is_copy_compatible(enum pipe_format src, enum pipe_format dst,
                                   boolean allow_compressed);
 
 /* blitter interface */
+void vrend_bind_buffer(GLenum target, GLuint id);
+void vrend_delete_buffers(GLsizei n, const GLuint *ids);
+void vrend_use_program(struct vrend_context *ctx, GLuint program_id);
 void vrend_renderer_blit_gl(struct vrend_context *ctx,
                             struct vrend_resource *src_res,
                             struct vrend_resource *dst_res,
@@ -407,6 +507,7 @@ void vrend_blitter_fini(void);
 
 void vrend_renderer_reset(void);
 int vrend_renderer_get_poll_fd(void);
+void vrend_renderer_signal_poll_fd(void);
 void vrend_decode_reset(bool ctx_0_only);
 
 unsigned vrend_renderer_query_multisample_caps(unsigned max_samples,
@@ -420,5 +521,5 @@ struct gl_version {
 static const struct gl_version gl_versions[] = { {4,5}, {4,4}, {4,3}, {4,2}, {4,1}, {4,0},
                                                  {3,3}, {3,2}, {3,1}, {3,0} };
 
-extern struct vrend_if_cbs *vrend_clicbs;
+#define vrend_clicbs (vrend_instance->clicbs)
 #endif
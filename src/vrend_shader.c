@@ -168,6 +168,7 @@ struct dump_ctx {
    uint32_t num_sampler_arrays;
 
    int num_consts;
+   bool const_ubo;
    int num_imm;
    struct immed imm[MAX_IMMEDIATE];
    unsigned fragcoord_input;
@@ -4827,7 +4828,11 @@ static char *emit_ios(struct dump_ctx *ctx, char *glsl_hdr)
    }
    if (ctx->num_consts) {
       const char *cname = tgsi_proc_to_prefix(ctx->prog_type);
-      snprintf(buf, 255, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
+      if (ctx->const_ubo)
+         snprintf(buf, 255, "layout(std140) uniform %sconstbuf { uvec4 %sconst0[%d]; };\n",
+                  cname, cname, ctx->num_consts);
+      else
+         snprintf(buf, 255, "uniform uvec4 %sconst0[%d];\n", cname, ctx->num_consts);
       STRCAT_WITH_RET(glsl_hdr, buf);
    }
 
@@ -5066,6 +5071,14 @@ char *vrend_convert_shader(struct vrend_shader_cfg *cfg,
    if (bret == FALSE)
       goto fail;
 
+   /* the constant block takes one of the uniform blocks of the stage */
+   ctx.const_ubo = ctx.num_consts && cfg->max_const_ubo_size &&
+                   (cfg->use_gles || cfg->glsl_version >= 140) &&
+                   (uint32_t)ctx.num_consts * 16 <= cfg->max_const_ubo_size &&
+                   ctx.num_ubo < cfg->max_uniform_blocks;
+   if (ctx.const_ubo)
+      require_glsl_ver(&ctx, 140);
+
    glsl_hdr = malloc(1024);
    if (!glsl_hdr)
       goto fail;
@@ -5104,6 +5117,7 @@ char *vrend_convert_shader(struct vrend_shader_cfg *cfg,
    sinfo->samplers_used_mask = ctx.samplers_used;
    sinfo->images_used_mask = ctx.images_used_mask;
    sinfo->num_consts = ctx.num_consts;
+   sinfo->const_ubo = ctx.const_ubo;
    sinfo->num_ubos = ctx.num_ubo;
    memcpy(sinfo->ubo_idx, ctx.ubo_idx, ctx.num_ubo * sizeof(*ctx.ubo_idx));
 
@@ -46,6 +46,7 @@ struct vrend_shader_info {
    uint32_t images_used_mask;
    uint32_t ssbo_used_mask;
    int num_consts;
+   bool const_ubo;
    int num_inputs;
    int num_interps;
    int num_outputs;
@@ -109,6 +110,10 @@ struct vrend_shader_cfg {
    bool use_gles;
    bool use_core_profile;
    bool use_explicit_locations;
+   /* largest constant file emitted as a uniform block, 0 to always use
+    * plain uniforms */
+   uint32_t max_const_ubo_size;
+   int max_uniform_blocks;
 };
 
 bool vrend_patch_vertex_shader_interpolants(struct vrend_shader_cfg *cfg,
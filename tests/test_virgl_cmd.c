@@ -1014,6 +1014,187 @@ START_TEST(virgl_test_large_shader)
 }
 END_TEST
 
+/* the vertex shader constants change with every draw and wrap the constant
+ * ring, the fragment shader keeps the ones it got before the first draw */
+START_TEST(virgl_test_render_const_ring_wrap)
+{
+   struct virgl_context ctx;
+   struct virgl_resource res;
+   struct virgl_resource vbo;
+   struct virgl_surface surf;
+   struct pipe_framebuffer_state fb_state;
+   struct pipe_vertex_element ve[2];
+   struct pipe_vertex_buffer vbuf;
+   struct pipe_blend_state blend;
+   struct pipe_depth_stencil_alpha_state dsa;
+   struct pipe_rasterizer_state rasterizer;
+   struct pipe_viewport_state vp;
+   struct pipe_shader_state vs, fs;
+   struct pipe_draw_info info;
+   union pipe_color_union color;
+   struct virgl_box box;
+   const int num_vs_consts = 512;
+   uint32_t *vs_consts;
+   float red[4] = { 1.0f, 0.0f, 0.0f, 1.0f };
+   int ctx_handle = 1;
+   int tw = 64, th = 64;
+   uint32_t *ptr;
+   int handle, i, ret;
+   const char *vs_text =
+      "VERT\n"
+      "DCL IN[0]\n"
+      "DCL IN[1]\n"
+      "DCL OUT[0], POSITION\n"
+      "DCL OUT[1], COLOR\n"
+      "DCL CONST[0..511]\n"
+      "  0: MOV OUT[1], IN[1]\n"
+      "  1: ADD OUT[0], IN[0], CONST[511]\n"
+      "  2: END\n";
+   const char *fs_text =
+      "FRAG\n"
+      "DCL IN[0], COLOR, LINEAR\n"
+      "DCL OUT[0], COLOR\n"
+      "DCL CONST[0]\n"
+      "  0: MOV OUT[0], CONST[0]\n"
+      "  1: END\n";
+
+   ret = testvirgl_init_ctx_cmdbuf(&ctx);
+   ck_assert_int_eq(ret, 0);
+
+   ret = testvirgl_create_backed_simple_2d_res(&res, 1, tw, th);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, res.handle);
+
+   memset(&surf, 0, sizeof(surf));
+   surf.base.format = PIPE_FORMAT_B8G8R8X8_UNORM;
+   surf.handle = ctx_handle++;
+   surf.base.texture = &res.base;
+   virgl_encoder_create_surface(&ctx, surf.handle, &res, &surf.base);
+
+   fb_state.nr_cbufs = 1;
+   fb_state.zsbuf = NULL;
+   fb_state.cbufs[0] = &surf.base;
+   virgl_encoder_set_framebuffer_state(&ctx, &fb_state);
+
+   color.f[0] = 0.0;
+   color.f[1] = 1.0;
+   color.f[2] = 0.0;
+   color.f[3] = 1.0;
+   virgl_encode_clear(&ctx, PIPE_CLEAR_COLOR0, &color, 0.0, 0);
+
+   handle = ctx_handle++;
+   memset(ve, 0, sizeof(ve));
+   ve[0].src_offset = Offset(struct vertex, position);
+   ve[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   ve[1].src_offset = Offset(struct vertex, color);
+   ve[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+   virgl_encoder_create_vertex_elements(&ctx, handle, 2, ve);
+   virgl_encode_bind_object(&ctx, handle, VIRGL_OBJECT_VERTEX_ELEMENTS);
+
+   ret = testvirgl_create_backed_simple_buffer(&vbo, 2, sizeof(vertices), PIPE_BIND_VERTEX_BUFFER);
+   ck_assert_int_eq(ret, 0);
+   virgl_renderer_ctx_attach_resource(ctx.ctx_id, vbo.handle);
+
+   box.x = 0;
+   box.y = 0;
+   box.z = 0;
+   box.w = sizeof(vertices);
+   box.h = 1;
+   box.d = 1;
+   virgl_encoder_inline_write(&ctx, &vbo, 0, 0, (struct pipe_box *)&box, &vertices, box.w, 0);
+
+   vbuf.stride = sizeof(struct vertex);
+   vbuf.buffer_offset = 0;
+   vbuf.buffer = &vbo.base;
+   virgl_encoder_set_vertex_buffers(&ctx, 1, &vbuf);
+
+   memset(&vs, 0, sizeof(vs));
+   handle = ctx_handle++;
+   virgl_encode_shader_state(&ctx, handle, PIPE_SHADER_VERTEX, &vs, vs_text);
+   virgl_encode_bind_shader(&ctx, handle, PIPE_SHADER_VERTEX);
+
+   memset(&fs, 0, sizeof(fs));
+   handle = ctx_handle++;
+   virgl_encode_shader_state(&ctx, handle, PIPE_SHADER_FRAGMENT, &fs, fs_text);
+   virgl_encode_bind_shader(&ctx, handle, PIPE_SHADER_FRAGMENT);
+
+   memset(&blend, 0, sizeof(blend));
+   blend.rt[0].colormask = PIPE_MASK_RGBA;
+   handle = ctx_handle++;
+   virgl_encode_blend_state(&ctx, handle, &blend);
+   virgl_encode_bind_object(&ctx, handle, VIRGL_OBJECT_BLEND);
+
+   memset(&dsa, 0, sizeof(dsa));
+   handle = ctx_handle++;
+   virgl_encode_dsa_state(&ctx, handle, &dsa);
+   virgl_encode_bind_object(&ctx, handle, VIRGL_OBJECT_DSA);
+
+   memset(&rasterizer, 0, sizeof(rasterizer));
+   rasterizer.cull_face = PIPE_FACE_NONE;
+   rasterizer.half_pixel_center = 1;
+   rasterizer.bottom_edge_rule = 1;
+   rasterizer.depth_clip = 1;
+   handle = ctx_handle++;
+   virgl_encode_rasterizer_state(&ctx, handle, &rasterizer);
+   virgl_encode_bind_object(&ctx, handle, VIRGL_OBJECT_RASTERIZER);
+
+   vp.scale[0] = tw / 2.0f;
+   vp.scale[1] = th / 2.0f;
+   vp.scale[2] = 0.5f;
+   vp.translate[0] = tw / 2.0f;
+   vp.translate[1] = th / 2.0f;
+   vp.translate[2] = 0.5f;
+   virgl_encoder_set_viewport_states(&ctx, 0, 1, &vp);
+
+   virgl_encoder_write_constant_buffer(&ctx, PIPE_SHADER_FRAGMENT, 0, 4, red);
+
+   /* 8 KiB per draw goes round the 1 MiB ring more than once */
+   vs_consts = calloc(num_vs_consts, 4 * sizeof(uint32_t));
+   ck_assert(vs_consts != NULL);
+   memset(&info, 0, sizeof(info));
+   info.count = 3;
+   info.mode = PIPE_PRIM_TRIANGLES;
+   for (i = 0; i < 160; i++) {
+      virgl_encoder_write_constant_buffer(&ctx, PIPE_SHADER_VERTEX, 0,
+                                          num_vs_consts * 4, vs_consts);
+      virgl_encoder_draw_vbo(&ctx, &info);
+   }
+   free(vs_consts);
+
+   virgl_renderer_submit_cmd(ctx.cbuf->buf, ctx.ctx_id, ctx.cbuf->cdw);
+
+   testvirgl_reset_fence();
+   ret = virgl_renderer_create_fence(1, ctx.ctx_id);
+   ck_assert_int_eq(ret, 0);
+   do {
+      virgl_renderer_poll();
+      if (testvirgl_get_last_fence() >= 1)
+         break;
+      nanosleep((struct timespec[]){{0, 50000}}, NULL);
+   } while (1);
+
+   box.x = 0;
+   box.y = 0;
+   box.z = 0;
+   box.w = tw;
+   box.h = th;
+   box.d = 1;
+   ret = virgl_renderer_transfer_read_iov(res.handle, ctx.ctx_id, 0, 0, 0, &box, 0, NULL, 0);
+   ck_assert_int_eq(ret, 0);
+
+   /* the middle of the triangle still has the fragment shader's red */
+   ptr = res.iovs[0].iov_base;
+   ck_assert_int_eq(ptr[(th / 2) * tw + tw / 2] & 0xffffff, 0xff0000);
+
+   virgl_renderer_ctx_detach_resource(ctx.ctx_id, res.handle);
+
+   testvirgl_destroy_backed_res(&vbo);
+   testvirgl_destroy_backed_res(&res);
+
+   testvirgl_fini_ctx_cmdbuf(&ctx);
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -1028,6 +1209,7 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_test_render_simple);
   tcase_add_test(tc_core, virgl_test_render_geom_simple);
   tcase_add_test(tc_core, virgl_test_render_xfb);
+  tcase_add_test(tc_core, virgl_test_render_const_ring_wrap);
 
   suite_add_tcase(s, tc_core);
   return s;
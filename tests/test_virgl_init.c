@@ -30,6 +30,8 @@
 #include <check.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <virglrenderer.h>
 #include <gbm.h>
 #include <sys/uio.h>
@@ -149,6 +151,37 @@ START_TEST(virgl_init_egl_create_ctx_create_bind_res)
 }
 END_TEST
 
+START_TEST(virgl_init_egl_create_ctx_create_bind_res_mem_usage)
+{
+  int ret;
+  struct virgl_renderer_resource_create_args res;
+  uint64_t ctx_bytes, total_bytes;
+
+  testvirgl_init_simple_1d_resource(&res, 1);
+
+  ret = virgl_renderer_resource_create(&res, NULL, 0);
+  ck_assert_int_eq(ret, 0);
+
+  virgl_renderer_ctx_attach_resource(1, res.handle);
+
+  ret = virgl_renderer_get_mem_usage(1, &ctx_bytes, &total_bytes);
+  ck_assert_int_eq(ret, 0);
+  ck_assert(ctx_bytes > 0);
+  ck_assert(total_bytes >= ctx_bytes);
+
+  virgl_renderer_ctx_detach_resource(1, res.handle);
+
+  ret = virgl_renderer_get_mem_usage(1, &ctx_bytes, NULL);
+  ck_assert_int_eq(ret, 0);
+  ck_assert(ctx_bytes == 0);
+
+  ret = virgl_renderer_get_mem_usage(2, &ctx_bytes, NULL);
+  ck_assert_int_eq(ret, EINVAL);
+
+  virgl_renderer_resource_unref(1);
+}
+END_TEST
+
 START_TEST(virgl_init_egl_create_ctx_create_bind_res_illegal_ctx)
 {
   int ret;
@@ -444,6 +477,199 @@ START_TEST(virgl_init_egl_create_ctx_create_attach_res_illegal_res)
 }
 END_TEST
 
+static uint32_t ctx_fences[3];
+static uint32_t global_fence;
+
+static void test_write_fence(void *cookie, uint32_t fence_id)
+{
+  global_fence = fence_id;
+}
+
+static void test_write_context_fence(void *cookie, uint32_t ctx_id, uint32_t fence_id)
+{
+  ck_assert_int_lt(ctx_id, 3);
+  ctx_fences[ctx_id] = fence_id;
+}
+
+START_TEST(virgl_init_egl_ctx_fences)
+{
+  int ret;
+  struct virgl_renderer_callbacks cbs;
+
+  memset(&cbs, 0, sizeof(cbs));
+  cbs.version = 3;
+  cbs.write_fence = test_write_fence;
+  cbs.write_context_fence = test_write_context_fence;
+  ret = virgl_renderer_init(&mystruct, VIRGL_RENDERER_USE_EGL, &cbs);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+  ck_assert_int_eq(ret, 0);
+
+  /* fence ids are per context, context 0 still uses write_fence */
+  memset(ctx_fences, 0, sizeof(ctx_fences));
+  global_fence = 0;
+  ck_assert_int_eq(virgl_renderer_create_fence(1, 1), 0);
+  ck_assert_int_eq(virgl_renderer_create_fence(1, 2), 0);
+  ck_assert_int_eq(virgl_renderer_create_fence(2, 1), 0);
+  ck_assert_int_eq(virgl_renderer_create_fence(7, 0), 0);
+
+  while (ctx_fences[1] != 2 || ctx_fences[2] != 1 || global_fence != 7) {
+    virgl_renderer_poll();
+    nanosleep((struct timespec[]){{0, 50000}}, NULL);
+  }
+  ck_assert_int_eq(ctx_fences[0], 0);
+
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_context_destroy(2);
+  virgl_renderer_cleanup(&mystruct);
+}
+END_TEST
+
+START_TEST(virgl_init_egl_thread_submit)
+{
+  int ret;
+  uint32_t cmd[2];
+  struct virgl_renderer_callbacks cbs;
+
+  memset(&cbs, 0, sizeof(cbs));
+  cbs.version = 1;
+  cbs.write_fence = test_write_fence;
+  ret = virgl_renderer_init(&mystruct, VIRGL_RENDERER_USE_EGL | VIRGL_RENDERER_THREAD_SUBMIT, &cbs);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  ck_assert_int_eq(ret, 0);
+
+  /* the buffer is copied, so it can be reused right away */
+  cmd[0] = VIRGL_CMD0(VIRGL_CCMD_SET_SUB_CTX, 0, 1);
+  cmd[1] = 0;
+  ck_assert_int_eq(virgl_renderer_submit_cmd(cmd, 1, 2), 0);
+  memset(cmd, 0xff, sizeof(cmd));
+
+  global_fence = 0;
+  ck_assert_int_eq(virgl_renderer_create_fence(4, 1), 0);
+  while (global_fence != 4) {
+    virgl_renderer_poll();
+    nanosleep((struct timespec[]){{0, 50000}}, NULL);
+  }
+
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_cleanup(&mystruct);
+}
+END_TEST
+
+START_TEST(virgl_init_egl_virtual_ctx)
+{
+  int ret;
+  uint32_t cmd[6];
+  struct virgl_renderer_callbacks cbs;
+
+  setenv("VREND_VIRTUAL_CONTEXTS", "1", 1);
+  memset(&cbs, 0, sizeof(cbs));
+  cbs.version = 1;
+  cbs.write_fence = test_write_fence;
+  ret = virgl_renderer_init(&mystruct, VIRGL_RENDERER_USE_EGL, &cbs);
+  ck_assert_int_eq(ret, 0);
+
+  ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  ck_assert_int_eq(ret, 0);
+  ret = virgl_renderer_context_create(2, strlen("test2"), "test2");
+  ck_assert_int_eq(ret, 0);
+
+  /* switch between the sub contexts of both */
+  cmd[0] = VIRGL_CMD0(VIRGL_CCMD_CREATE_SUB_CTX, 0, 1);
+  cmd[1] = 1;
+  cmd[2] = VIRGL_CMD0(VIRGL_CCMD_SET_SUB_CTX, 0, 1);
+  cmd[3] = 1;
+  cmd[4] = VIRGL_CMD0(VIRGL_CCMD_SET_SUB_CTX, 0, 1);
+  cmd[5] = 0;
+  ck_assert_int_eq(virgl_renderer_submit_cmd(cmd, 1, 6), 0);
+  ck_assert_int_eq(virgl_renderer_submit_cmd(cmd, 2, 4), 0);
+  ck_assert_int_eq(virgl_renderer_submit_cmd(cmd, 1, 6), 0);
+
+  cmd[0] = VIRGL_CMD0(VIRGL_CCMD_DESTROY_SUB_CTX, 0, 1);
+  cmd[1] = 1;
+  ck_assert_int_eq(virgl_renderer_submit_cmd(cmd, 2, 2), 0);
+
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_context_destroy(2);
+  virgl_renderer_cleanup(&mystruct);
+  unsetenv("VREND_VIRTUAL_CONTEXTS");
+}
+END_TEST
+
+struct thread_renderer {
+  pthread_t thread;
+  uint32_t width;
+  uint32_t fence;
+  int ret;
+};
+
+static void thread_write_fence(void *cookie, uint32_t fence_id)
+{
+  struct thread_renderer *tr = cookie;
+  tr->fence = fence_id;
+}
+
+static void *thread_renderer_run(void *arg)
+{
+  struct thread_renderer *tr = arg;
+  struct virgl_renderer_callbacks cbs;
+  struct virgl_renderer_resource_create_args res;
+  struct virgl_renderer_resource_info info;
+
+  memset(&cbs, 0, sizeof(cbs));
+  cbs.version = 1;
+  cbs.write_fence = thread_write_fence;
+  tr->ret = virgl_renderer_init(tr, VIRGL_RENDERER_USE_EGL, &cbs);
+  if (tr->ret)
+    return NULL;
+
+  /* both renderers use the same context and resource handles */
+  tr->ret = virgl_renderer_context_create(1, strlen("test1"), "test1");
+  if (!tr->ret) {
+    testvirgl_init_simple_2d_resource(&res, 1);
+    res.width = tr->width;
+    tr->ret = virgl_renderer_resource_create(&res, NULL, 0);
+  }
+  if (!tr->ret) {
+    tr->ret = virgl_renderer_resource_get_info(1, &info);
+    if (!tr->ret && info.width != tr->width)
+      tr->ret = -1;
+    virgl_renderer_resource_unref(1);
+  }
+  if (!tr->ret)
+    tr->ret = virgl_renderer_create_fence(3, 0);
+  while (!tr->ret && tr->fence != 3) {
+    virgl_renderer_poll();
+    nanosleep((struct timespec[]){{0, 50000}}, NULL);
+  }
+
+  virgl_renderer_context_destroy(1);
+  virgl_renderer_cleanup(tr);
+  return NULL;
+}
+
+START_TEST(virgl_init_egl_threads)
+{
+  struct thread_renderer tr[2];
+  int i;
+
+  memset(tr, 0, sizeof(tr));
+  for (i = 0; i < 2; i++) {
+    tr[i].width = 50 + i * 20;
+    ck_assert_int_eq(pthread_create(&tr[i].thread, NULL, thread_renderer_run, &tr[i]), 0);
+  }
+  for (i = 0; i < 2; i++) {
+    pthread_join(tr[i].thread, NULL);
+    ck_assert_int_eq(tr[i].ret, 0);
+  }
+}
+END_TEST
+
 static Suite *virgl_init_suite(void)
 {
   Suite *s;
@@ -466,12 +692,17 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_init_get_caps_null);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_attach_res_illegal_res);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res_leak);
+  tcase_add_test(tc_core, virgl_init_egl_ctx_fences);
+  tcase_add_test(tc_core, virgl_init_egl_threads);
+  tcase_add_test(tc_core, virgl_init_egl_thread_submit);
+  tcase_add_test(tc_core, virgl_init_egl_virtual_ctx);
 
   suite_add_tcase(s, tc_core);
 
   tc_core = tcase_create("init_std");
   tcase_add_checked_fixture(tc_core, testvirgl_init_single_ctx_nr, testvirgl_fini_single_ctx);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res);
+  tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res_mem_usage);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res_illegal_ctx);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_bind_res_illegal_res);
   tcase_add_test(tc_core, virgl_init_egl_create_ctx_create_unbind_no_bind);
@@ -320,6 +320,47 @@ START_TEST(virgl_test_transfer_1d)
 }
 END_TEST
 
+/* storage recycled from a destroyed resource must not leak its contents */
+START_TEST(virgl_test_transfer_recycled_res_zeroed)
+{
+    struct virgl_resource res;
+    struct virgl_box box = { .w = 64, .h = 64, .d = 1 };
+    unsigned char *ptr;
+    unsigned i, size;
+    int ret, handle;
+
+    for (handle = 1; handle <= 2; handle++) {
+        if (_i == 0)
+            ret = testvirgl_create_backed_simple_2d_res(&res, handle, box.w, box.h);
+        else {
+            box.w = 128 * 1024;
+            box.h = 1;
+            ret = testvirgl_create_backed_simple_buffer(&res, handle, box.w,
+                                                        VIRGL_BIND_VERTEX_BUFFER);
+        }
+        ck_assert_int_eq(ret, 0);
+        virgl_renderer_ctx_attach_resource(1, res.handle);
+
+        ptr = res.iovs[0].iov_base;
+        size = res.iovs[0].iov_len;
+        if (handle == 1) {
+            memset(ptr, 0xa5, size);
+            ret = virgl_renderer_transfer_write_iov(res.handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+            ck_assert_int_eq(ret, 0);
+        } else {
+            memset(ptr, 0xff, size);
+            ret = virgl_renderer_transfer_read_iov(res.handle, 1, 0, 0, 0, &box, 0, NULL, 0);
+            ck_assert_int_eq(ret, 0);
+            for (i = 0; i < size; i++)
+                ck_assert_int_eq(ptr[i], 0);
+        }
+
+        virgl_renderer_ctx_detach_resource(1, res.handle);
+        testvirgl_destroy_backed_res(&res);
+    }
+}
+END_TEST
+
 START_TEST(virgl_test_transfer_1d_bad_iov)
 {
     struct virgl_renderer_resource_create_args res;
@@ -749,6 +790,7 @@ static Suite *virgl_init_suite(void)
   tcase_add_test(tc_core, virgl_test_transfer_read_1d_array_bad_box);
   tcase_add_test(tc_core, virgl_test_transfer_read_3d_bad_box);
   tcase_add_test(tc_core, virgl_test_transfer_1d);
+  tcase_add_loop_test(tc_core, virgl_test_transfer_recycled_res_zeroed, 0, 2);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_iov);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_iov_offset);
   tcase_add_test(tc_core, virgl_test_transfer_1d_bad_layer_stride);
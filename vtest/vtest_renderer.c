@@ -122,11 +122,10 @@ void *create_renderer(int in_fd, int ctx_id);
 #ifdef ANDROID_JNI
 static void *renderer_thread(void *arg)
 {
-    int fd = *(int*)arg;
-    static int ctx_id = 0;
-    ctx_id++;
+    int fd = (int)(intptr_t)arg;
     printf("renderer thread\n");
-    run_renderer(fd, ctx_id);
+    /* each thread has its own renderer instance */
+    run_renderer(fd, 1);
     return NULL;
 }
 
@@ -168,9 +167,8 @@ JNIEXPORT void JNICALL Java_common_overlay_nativeRun(JNIEnv *env, jclass cls, ji
 //int fd1;
 
   //volatile int fd2 = fd;
-  static int ctx_id;
-      ctx_id++;
-  struct vtest_renderer *r = create_renderer( fd, ctx_id);
+  /* each thread has its own renderer instance */
+  struct vtest_renderer *r = create_renderer( fd, 1);
   r->jni.env = env;
   r->jni.cls = cls;
   r->jni.create = (*env)->GetStaticMethodID(env,cls, "create", "(IIII)Landroid/view/SurfaceView;");
@@ -574,6 +572,9 @@ static int vtest_create_renderer(struct vtest_renderer *r, uint32_t length)
         ctx |= VIRGL_RENDERER_USE_GLES;
     }
 
+    if (getenv("VTEST_RENDER_THREAD"))
+        ctx |= VIRGL_RENDERER_THREAD_SUBMIT;
+
     
     if( !(r->flags & FL_GLX) ) vtest_egl_init(r, false,!!(ctx & VIRGL_RENDERER_USE_GLES));
 #ifdef X11
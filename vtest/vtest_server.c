@@ -22,6 +22,7 @@
  *
  **************************************************************************/
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -110,13 +111,13 @@ int wait_for_socket_accept(int sock)
     return -1;
 }
 #ifndef ANDROID_JNI
+/* every thread runs its own renderer instance, so context ids don't need
+ * to be unique between clients */
 static void *renderer_thread(void *arg)
 {
-    int fd = *(int*)arg;
-    static int ctx_id = 0;
-    ctx_id++;
+    int fd = (int)(intptr_t)arg;
 
-    run_renderer(fd, ctx_id);
+    run_renderer(fd, 1);
     return NULL;
 }
 
@@ -193,10 +194,12 @@ start:
     } else if(threads)
     {
       pthread_t thread;
-//      static int ctx_id;
-//      ctx_id++;
-//      void *d = create_renderer( in_fd, ctx_id);
-      pthread_create(&thread, NULL, renderer_thread, &in_fd);
+
+      /* in_fd is overwritten by the next accept, pass it by value */
+      if (pthread_create(&thread, NULL, renderer_thread, (void *)(intptr_t)in_fd) == 0)
+         pthread_detach(thread);
+      else
+         close(in_fd);
       goto restart;
     } else {
       run_renderer(in_fd, 1);